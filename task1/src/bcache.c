@@ -0,0 +1,338 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bcache.h"
+#include "exit_codes.h"
+#include "trace.h"
+
+static char *bcache_data(struct BlockCache *cache, struct CachedBlock *entry) {
+    return cache->data + (entry - cache->entries) * cache->block_size;
+}
+
+static struct CachedBlock *bcache_find(struct BlockCache *cache, size_t block_idx) {
+    struct CachedBlock *entry = cache->buckets[block_idx % cache->buckets_number];
+    while (entry != NULL && entry->block_idx != block_idx) entry = entry->hash_next;
+    return entry;
+}
+
+static void bcache_unlink(struct BlockCache *cache, struct CachedBlock *entry) {
+    struct CachedBlock **link = &cache->buckets[entry->block_idx % cache->buckets_number];
+    while (*link != entry) link = &(*link)->hash_next;
+    *link = entry->hash_next;
+    entry->valid = 0;
+    entry->dirty = 0;
+}
+
+// Writes the dirty entries back, sorted by block index: every run of adjacent blocks is one request of one batch
+static int bcache_write_back(struct BlockCache *cache, struct Io *io, struct CachedBlock **dirty, size_t dirty_number) {
+    if (dirty_number == 0) return 0;
+    struct iovec *vectors = malloc(sizeof(struct iovec) * dirty_number);
+    struct IoRequest *requests = malloc(sizeof(struct IoRequest) * dirty_number);
+    if (vectors == NULL || requests == NULL) {
+        free(vectors);
+        free(requests);
+        return NO_SPACE;
+    }
+
+    size_t requests_number = 0;
+    for (size_t i = 0; i < dirty_number; i++) {
+        vectors[i].iov_base = bcache_data(cache, dirty[i]);
+        vectors[i].iov_len = cache->block_size;
+        struct IoRequest *last = requests_number > 0 ? &requests[requests_number - 1] : NULL;
+        if (last != NULL && dirty[i]->block_idx == dirty[i - 1]->block_idx + 1 &&
+            last->vectors_number < IO_VECTORS_MAX) {
+            last->vectors_number++;
+            continue;
+        }
+        requests[requests_number].offset = cache->table_offset + dirty[i]->block_idx * cache->block_size;
+        requests[requests_number].vectors = &vectors[i];
+        requests[requests_number].vectors_number = 1;
+        requests_number++;
+    }
+
+    uint64_t started = trace_begin();
+    int res = io_submit(io, requests, requests_number, 1);
+    __atomic_fetch_add(&cache->generation, 1, __ATOMIC_SEQ_CST);
+    for (size_t i = 0; i < requests_number && started != 0; i++) {
+        size_t block_idx = (requests[i].offset - cache->table_offset) / cache->block_size;
+        trace_end(started, TRACE_OP_FILE_WRITE, TRACE_NONE, block_idx, requests[i].offset,
+                  requests[i].vectors_number * cache->block_size);
+    }
+    free(vectors);
+    free(requests);
+    if (res < 0) return res;
+
+    for (size_t i = 0; i < dirty_number; i++) dirty[i]->dirty = 0;
+    stats_count_cache(cache->stats, STATS_CACHE_WRITEBACK, dirty_number);
+    return 0;
+}
+
+// Writes back a dirty block together with the dirty cached blocks around it in the image, in one request.
+// The neighbours stay cached clean, so a large write evicted block by block goes out in long runs
+static int bcache_write_back_cluster(struct BlockCache *cache, struct Io *io, struct CachedBlock *entry) {
+    size_t first = entry->block_idx;
+    size_t last = entry->block_idx;
+    while (last - first + 1 < IO_VECTORS_MAX && first > 0) {
+        struct CachedBlock *neighbour = bcache_find(cache, first - 1);
+        if (neighbour == NULL || !neighbour->dirty) break;
+        first--;
+    }
+    while (last - first + 1 < IO_VECTORS_MAX) {
+        struct CachedBlock *neighbour = bcache_find(cache, last + 1);
+        if (neighbour == NULL || !neighbour->dirty) break;
+        last++;
+    }
+
+    struct CachedBlock **dirty = malloc(sizeof(struct CachedBlock *) * (last - first + 1));
+    if (dirty == NULL) return NO_SPACE;
+    for (size_t block_idx = first; block_idx <= last; block_idx++) {
+        dirty[block_idx - first] = bcache_find(cache, block_idx);
+    }
+    int res = bcache_write_back(cache, io, dirty, last - first + 1);
+    free(dirty);
+    return res;
+}
+
+// Frees an entry for a new block, the first one the clock hand finds unreferenced. A dirty victim is written
+// back first, NULL if that fails
+static struct CachedBlock *bcache_take(struct BlockCache *cache, struct Io *io) {
+    while (1) {
+        struct CachedBlock *entry = &cache->entries[cache->hand];
+        cache->hand = (cache->hand + 1) % cache->capacity;
+        if (!entry->valid) return entry;
+        if (entry->referenced) {
+            entry->referenced = 0;
+            continue;
+        }
+        if (entry->dirty && bcache_write_back_cluster(cache, io, entry) < 0) return NULL;
+        bcache_unlink(cache, entry);
+        stats_count_cache(cache->stats, STATS_CACHE_EVICTION, 1);
+        return entry;
+    }
+}
+
+static void bcache_insert(struct BlockCache *cache, struct CachedBlock *entry, size_t block_idx, int dirty) {
+    entry->block_idx = block_idx;
+    entry->valid = 1;
+    entry->dirty = dirty;
+    entry->referenced = 0;
+    entry->prefetched = 0;
+    struct CachedBlock **bucket = &cache->buckets[block_idx % cache->buckets_number];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+}
+
+// Holds as many blocks as fit into budget bytes, stats gets the hit and miss counts
+int bcache_init(struct BlockCache *cache, size_t budget, size_t block_size, size_t table_offset,
+                struct Stats *stats) {
+    cache->capacity = budget / block_size;
+    cache->block_size = block_size;
+    cache->table_offset = table_offset;
+    cache->buckets_number = cache->capacity > 0 ? cache->capacity : 1;
+    cache->hand = 0;
+    cache->generation = 0;
+    cache->writers = 0;
+    cache->stats = stats;
+    cache->entries = calloc(cache->capacity + 1, sizeof(struct CachedBlock));
+    cache->data = malloc(cache->capacity * block_size + 1);
+    cache->buckets = calloc(cache->buckets_number, sizeof(struct CachedBlock *));
+    pthread_mutex_init(&cache->mutex, NULL);
+    if (cache->entries == NULL || cache->data == NULL || cache->buckets == NULL) {
+        bcache_free(cache);
+        return NO_SPACE;
+    }
+    return 0;
+}
+
+// Drops everything, dirty blocks included, bcache_flush first to keep them
+void bcache_free(struct BlockCache *cache) {
+    free(cache->entries);
+    free(cache->data);
+    free(cache->buckets);
+    cache->entries = NULL;
+    cache->data = NULL;
+    cache->buckets = NULL;
+    cache->capacity = 0;
+    pthread_mutex_destroy(&cache->mutex);
+}
+
+// Copies bytes [begin, end) of the block to buffer if it is cached. Returns 1 on a hit, 0 on a miss
+int bcache_read(struct BlockCache *cache, size_t block_idx, size_t begin, size_t end, char *buffer) {
+    if (cache->capacity == 0) return 0;
+    pthread_mutex_lock(&cache->mutex);
+    struct CachedBlock *entry = bcache_find(cache, block_idx);
+    int prefetched = 0;
+    if (entry != NULL) {
+        memcpy(buffer, bcache_data(cache, entry) + begin, end - begin);
+        entry->referenced = 1;
+        prefetched = entry->prefetched;
+        entry->prefetched = 0;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    stats_count_cache(cache->stats, entry != NULL ? STATS_CACHE_HIT : STATS_CACHE_MISS, 1);
+    if (prefetched) stats_count_cache(cache->stats, STATS_CACHE_PREFETCH_HIT, 1);
+    return entry != NULL;
+}
+
+// Stores bytes [begin, end) of the block in the cache, to be written back later. A block that is not cached is
+// only taken in when written whole. Returns 1 when the cache took the bytes, 0 when the caller has to write them
+int bcache_write(struct BlockCache *cache, struct Io *io, size_t block_idx, size_t begin, size_t end,
+                 const char *buffer) {
+    if (cache->capacity == 0) return 0;
+    pthread_mutex_lock(&cache->mutex);
+    struct CachedBlock *entry = bcache_find(cache, block_idx);
+    if (entry != NULL) {
+        entry->referenced = 1;
+        entry->dirty = 1;
+        entry->prefetched = 0;
+    } else if (begin == 0 && end == cache->block_size) {
+        entry = bcache_take(cache, io);
+        if (entry != NULL) bcache_insert(cache, entry, block_idx, 1);
+    }
+    if (entry != NULL) memcpy(bcache_data(cache, entry) + begin, buffer, end - begin);
+    pthread_mutex_unlock(&cache->mutex);
+    return entry != NULL;
+}
+
+// Caches a whole block just read from the image
+int bcache_fill(struct BlockCache *cache, struct Io *io, size_t block_idx, const char *block) {
+    if (cache->capacity == 0) return 0;
+    pthread_mutex_lock(&cache->mutex);
+    int res = 0;
+    if (bcache_find(cache, block_idx) == NULL) {
+        struct CachedBlock *entry = bcache_take(cache, io);
+        if (entry != NULL) {
+            bcache_insert(cache, entry, block_idx, 0);
+            memcpy(bcache_data(cache, entry), block, cache->block_size);
+        } else {
+            res = WRITE_FAILURE;
+        }
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return res;
+}
+
+// Brackets writes that go to the blocks table around the cache. A block read ahead meanwhile may miss them, so
+// it is not taken in. Begun before the cache is asked to take the bytes, as a block read ahead and taken in
+// after that would not get them
+void bcache_write_begin(struct BlockCache *cache) {
+    if (cache->capacity == 0) return;
+    __atomic_fetch_add(&cache->writers, 1, __ATOMIC_SEQ_CST);
+}
+
+void bcache_write_end(struct BlockCache *cache) {
+    if (cache->capacity == 0) return;
+    __atomic_fetch_add(&cache->generation, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_sub(&cache->writers, 1, __ATOMIC_SEQ_CST);
+}
+
+// Takes the generation to check read ahead blocks against before they are read. Returns 0 when a direct write
+// is running and reading ahead would be wasted
+int bcache_prefetch_begin(struct BlockCache *cache, size_t *generation) {
+    if (cache->capacity == 0) return 0;
+    *generation = __atomic_load_n(&cache->generation, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&cache->writers, __ATOMIC_SEQ_CST) == 0;
+}
+
+// Keeps the blocks that are not cached, in order, returns their number
+size_t bcache_missing(struct BlockCache *cache, size_t *block_idxs, size_t blocks_number) {
+    if (cache->capacity == 0) return 0;
+    size_t missing = 0;
+    pthread_mutex_lock(&cache->mutex);
+    for (size_t i = 0; i < blocks_number; i++) {
+        if (bcache_find(cache, block_idxs[i]) == NULL) block_idxs[missing++] = block_idxs[i];
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return missing;
+}
+
+// Caches blocks read since bcache_prefetch_begin gave generation, one after another in blocks, as long as nothing
+// was written to the blocks table since. Returns the number taken in
+static size_t bcache_fill_since(struct BlockCache *cache, struct Io *io, size_t generation, const size_t *block_idxs,
+                                size_t blocks_number, const char *blocks, int prefetched) {
+    size_t filled = 0;
+    pthread_mutex_lock(&cache->mutex);
+    for (size_t i = 0; i < blocks_number; i++) {
+        if (__atomic_load_n(&cache->generation, __ATOMIC_SEQ_CST) != generation ||
+            __atomic_load_n(&cache->writers, __ATOMIC_SEQ_CST) != 0) {
+            break;
+        }
+        if (bcache_find(cache, block_idxs[i]) != NULL) continue;
+        struct CachedBlock *entry = bcache_take(cache, io);
+        if (entry == NULL) break;
+        bcache_insert(cache, entry, block_idxs[i], 0);
+        entry->prefetched = prefetched;
+        memcpy(bcache_data(cache, entry), blocks + i * cache->block_size, cache->block_size);
+        filled++;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return filled;
+}
+
+// Caches blocks read ahead since bcache_prefetch_begin gave generation. Dropped if anything was written to the
+// blocks table since, they may be stale. They are taken in unreferenced, so the clock hand takes them first
+// unless they get hit
+void bcache_prefetch_fill(struct BlockCache *cache, struct Io *io, size_t generation, const size_t *block_idxs,
+                          size_t blocks_number, const char *blocks) {
+    if (cache->capacity == 0) return;
+    size_t filled = bcache_fill_since(cache, io, generation, block_idxs, blocks_number, blocks, 1);
+    stats_count_cache(cache->stats, STATS_CACHE_PREFETCH, filled);
+}
+
+// Caches a block holding the tails of several files, read since bcache_prefetch_begin gave generation. The other
+// files write their parts of it under their own locks, so like blocks read ahead it is dropped if anything was
+// written to the blocks table since
+void bcache_fill_shared(struct BlockCache *cache, struct Io *io, size_t generation, size_t block_idx,
+                        const char *block) {
+    if (cache->capacity == 0) return;
+    bcache_fill_since(cache, io, generation, &block_idx, 1, block, 0);
+}
+
+// Forgets a block that was freed, unwritten changes are not needed anymore
+void bcache_drop(struct BlockCache *cache, size_t block_idx) {
+    if (cache->capacity == 0) return;
+    pthread_mutex_lock(&cache->mutex);
+    struct CachedBlock *entry = bcache_find(cache, block_idx);
+    if (entry != NULL) bcache_unlink(cache, entry);
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+// Writes back the dirty blocks among [first_block, first_block + blocks_number), before the image is read
+// around the cache
+int bcache_flush_range(struct BlockCache *cache, struct Io *io, size_t first_block, size_t blocks_number) {
+    if (cache->capacity == 0) return 0;
+    struct CachedBlock **dirty = malloc(sizeof(struct CachedBlock *) * (blocks_number + 1));
+    if (dirty == NULL) return NO_SPACE;
+    pthread_mutex_lock(&cache->mutex);
+    size_t dirty_number = 0;
+    for (size_t i = 0; i < blocks_number; i++) {
+        struct CachedBlock *entry = bcache_find(cache, first_block + i);
+        if (entry != NULL && entry->dirty) dirty[dirty_number++] = entry;
+    }
+    int res = bcache_write_back(cache, io, dirty, dirty_number);
+    pthread_mutex_unlock(&cache->mutex);
+    free(dirty);
+    return res;
+}
+
+static int bcache_by_block(const void *a, const void *b) {
+    const struct CachedBlock *first = *(struct CachedBlock *const *) a;
+    const struct CachedBlock *second = *(struct CachedBlock *const *) b;
+    return first->block_idx < second->block_idx ? -1 : first->block_idx > second->block_idx;
+}
+
+int bcache_flush(struct BlockCache *cache, struct Io *io) {
+    if (cache->capacity == 0) return 0;
+    struct CachedBlock **dirty = malloc(sizeof(struct CachedBlock *) * cache->capacity);
+    if (dirty == NULL) return NO_SPACE;
+    pthread_mutex_lock(&cache->mutex);
+    size_t dirty_number = 0;
+    for (size_t i = 0; i < cache->capacity; i++) {
+        if (cache->entries[i].valid && cache->entries[i].dirty) dirty[dirty_number++] = &cache->entries[i];
+    }
+    qsort(dirty, dirty_number, sizeof(struct CachedBlock *), bcache_by_block);
+    int res = bcache_write_back(cache, io, dirty, dirty_number);
+    pthread_mutex_unlock(&cache->mutex);
+    free(dirty);
+    return res;
+}
@@ -0,0 +1,79 @@
+#ifndef TASK1_BCACHE_H
+#define TASK1_BCACHE_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "io.h"
+#include "stats.h"
+
+// Memory for cached block contents, 0 turns the cache off
+#ifndef BLOCK_CACHE_BYTES
+#define BLOCK_CACHE_BYTES (4 * 1024 * 1024)
+#endif
+
+struct CachedBlock {
+    size_t block_idx;
+    int valid;
+    int dirty;
+    // Set on every hit, cleared by the passing clock hand, blocks read once go first
+    int referenced;
+    // Read ahead and not hit yet
+    int prefetched;
+    struct CachedBlock *hash_next;
+};
+
+// Write-back cache of data blocks in front of the blocks table, bounded by a byte budget and evicted in CLOCK order
+struct BlockCache {
+    struct CachedBlock *entries;
+    char *data;
+    size_t capacity;
+    size_t block_size;
+    // Image offset of block 0
+    size_t table_offset;
+    struct CachedBlock **buckets;
+    size_t buckets_number;
+    size_t hand;
+    // Guards everything above including the contents, held while evicted blocks are written back
+    pthread_mutex_t mutex;
+    // Bumped after every write to the blocks table, read ahead blocks are only taken in if it did not move
+    // while they were read and no direct write was running
+    size_t generation;
+    size_t writers;
+
+    struct Stats *stats;
+};
+
+int bcache_init(struct BlockCache *cache, size_t budget, size_t block_size, size_t table_offset,
+                struct Stats *stats);
+
+void bcache_free(struct BlockCache *cache);
+
+int bcache_read(struct BlockCache *cache, size_t block_idx, size_t begin, size_t end, char *buffer);
+
+int bcache_write(struct BlockCache *cache, struct Io *io, size_t block_idx, size_t begin, size_t end,
+                 const char *buffer);
+
+int bcache_fill(struct BlockCache *cache, struct Io *io, size_t block_idx, const char *block);
+
+void bcache_write_begin(struct BlockCache *cache);
+
+void bcache_write_end(struct BlockCache *cache);
+
+int bcache_prefetch_begin(struct BlockCache *cache, size_t *generation);
+
+size_t bcache_missing(struct BlockCache *cache, size_t *block_idxs, size_t blocks_number);
+
+void bcache_prefetch_fill(struct BlockCache *cache, struct Io *io, size_t generation, const size_t *block_idxs,
+                          size_t blocks_number, const char *blocks);
+
+void bcache_fill_shared(struct BlockCache *cache, struct Io *io, size_t generation, size_t block_idx,
+                        const char *block);
+
+void bcache_drop(struct BlockCache *cache, size_t block_idx);
+
+int bcache_flush_range(struct BlockCache *cache, struct Io *io, size_t first_block, size_t blocks_number);
+
+int bcache_flush(struct BlockCache *cache, struct Io *io);
+
+#endif //TASK1_BCACHE_H
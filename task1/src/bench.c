@@ -0,0 +1,355 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fs.h"
+
+#define BENCH_FORMAT_CSV 0
+#define BENCH_FORMAT_JSON 1
+
+// Deepest path and longest path component the sweeps generate
+#define BENCH_PATH_LENGTH 1024
+
+// Bytes written by one size step, the number of files shrinks as they grow
+#define BENCH_SIZE_BUDGET (32 * 1024 * 1024)
+
+// Length of files in the fan-out, depth and fragmentation sweeps
+#define BENCH_SMALL_FILE 16
+#define BENCH_FRAGMENTED_FILE (64 * 1024)
+
+struct Bench {
+    char *image;
+    int engine;
+    int format;
+    int full;
+    size_t rows_number;
+    struct FS fs;
+
+    double *latencies;
+    size_t latencies_number;
+    size_t latencies_capacity;
+
+    // Counters when the measured group of operations started
+    double started;
+    long syscalls;
+    long faults;
+};
+
+static double bench_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Read and write system calls made so far, -1 where /proc/self/io is not available. Reading it costs one
+static long bench_syscalls() {
+    int fd = open("/proc/self/io", O_RDONLY);
+    if (fd < 0) return -1;
+    char text[512];
+    ssize_t length = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (length <= 0) return -1;
+    text[length] = 0;
+
+    char *syscr = strstr(text, "syscr: ");
+    char *syscw = strstr(text, "syscw: ");
+    if (syscr == NULL || syscw == NULL) return -1;
+    return atol(syscr + 7) + atol(syscw + 7);
+}
+
+// Page faults so far, the mmap engine does its I/O through them
+static long bench_faults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+static int bench_open(struct Bench *bench, size_t blocks_number, size_t inodes_number) {
+    struct SuperBlock super_block = init_default_super_block();
+    super_block.blocks_number = blocks_number;
+    super_block.inodes_number = inodes_number;
+    int res = fs_create_engine(&bench->fs, bench->image, bench->engine, &super_block);
+    if (res < 0) fprintf(stderr, "Could not create %s: %d\n", bench->image, res);
+    // Rows name the engine that ran, uring falls back to pread where rings are not allowed
+    if (res >= 0) bench->engine = bench->fs.io.engine;
+    return res;
+}
+
+static void bench_close(struct Bench *bench) {
+    fs_close(&bench->fs);
+    unlink(bench->image);
+}
+
+static void bench_begin(struct Bench *bench) {
+    bench->latencies_number = 0;
+    bench->faults = bench_faults();
+    bench->syscalls = bench_syscalls();
+    bench->started = bench_now();
+}
+
+static void bench_record(struct Bench *bench, double started) {
+    double latency = bench_now() - started;
+    if (bench->latencies_number == bench->latencies_capacity) {
+        size_t capacity = bench->latencies_capacity == 0 ? 1024 : bench->latencies_capacity * 2;
+        double *latencies = realloc(bench->latencies, capacity * sizeof(double));
+        if (latencies == NULL) return;
+        bench->latencies = latencies;
+        bench->latencies_capacity = capacity;
+    }
+    bench->latencies[bench->latencies_number++] = latency;
+}
+
+static int bench_compare(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Reports the operations recorded since bench_begin as one row
+static void bench_end(struct Bench *bench, const char *suite, const char *parameter, size_t value,
+                      const char *operation) {
+    double elapsed = bench_now() - bench->started;
+    long syscalls = bench_syscalls();
+    long faults = bench_faults();
+    size_t ops = bench->latencies_number;
+    if (ops == 0) return;
+
+    qsort(bench->latencies, ops, sizeof(double), bench_compare);
+    double p50 = bench->latencies[(ops - 1) * 50 / 100] * 1e6;
+    double p99 = bench->latencies[(ops - 1) * 99 / 100] * 1e6;
+    double syscalls_per_op = -1;
+    if (syscalls >= 0 && bench->syscalls >= 0) syscalls_per_op = (double) (syscalls - bench->syscalls - 1) / ops;
+    double faults_per_op = (double) (faults - bench->faults) / ops;
+    const char *engine = io_engine_name(bench->engine);
+
+    if (bench->format == BENCH_FORMAT_JSON) {
+        printf("%s{\"engine\": \"%s\", \"suite\": \"%s\", \"parameter\": \"%s\", \"value\": %zu, "
+               "\"op\": \"%s\", \"ops\": %zu, \"ops_per_sec\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+               "\"syscalls_per_op\": %.2f, \"faults_per_op\": %.2f}",
+               bench->rows_number == 0 ? "[\n" : ",\n", engine, suite, parameter, value, operation, ops,
+               ops / elapsed, p50, p99, syscalls_per_op, faults_per_op);
+    } else {
+        if (bench->rows_number == 0) {
+            printf("engine,suite,parameter,value,op,ops,ops_per_sec,p50_us,p99_us,syscalls_per_op,faults_per_op\n");
+        }
+        printf("%s,%s,%s,%zu,%s,%zu,%.1f,%.2f,%.2f,%.2f,%.2f\n", engine, suite, parameter, value, operation, ops,
+               ops / elapsed, p50, p99, syscalls_per_op, faults_per_op);
+    }
+    fflush(stdout);
+    bench->rows_number++;
+}
+
+// Adds, reads, updates and removes files_number files at prefix, reporting each operation
+static int bench_files(struct Bench *bench, const char *suite, const char *parameter, size_t value,
+                       const char *prefix, size_t files_number, size_t content_length) {
+    char *content = malloc(content_length);
+    char *path = malloc(BENCH_PATH_LENGTH);
+    if (content == NULL || path == NULL) {
+        free(content);
+        free(path);
+        return NO_SPACE;
+    }
+    for (size_t i = 0; i < content_length; i++) content[i] = (char) ('a' + i % 26);
+
+    int res = 0;
+    bench_begin(bench);
+    for (size_t i = 0; i < files_number && res >= 0; i++) {
+        snprintf(path, BENCH_PATH_LENGTH, "%sf%zu", prefix, i);
+        double started = bench_now();
+        res = fs_add(&bench->fs, path, content, content_length);
+        bench_record(bench, started);
+    }
+    bench_end(bench, suite, parameter, value, "add");
+
+    bench_begin(bench);
+    for (size_t i = 0; i < files_number && res >= 0; i++) {
+        snprintf(path, BENCH_PATH_LENGTH, "%sf%zu", prefix, i);
+        double started = bench_now();
+        res = fs_read(&bench->fs, path, content, content_length);
+        bench_record(bench, started);
+    }
+    bench_end(bench, suite, parameter, value, "read");
+
+    bench_begin(bench);
+    for (size_t i = 0; i < files_number && res >= 0; i++) {
+        snprintf(path, BENCH_PATH_LENGTH, "%sf%zu", prefix, i);
+        content[0] = (char) ('A' + i % 26);
+        double started = bench_now();
+        res = fs_update(&bench->fs, path, content, content_length);
+        bench_record(bench, started);
+    }
+    bench_end(bench, suite, parameter, value, "update");
+
+    bench_begin(bench);
+    for (size_t i = 0; i < files_number && res >= 0; i++) {
+        snprintf(path, BENCH_PATH_LENGTH, "%sf%zu", prefix, i);
+        double started = bench_now();
+        res = fs_remove(&bench->fs, path);
+        bench_record(bench, started);
+    }
+    bench_end(bench, suite, parameter, value, "remove");
+
+    if (res < 0) fprintf(stderr, "%s %s=%zu failed: %d\n", suite, parameter, value, res);
+    free(content);
+    free(path);
+    return res;
+}
+
+// Blocks taken by files_number files of content_length bytes, with room for their indirect blocks
+static size_t bench_blocks(size_t files_number, size_t content_length) {
+    size_t block_size = init_default_super_block().block_size;
+    size_t blocks = content_length / block_size + 1;
+    return files_number * (blocks + blocks / 64 + 4) + 1024;
+}
+
+static int bench_sizes(struct Bench *bench) {
+    size_t sizes[] = {1, 64, 1024, 4 * 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024};
+    size_t sizes_number = bench->full ? 8 : 6;
+    for (size_t i = 0; i < sizes_number; i++) {
+        size_t files_number = BENCH_SIZE_BUDGET / sizes[i];
+        if (files_number > 1000) files_number = 1000;
+        if (files_number < 4) files_number = 4;
+        if (bench_open(bench, bench_blocks(files_number, sizes[i]), files_number + 16) < 0) return -1;
+        bench_files(bench, "size", "bytes", sizes[i], "/", files_number, sizes[i]);
+        bench_close(bench);
+    }
+    return 0;
+}
+
+static int bench_fanout(struct Bench *bench) {
+    size_t fanouts[] = {1, 10, 100, 1000, 10000};
+    size_t fanouts_number = bench->full ? 5 : 4;
+    for (size_t i = 0; i < fanouts_number; i++) {
+        size_t fanout = fanouts[i];
+        if (bench_open(bench, bench_blocks(fanout, BENCH_SMALL_FILE) + fanout / 8, fanout + 16) < 0) return -1;
+
+        // Listing is measured with the directory full, before bench_files empties it
+        char path[BENCH_PATH_LENGTH];
+        char content[BENCH_SMALL_FILE];
+        memset(content, 'x', sizeof(content));
+        int res = 0;
+        for (size_t j = 0; j < fanout && res >= 0; j++) {
+            snprintf(path, sizeof(path), "/l/f%zu", j);
+            res = fs_add(&bench->fs, path, content, sizeof(content));
+        }
+        size_t listings_number = 100000 / fanout;
+        if (listings_number > 1000) listings_number = 1000;
+        bench_begin(bench);
+        for (size_t j = 0; j < listings_number && res >= 0; j++) {
+            double started = bench_now();
+            res = fs_size(&bench->fs, "/l/");
+            if (res >= 0) {
+                char *listing = malloc(res);
+                res = listing == NULL ? NO_SPACE : fs_read(&bench->fs, "/l/", listing, res);
+                free(listing);
+            }
+            bench_record(bench, started);
+        }
+        bench_end(bench, "fanout", "entries", fanout, "list");
+        if (res >= 0) res = fs_remove(&bench->fs, "/l/");
+        if (res < 0) fprintf(stderr, "fanout entries=%zu listing failed: %d\n", fanout, res);
+
+        bench_files(bench, "fanout", "entries", fanout, "/d/", fanout, BENCH_SMALL_FILE);
+        bench_close(bench);
+    }
+    return 0;
+}
+
+static int bench_depth(struct Bench *bench) {
+    size_t depths[] = {1, 4, 16, 64, 256};
+    size_t depths_number = bench->full ? 5 : 4;
+    for (size_t i = 0; i < depths_number; i++) {
+        char prefix[BENCH_PATH_LENGTH] = "/";
+        for (size_t j = 0; j < depths[i]; j++) strcat(prefix, "d/");
+        size_t files_number = 200;
+        size_t blocks_number = bench_blocks(files_number, BENCH_SMALL_FILE) + depths[i];
+        if (bench_open(bench, blocks_number, files_number + depths[i] + 16) < 0) return -1;
+        bench_files(bench, "depth", "dirs", depths[i], prefix, files_number, BENCH_SMALL_FILE);
+        bench_close(bench);
+    }
+    return 0;
+}
+
+// Splits the free space into single block holes, percent of it is in holes and the rest is one free run at the
+// end of the image
+static int bench_fragmentation(struct Bench *bench) {
+    size_t levels[] = {0, 50, 90, 100};
+    size_t block_size = init_default_super_block().block_size;
+    size_t files_number = bench->full ? 256 : 64;
+    for (size_t i = 0; i < 4; i++) {
+        size_t free_blocks = bench_blocks(files_number, BENCH_FRAGMENTED_FILE) - 1024;
+        size_t holes = free_blocks * levels[i] / 100;
+        size_t fillers = holes * 2;
+        if (bench_open(bench, fillers + free_blocks - holes + 1024, fillers + files_number + 16) < 0) return -1;
+
+        // Every filler takes one block, every other one is removed to leave a hole
+        char path[BENCH_PATH_LENGTH];
+        char *content = malloc(block_size - 1);
+        memset(content, 'h', block_size - 1);
+        int res = 0;
+        for (size_t j = 0; j < fillers && res >= 0; j++) {
+            snprintf(path, sizeof(path), "/h/f%zu", j);
+            res = fs_add(&bench->fs, path, content, block_size - 1);
+        }
+        for (size_t j = 0; j < fillers && res >= 0; j += 2) {
+            snprintf(path, sizeof(path), "/h/f%zu", j);
+            res = fs_remove(&bench->fs, path);
+        }
+        free(content);
+        if (res < 0) {
+            fprintf(stderr, "fragmentation percent=%zu setup failed: %d\n", levels[i], res);
+        } else {
+            bench_files(bench, "fragmentation", "percent", levels[i], "/", files_number, BENCH_FRAGMENTED_FILE);
+        }
+        bench_close(bench);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("Use: %s [scratch image] [pread|stdio|mmap|uring|all] [csv|json] [quick|full]\n", argv[0]);
+        return 1;
+    }
+
+    struct Bench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.image = argv[1];
+
+    int engines[] = {IO_ENGINE_PREAD, IO_ENGINE_STDIO, IO_ENGINE_MMAP, IO_ENGINE_URING};
+    size_t engines_number = 4;
+    if (argc > 2 && strcmp(argv[2], "all") != 0) {
+        engines[0] = io_engine_by_name(argv[2]);
+        engines_number = 1;
+        if (engines[0] < 0) {
+            printf("Unknown I/O engine: %s\n", argv[2]);
+            return 1;
+        }
+    }
+    if (argc > 3) {
+        if (strcmp(argv[3], "json") == 0) {
+            bench.format = BENCH_FORMAT_JSON;
+        } else if (strcmp(argv[3], "csv") != 0) {
+            printf("Unknown format: %s\n", argv[3]);
+            return 1;
+        }
+    }
+    bench.full = argc > 4 && strcmp(argv[4], "full") == 0;
+
+    int res = 0;
+    for (size_t i = 0; i < engines_number && res >= 0; i++) {
+        bench.engine = engines[i];
+        res = bench_sizes(&bench);
+        if (res >= 0) res = bench_fanout(&bench);
+        if (res >= 0) res = bench_depth(&bench);
+        if (res >= 0) res = bench_fragmentation(&bench);
+    }
+    if (bench.format == BENCH_FORMAT_JSON) printf(bench.rows_number == 0 ? "[]\n" : "\n]\n");
+
+    free(bench.latencies);
+    return res < 0 ? 1 : 0;
+}
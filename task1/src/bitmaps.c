@@ -1,46 +1,183 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "bitmaps.h"
 #include "exit_codes.h"
+#include "trace.h"
+
+static uint64_t bitmap_valid_mask(struct Bitmap *bitmap, size_t word_idx) {
+    size_t first_bit = word_idx * 64;
+    if (first_bit + 64 <= bitmap->bits_number) return ~(uint64_t) 0;
+    if (first_bit >= bitmap->bits_number) return 0;
+    return ((uint64_t) 1 << (bitmap->bits_number - first_bit)) - 1;
+}
+
+static void bitmap_mark_dirty(struct Bitmap *bitmap, size_t byte_idx) {
+    if (bitmap->dirty_begin >= bitmap->dirty_end) {
+        bitmap->dirty_begin = byte_idx;
+        bitmap->dirty_end = byte_idx + 1;
+        return;
+    }
+    if (byte_idx < bitmap->dirty_begin) bitmap->dirty_begin = byte_idx;
+    if (byte_idx + 1 > bitmap->dirty_end) bitmap->dirty_end = byte_idx + 1;
+}
+
+int bitmap_load(struct Bitmap *bitmap, struct Io *io, size_t offset, size_t length, size_t bits_number) {
+    if (bits_number > length * 8) bits_number = length * 8;
+
+    bitmap->offset = offset;
+    bitmap->length = length;
+    bitmap->bits_number = bits_number;
+    bitmap->words_number = (length + 7) / 8;
+    bitmap->regions_number = (bits_number + BITMAP_REGION_BITS - 1) / BITMAP_REGION_BITS;
+    bitmap->dirty_begin = 0;
+    bitmap->dirty_end = 0;
+
+    unsigned char *bytes = calloc(bitmap->words_number * 8, 1);
+    bitmap->words = malloc(sizeof(uint64_t) * bitmap->words_number);
+    bitmap->region_free = calloc(bitmap->regions_number + 1, sizeof(size_t));
+
+    uint64_t started = trace_begin();
+    int res = io_read(io, offset, bytes, length);
+    trace_end(started, TRACE_OP_BITMAP_READ, TRACE_NONE, TRACE_NONE, offset, length);
+    if (res < 0) {
+        free(bytes);
+        bitmap_free(bitmap);
+        return READ_FAILURE;
+    }
+
+    // Assemble words byte by byte so that bit idx always lives in byte idx / 8 regardless of host endianness
+    for (size_t i = 0; i < bitmap->words_number; i++) {
+        uint64_t word = 0;
+        for (size_t j = 0; j < 8; j++) {
+            word |= (uint64_t) bytes[i * 8 + j] << (j * 8);
+        }
+        bitmap->words[i] = word;
+    }
+    free(bytes);
+
+    bitmap->free_number = 0;
+    for (size_t i = 0; i < bitmap->words_number; i++) {
+        size_t free_bits = __builtin_popcountll(~bitmap->words[i] & bitmap_valid_mask(bitmap, i));
+        bitmap->region_free[i * 64 / BITMAP_REGION_BITS] += free_bits;
+        bitmap->free_number += free_bits;
+    }
+    return 0;
+}
+
+// Bytes [begin, end) of the bitmap as they are stored in the image
+static void bitmap_encode(struct Bitmap *bitmap, size_t begin, size_t end, unsigned char *bytes) {
+    for (size_t byte_idx = begin; byte_idx < end; byte_idx++) {
+        bytes[byte_idx - begin] = (unsigned char) (bitmap->words[byte_idx / 8] >> (byte_idx % 8 * 8));
+    }
+}
+
+static int bitmap_write(struct Io *io, size_t offset, unsigned char *bytes, size_t length) {
+    uint64_t started = trace_begin();
+    int res = io_write(io, offset, bytes, length);
+    trace_end(started, TRACE_OP_BITMAP_WRITE, TRACE_NONE, TRACE_NONE, offset, length);
+    return res < 0 ? WRITE_FAILURE : 0;
+}
+
+int bitmap_flush(struct Bitmap *bitmap, struct Io *io) {
+    if (bitmap->dirty_begin >= bitmap->dirty_end) return 0;
+
+    size_t dirty_length = bitmap->dirty_end - bitmap->dirty_begin;
+    unsigned char *bytes = malloc(dirty_length);
+    if (bytes == NULL) return NO_SPACE;
+    bitmap_encode(bitmap, bitmap->dirty_begin, bitmap->dirty_end, bytes);
+    int res = bitmap_write(io, bitmap->offset + bitmap->dirty_begin, bytes, dirty_length);
+    free(bytes);
+    if (res < 0) return res;
+
+    bitmap->dirty_begin = 0;
+    bitmap->dirty_end = 0;
+    return 0;
+}
+
+// Flushes two bitmaps, when first is directly followed by second in the image and both are dirty they go out
+// in one write spanning from the dirty range of first to the dirty range of second, clean bytes in between
+// included
+int bitmap_flush_adjacent(struct Bitmap *first, struct Bitmap *second, struct Io *io) {
+    int both_dirty = first->dirty_begin < first->dirty_end && second->dirty_begin < second->dirty_end;
+    if (!both_dirty || first->offset + first->length != second->offset) {
+        int res = bitmap_flush(first, io);
+        if (res < 0) return res;
+        return bitmap_flush(second, io);
+    }
+
+    size_t first_length = first->length - first->dirty_begin;
+    size_t length = first_length + second->dirty_end;
+    unsigned char *bytes = malloc(length);
+    if (bytes == NULL) return NO_SPACE;
+    bitmap_encode(first, first->dirty_begin, first->length, bytes);
+    bitmap_encode(second, 0, second->dirty_end, bytes + first_length);
+    int res = bitmap_write(io, first->offset + first->dirty_begin, bytes, length);
+    free(bytes);
+    if (res < 0) return res;
+
+    first->dirty_begin = 0;
+    first->dirty_end = 0;
+    second->dirty_begin = 0;
+    second->dirty_end = 0;
+    return 0;
+}
+
+void bitmap_free(struct Bitmap *bitmap) {
+    free(bitmap->words);
+    free(bitmap->region_free);
+    bitmap->words = NULL;
+    bitmap->region_free = NULL;
+}
+
+int bitmap_set(struct Bitmap *bitmap, size_t idx, char value) {
+    if (idx >= bitmap->bits_number) return WRONG_INPUT;
+
+    uint64_t bit = (uint64_t) 1 << (idx % 64);
+    uint64_t *word = &bitmap->words[idx / 64];
+    int old_value = (*word & bit) != 0;
+    if (old_value == (value == 1)) return 0;
 
-int bitmap_set(FILE *file, size_t offset, size_t idx, char value) {
-    fseek(file, offset + idx / 8, SEEK_SET);
-    char byte;
-    char new_byte;
-    if (fread(&byte, 1, 1, file) != 1) return READ_FAILURE;
     if (value == 1) {
-        new_byte = byte | (1 << (idx % 8));
+        *word |= bit;
+        bitmap->region_free[idx / BITMAP_REGION_BITS]--;
+        bitmap->free_number--;
     } else {
-        new_byte = byte & (~(1 << (idx % 8)));
+        *word &= ~bit;
+        bitmap->region_free[idx / BITMAP_REGION_BITS]++;
+        bitmap->free_number++;
     }
-    fseek(file, -1, SEEK_CUR);
-    if (fwrite(&new_byte, 1, 1, file) != 1) return WRITE_FAILURE;
+    bitmap_mark_dirty(bitmap, idx / 8);
     return 0;
 }
 
-int bitmap_read(FILE *file, size_t offset, size_t idx) {
-    fseek(file, offset + idx / 8, SEEK_SET);
-    char byte;
-    if (fread(&byte, 1, 1, file) != 1) return READ_FAILURE;
-    return (byte >> (idx % 8)) & 1;
+int bitmap_read(struct Bitmap *bitmap, size_t idx) {
+    if (idx >= bitmap->bits_number) return NOT_FOUND;
+    return (bitmap->words[idx / 64] >> (idx % 64)) & 1;
 }
 
-int bitmap_find_first_free(FILE *file, size_t offset, size_t bitmap_length, size_t *results, size_t required) {
-    size_t byte_idx = 0;
+int bitmap_find_first_free(struct Bitmap *bitmap, size_t *results, size_t required) {
+    if (bitmap->free_number < required) return NO_SPACE;
+
     size_t found = 0;
-    fseek(file, offset, SEEK_SET);
-    char byte;
-    while (byte_idx < bitmap_length && found < required) {
-        if (fread(&byte, 1, 1, file) != 1) return READ_FAILURE;
-        size_t bit_idx = 0;
-        while (bit_idx < 8 && found < required) {
-            if (((byte >> bit_idx) & 1) == 0) {
-                results[found] = byte_idx * 8 + bit_idx;
+    const size_t words_per_region = BITMAP_REGION_BITS / 64;
+    for (size_t region_idx = 0; region_idx < bitmap->regions_number && found < required; region_idx++) {
+        if (bitmap->region_free[region_idx] == 0) continue;
+
+        size_t word_idx = region_idx * words_per_region;
+        size_t region_end = word_idx + words_per_region;
+        if (region_end > bitmap->words_number) region_end = bitmap->words_number;
+
+        for (; word_idx < region_end && found < required; word_idx++) {
+            uint64_t free_bits = ~bitmap->words[word_idx] & bitmap_valid_mask(bitmap, word_idx);
+            while (free_bits != 0 && found < required) {
+                results[found] = word_idx * 64 + __builtin_ctzll(free_bits);
                 found++;
+                free_bits &= free_bits - 1;
             }
-            bit_idx++;
         }
-        byte_idx++;
     }
     if (found < required) return NO_SPACE;
     return 0;
-}
\ No newline at end of file
+}
@@ -2,11 +2,44 @@
 #define TASK1_BITMAPS_H
 
 #include <stdio.h>
+#include <stdint.h>
 
-int bitmap_set(FILE *file, size_t offset, size_t idx, char value);
+#include "io.h"
 
-int bitmap_read(FILE *file, size_t offset, size_t idx);
+// Bits per free-count summary region, must be a multiple of 64
+#define BITMAP_REGION_BITS 512
 
-int bitmap_find_first_free(FILE *file, size_t offset, size_t bitmap_length, size_t *results, size_t required);
+struct Bitmap {
+    uint64_t *words;
+    size_t words_number;
+    size_t bits_number;
+
+    // Location of the bitmap in the image
+    size_t offset;
+    size_t length;
+
+    // Free bits per BITMAP_REGION_BITS region, full regions are skipped while searching
+    size_t *region_free;
+    size_t regions_number;
+    size_t free_number;
+
+    // Byte range [dirty_begin, dirty_end) not yet written back to the image
+    size_t dirty_begin;
+    size_t dirty_end;
+};
+
+int bitmap_load(struct Bitmap *bitmap, struct Io *io, size_t offset, size_t length, size_t bits_number);
+
+int bitmap_flush(struct Bitmap *bitmap, struct Io *io);
+
+int bitmap_flush_adjacent(struct Bitmap *first, struct Bitmap *second, struct Io *io);
+
+void bitmap_free(struct Bitmap *bitmap);
+
+int bitmap_set(struct Bitmap *bitmap, size_t idx, char value);
+
+int bitmap_read(struct Bitmap *bitmap, size_t idx);
+
+int bitmap_find_first_free(struct Bitmap *bitmap, size_t *results, size_t required);
 
 #endif //TASK1_BITMAPS_H
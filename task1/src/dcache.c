@@ -0,0 +1,120 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+#include "exit_codes.h"
+
+static size_t dcache_hash(size_t parent_inode_idx, char *name, size_t name_length) {
+    // FNV-1a over the name, seeded with the parent inode
+    uint64_t hash = 14695981039346656037ULL ^ parent_inode_idx;
+    for (size_t i = 0; i < name_length; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static struct Dentry *dcache_find(struct DentryCache *cache, size_t parent_inode_idx, char *name,
+                                  size_t name_length, struct Dentry **set) {
+    size_t set_idx = dcache_hash(parent_inode_idx, name, name_length) % cache->sets_number;
+    *set = &cache->entries[set_idx * DENTRY_CACHE_WAYS];
+    for (size_t way = 0; way < DENTRY_CACHE_WAYS; way++) {
+        struct Dentry *dentry = &(*set)[way];
+        if (dentry->state != DENTRY_MISS &&
+            dentry->parent_inode_idx == parent_inode_idx &&
+            dentry->name_length == name_length &&
+            memcmp(dentry->name, name, name_length) == 0) {
+            return dentry;
+        }
+    }
+    return NULL;
+}
+
+int dcache_init(struct DentryCache *cache, size_t capacity) {
+    cache->sets_number = capacity / DENTRY_CACHE_WAYS;
+    if (cache->sets_number == 0) cache->sets_number = 1;
+    cache->entries = calloc(cache->sets_number * DENTRY_CACHE_WAYS, sizeof(struct Dentry));
+    cache->next_way = calloc(cache->sets_number, 1);
+    cache->hits = 0;
+    cache->misses = 0;
+    pthread_mutex_init(&cache->mutex, NULL);
+    if (cache->entries == NULL || cache->next_way == NULL) {
+        dcache_free(cache);
+        return NO_SPACE;
+    }
+    return 0;
+}
+
+void dcache_free(struct DentryCache *cache) {
+    free(cache->entries);
+    free(cache->next_way);
+    cache->entries = NULL;
+    cache->next_way = NULL;
+    pthread_mutex_destroy(&cache->mutex);
+}
+
+int dcache_lookup(struct DentryCache *cache, size_t parent_inode_idx, char *name, size_t name_length,
+                  size_t *inode_idx) {
+    if (name_length > DENTRY_NAME_LENGTH) return DENTRY_MISS;
+
+    pthread_mutex_lock(&cache->mutex);
+    struct Dentry *set;
+    struct Dentry *dentry = dcache_find(cache, parent_inode_idx, name, name_length, &set);
+    int state = DENTRY_MISS;
+    if (dentry == NULL) {
+        cache->misses++;
+    } else {
+        cache->hits++;
+        *inode_idx = dentry->inode_idx;
+        state = dentry->state;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return state;
+}
+
+void dcache_insert(struct DentryCache *cache, size_t parent_inode_idx, char *name, size_t name_length,
+                   int state, size_t inode_idx) {
+    if (name_length > DENTRY_NAME_LENGTH) return;
+
+    pthread_mutex_lock(&cache->mutex);
+    struct Dentry *set;
+    struct Dentry *dentry = dcache_find(cache, parent_inode_idx, name, name_length, &set);
+    if (dentry == NULL) {
+        for (size_t way = 0; way < DENTRY_CACHE_WAYS && dentry == NULL; way++) {
+            if (set[way].state == DENTRY_MISS) dentry = &set[way];
+        }
+    }
+    if (dentry == NULL) {
+        unsigned char *next_way = &cache->next_way[(set - cache->entries) / DENTRY_CACHE_WAYS];
+        dentry = &set[*next_way];
+        *next_way = (*next_way + 1) % DENTRY_CACHE_WAYS;
+    }
+
+    dentry->parent_inode_idx = parent_inode_idx;
+    dentry->inode_idx = inode_idx;
+    dentry->state = state;
+    dentry->name_length = name_length;
+    memcpy(dentry->name, name, name_length);
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void dcache_invalidate(struct DentryCache *cache, size_t parent_inode_idx, char *name, size_t name_length) {
+    if (name_length > DENTRY_NAME_LENGTH) return;
+
+    pthread_mutex_lock(&cache->mutex);
+    struct Dentry *set;
+    struct Dentry *dentry = dcache_find(cache, parent_inode_idx, name, name_length, &set);
+    if (dentry != NULL) dentry->state = DENTRY_MISS;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+// Drops every entry looked up in a removed directory, its inode index may be reused by a new one
+void dcache_invalidate_dir(struct DentryCache *cache, size_t dir_inode_idx) {
+    pthread_mutex_lock(&cache->mutex);
+    size_t entries_number = cache->sets_number * DENTRY_CACHE_WAYS;
+    for (size_t i = 0; i < entries_number; i++) {
+        if (cache->entries[i].parent_inode_idx == dir_inode_idx) cache->entries[i].state = DENTRY_MISS;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+}
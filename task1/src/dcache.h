@@ -0,0 +1,54 @@
+#ifndef TASK1_DCACHE_H
+#define TASK1_DCACHE_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#ifndef DENTRY_CACHE_CAPACITY
+#define DENTRY_CACHE_CAPACITY 4096
+#endif
+
+// Entries per set, a set is replaced round-robin
+#define DENTRY_CACHE_WAYS 4
+
+// Longer names are never cached
+#define DENTRY_NAME_LENGTH 48
+
+#define DENTRY_MISS 0
+#define DENTRY_POSITIVE 1
+#define DENTRY_NEGATIVE 2
+
+struct Dentry {
+    size_t parent_inode_idx;
+    size_t inode_idx;
+    unsigned char state;
+    unsigned char name_length;
+    char name[DENTRY_NAME_LENGTH];
+};
+
+// Set-associative (parent inode, name) -> child inode cache, including known-absent names
+struct DentryCache {
+    struct Dentry *entries;
+    size_t sets_number;
+    unsigned char *next_way;
+    pthread_mutex_t mutex;
+
+    size_t hits;
+    size_t misses;
+};
+
+int dcache_init(struct DentryCache *cache, size_t capacity);
+
+void dcache_free(struct DentryCache *cache);
+
+int dcache_lookup(struct DentryCache *cache, size_t parent_inode_idx, char *name, size_t name_length,
+                  size_t *inode_idx);
+
+void dcache_insert(struct DentryCache *cache, size_t parent_inode_idx, char *name, size_t name_length,
+                   int state, size_t inode_idx);
+
+void dcache_invalidate(struct DentryCache *cache, size_t parent_inode_idx, char *name, size_t name_length);
+
+void dcache_invalidate_dir(struct DentryCache *cache, size_t dir_inode_idx);
+
+#endif //TASK1_DCACHE_H
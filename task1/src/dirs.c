@@ -1,24 +1,282 @@
 #include <stdlib.h>
 #include <string.h>
+#include "dcache.h"
+#include "dirs.h"
 #include "files.h"
 #include "exit_codes.h"
 
-int dir_init(struct FS *fs) {
+// A flat directory is an entries count followed by (inode idx, NUL-terminated name) entries.
+// Once it outgrows one block it is rewritten as a hashed directory: a header block holding
+// DIR_HASHED_MAGIC in place of the count and the buckets number, then one block per bucket
+// holding the number of used bytes followed by entries in the flat format.
+#define DIR_HASHED_MAGIC ((size_t) -1)
+
+#define DIR_BUCKET_FULL 1
+
+// Where an entry is in directory order: its bucket, 0 in a flat directory, and its bytes among the entries of the
+// bucket. end is 0 when the position is not known
+struct DirPos {
+    size_t buckets_number;
+    size_t bucket;
+    size_t offset;
+    size_t end;
+    // Bytes of entries in the bucket
+    size_t used;
+};
+
+// File the calling thread looked up last, and how many entries after it have their inodes loaded ahead
+struct DirWalk {
+    struct FS *fs;
+    size_t dir_inode_idx;
+    struct DirPos pos;
+    size_t ahead;
+};
+
+static _Thread_local struct DirWalk dir_walk;
+
+static size_t dir_hash(char *filename, size_t filename_length) {
+    // FNV-1a
+    size_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < filename_length; i++) {
+        hash ^= (unsigned char) filename[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static size_t dir_entry_size(char *entry) {
+    return sizeof(size_t) + strlen(entry + sizeof(size_t)) + 1;
+}
+
+static size_t dir_bucket_capacity(struct FS *fs) {
+    return fs->super_block.block_size - sizeof(size_t);
+}
+
+// Looks for filename among entries, pointing to file_inode_idx unless it is DIR_ANY_FILE, sets entry_offset to
+// its position if found
+static int dir_entries_find(char *entries, size_t entries_length, char *filename, size_t filename_length,
+                            size_t file_inode_idx, size_t *entry_offset) {
+    size_t i = 0;
+    while (i < entries_length) {
+        char *name = entries + i + sizeof(size_t);
+        size_t filename_size = strlen(name) + 1;
+        size_t entry_inode_idx;
+        memcpy(&entry_inode_idx, entries + i, sizeof(size_t));
+        if (filename_size == filename_length + 1 && memcmp(filename, name, filename_length) == 0 &&
+            (file_inode_idx == DIR_ANY_FILE || entry_inode_idx == file_inode_idx)) {
+            *entry_offset = i;
+            return 1;
+        }
+        i += sizeof(size_t) + filename_size;
+    }
+    return 0;
+}
+
+// Sets buckets_number to the buckets number of a hashed directory or to 0 for a flat one
+static int dir_buckets_number(struct FS *fs, size_t dir_inode_idx, size_t *buckets_number) {
+    size_t header[2];
+    int res = file_pread(fs, dir_inode_idx, (char *) header, sizeof(header), 0, 1);
+    if (res < 0) return res;
+    *buckets_number = 0;
+    if (res == sizeof(header) && header[0] == DIR_HASHED_MAGIC) *buckets_number = header[1];
+    return 0;
+}
+
+// Reads all entries as a flat directory regardless of the on-disk format, returns its size
+static int dir_load(struct FS *fs, size_t dir_inode_idx, char **buffer) {
+    int size = file_size(fs, dir_inode_idx, 1);
+    if (size < 0) return size;
+
+    char *content = malloc(size);
+    int res = file_read(fs, dir_inode_idx, content, size, 1);
+    if (res < 0) {
+        free(content);
+        return res;
+    }
+
+    size_t header;
+    memcpy(&header, content, sizeof(size_t));
+    if (header != DIR_HASHED_MAGIC) {
+        *buffer = content;
+        return size;
+    }
+
+    size_t buckets_number;
+    memcpy(&buckets_number, content + sizeof(size_t), sizeof(size_t));
+
+    size_t block_size = fs->super_block.block_size;
+    char *flat = malloc(size);
+    size_t flat_size = sizeof(size_t);
+    size_t entries_number = 0;
+    for (size_t bucket_idx = 0; bucket_idx < buckets_number; bucket_idx++) {
+        char *bucket = content + (bucket_idx + 1) * block_size;
+        size_t used;
+        memcpy(&used, bucket, sizeof(size_t));
+        memcpy(flat + flat_size, bucket + sizeof(size_t), used);
+        for (size_t i = 0; i < used; i += dir_entry_size(bucket + sizeof(size_t) + i)) {
+            entries_number++;
+        }
+        flat_size += used;
+    }
+    memcpy(flat, &entries_number, sizeof(size_t));
+    free(content);
+
+    *buffer = flat;
+    return flat_size;
+}
+
+// Loads the inodes of up to entries_max entries of a flat directory image starting at entry_offset, the ones
+// cached already do not count
+static void dir_prefetch_inodes(struct FS *fs, char *flat, size_t flat_size, size_t entry_offset,
+                                size_t entries_max) {
+    size_t entries_number;
+    memcpy(&entries_number, flat, sizeof(size_t));
+    if (entries_max > entries_number) entries_max = entries_number;
+    size_t *inode_idxs = malloc(sizeof(size_t) * (entries_max + 1));
+    if (inode_idxs == NULL) return;
+    size_t inodes_number = 0;
+    for (size_t i = entry_offset; i < flat_size && inodes_number < entries_max; i += dir_entry_size(flat + i)) {
+        memcpy(&inode_idxs[inodes_number++], flat + i, sizeof(size_t));
+    }
+    inode_prefetch(fs, inode_idxs, inodes_number);
+    free(inode_idxs);
+}
+
+// Rewrites a directory from its flat image as a hashed one, DIR_BUCKET_FULL if an entry does not fit
+static int dir_rehash(struct FS *fs, struct Txn *txn, size_t dir_inode_idx, char *flat, size_t flat_size,
+                      size_t buckets_number) {
+    size_t block_size = fs->super_block.block_size;
+    size_t content_length = (buckets_number + 1) * block_size;
+    char *content = calloc(content_length, 1);
+
+    size_t header[2] = {DIR_HASHED_MAGIC, buckets_number};
+    memcpy(content, header, sizeof(header));
+
+    size_t i = sizeof(size_t);
+    while (i < flat_size) {
+        size_t entry_size = dir_entry_size(flat + i);
+        size_t bucket_idx = dir_hash(flat + i + sizeof(size_t), entry_size - sizeof(size_t) - 1) % buckets_number;
+        char *bucket = content + (bucket_idx + 1) * block_size;
+
+        size_t used;
+        memcpy(&used, bucket, sizeof(size_t));
+        if (used + entry_size > dir_bucket_capacity(fs)) {
+            free(content);
+            return DIR_BUCKET_FULL;
+        }
+        memcpy(bucket + sizeof(size_t) + used, flat + i, entry_size);
+        used += entry_size;
+        memcpy(bucket, &used, sizeof(size_t));
+        i += entry_size;
+    }
+
+    int res = file_update(fs, txn, dir_inode_idx, content, content_length, 1);
+    free(content);
+    return res;
+}
+
+// Doubles the buckets number until every entry fits, a full rewrite amortized over the inserts since the last one
+static int dir_grow(struct FS *fs, struct Txn *txn, size_t dir_inode_idx, char *flat, size_t flat_size,
+                    size_t buckets_number) {
+    size_t entries_number;
+    memcpy(&entries_number, flat, sizeof(size_t));
+    while (1) {
+        int res = dir_rehash(fs, txn, dir_inode_idx, flat, flat_size, buckets_number);
+        if (res != DIR_BUCKET_FULL) return res;
+        if (buckets_number > entries_number) return NO_SPACE;
+        buckets_number *= 2;
+    }
+}
+
+// Called with the directory holding the target locked for writing. Anyone still using the target locked it
+// from that directory before, so taking its lock waits for them
+static int dir_remove_target(struct FS *fs, size_t file_inode_idx) {
+    struct Inode *inode;
+    int res = inode_lock(fs, file_inode_idx, 1, &inode);
+    if (res < 0) return res;
+    res = file_remove(fs, file_inode_idx, 0);
+    if (res == WRONG_FILE_TYPE) {
+        res = dir_remove_rec(fs, file_inode_idx);
+    }
+    inode_unlock(fs, inode);
+    return res;
+}
+
+int dir_init(struct FS *fs, struct Txn *txn) {
     size_t size = 0;
-    return file_add(fs, (char *) &size, sizeof(size_t), 1);
+    return file_add(fs, txn, (char *) &size, sizeof(size_t), 1);
+}
+
+static int dir_hashed_add(struct FS *fs, struct Txn *txn, char *filename, size_t filename_length,
+                          size_t file_inode_idx, size_t dir_inode_idx, size_t buckets_number) {
+    size_t block_size = fs->super_block.block_size;
+    size_t entry_size = sizeof(size_t) + filename_length + 1;
+    if (entry_size > dir_bucket_capacity(fs)) return NO_SPACE;
+
+    size_t bucket_offset = (dir_hash(filename, filename_length) % buckets_number + 1) * block_size;
+    char *bucket = malloc(block_size);
+    int res = file_pread(fs, dir_inode_idx, bucket, block_size, bucket_offset, 1);
+    if (res < 0) {
+        free(bucket);
+        return res;
+    }
+
+    size_t used;
+    memcpy(&used, bucket, sizeof(size_t));
+    if (used + entry_size <= dir_bucket_capacity(fs)) {
+        char *entry = bucket + sizeof(size_t) + used;
+        memcpy(entry, &file_inode_idx, sizeof(size_t));
+        memcpy(entry + sizeof(size_t), filename, filename_length);
+        entry[sizeof(size_t) + filename_length] = '\0';
+        used += entry_size;
+        memcpy(bucket, &used, sizeof(size_t));
+        res = file_pwrite(fs, txn, dir_inode_idx, bucket, sizeof(size_t) + used, bucket_offset, 1);
+        free(bucket);
+        if (res < 0) return res;
+        return 0;
+    }
+    free(bucket);
+
+    // The bucket is full, rehash everything into twice as many buckets
+    char *flat;
+    int flat_size = dir_load(fs, dir_inode_idx, &flat);
+    if (flat_size < 0) return flat_size;
+    flat = realloc(flat, flat_size + entry_size);
+
+    size_t entries_number;
+    memcpy(&entries_number, flat, sizeof(size_t));
+    entries_number++;
+    memcpy(flat, &entries_number, sizeof(size_t));
+    memcpy(flat + flat_size, &file_inode_idx, sizeof(size_t));
+    memcpy(flat + flat_size + sizeof(size_t), filename, filename_length);
+    flat[flat_size + entry_size - 1] = '\0';
+
+    res = dir_grow(fs, txn, dir_inode_idx, flat, flat_size + entry_size, buckets_number * 2);
+    free(flat);
+    return res;
 }
 
-int dir_add(struct FS *fs, char *filename, size_t file_inode_idx, size_t dir_inode_idx) {
-    size_t filename_size = strlen(filename) + 1;
+int dir_add(struct FS *fs, struct Txn *txn, char *filename, size_t filename_length, size_t file_inode_idx,
+            size_t dir_inode_idx) {
+    size_t buckets_number;
+    int res = dir_buckets_number(fs, dir_inode_idx, &buckets_number);
+    if (res < 0) return res;
+    if (buckets_number > 0) {
+        res = dir_hashed_add(fs, txn, filename, filename_length, file_inode_idx, dir_inode_idx, buckets_number);
+        dcache_invalidate(&fs->dentry_cache, dir_inode_idx, filename, filename_length);
+        return res;
+    }
+
+    size_t filename_size = filename_length + 1;
 
-    size_t dir_size = file_size(fs, dir_inode_idx, 1);
+    int dir_size = file_size(fs, dir_inode_idx, 1);
     if (dir_size < 0) return dir_size;
     int buffer_size = dir_size + sizeof(size_t) + filename_size;
     if (buffer_size < 0) return buffer_size;
 
     char *buffer = malloc(buffer_size);
 
-    int res = file_read(fs, dir_inode_idx, buffer, buffer_size, 1);
+    res = file_read(fs, dir_inode_idx, buffer, buffer_size, 1);
     if (res < 0) {
         free(buffer);
         return res;
@@ -30,86 +288,118 @@ int dir_add(struct FS *fs, char *filename, size_t file_inode_idx, size_t dir_ino
     memcpy(buffer, &size, sizeof(size_t));
 
     memcpy(buffer + dir_size, &file_inode_idx, sizeof(size_t));
-    memcpy(buffer + dir_size + sizeof(size_t), filename, filename_size);
-
-    res = file_update(fs, dir_inode_idx, buffer, dir_size + sizeof(size_t) + filename_size, 1);
+    memcpy(buffer + dir_size + sizeof(size_t), filename, filename_length);
+    buffer[dir_size + sizeof(size_t) + filename_length] = '\0';
+
+    if (buffer_size > fs->super_block.block_size) {
+        // Aim for half full buckets after the conversion
+        size_t entries_length = buffer_size - sizeof(size_t);
+        res = dir_grow(fs, txn, dir_inode_idx, buffer, buffer_size, entries_length * 2 / dir_bucket_capacity(fs) + 1);
+    } else {
+        res = file_update(fs, txn, dir_inode_idx, buffer, buffer_size, 1);
+    }
     free(buffer);
+    dcache_invalidate(&fs->dentry_cache, dir_inode_idx, filename, filename_length);
     if (res < 0) return res;
 
     return 0;
 }
 
 int dir_remove_rec(struct FS *fs, size_t dir_inode_idx) {
-    int buffer_size = file_size(fs, dir_inode_idx, 1);
+    char *buffer;
+    int buffer_size = dir_load(fs, dir_inode_idx, &buffer);
     if (buffer_size < 0) return 0;
 
-    char *buffer = malloc(buffer_size);
-
-    int res = file_read(fs, dir_inode_idx, buffer, buffer_size, 1);
-    if (res < 0) {
-        free(buffer);
-        return res;
-    }
-
+    int res;
     size_t i = sizeof(size_t);
     while (i < buffer_size) {
         size_t file_inode_idx;
         memcpy(&file_inode_idx, buffer + i, sizeof(size_t));
-        i += sizeof(size_t);
-        res = file_remove(fs, file_inode_idx, 0);
-        if (res == WRONG_FILE_TYPE) {
-            dir_remove_rec(fs, file_inode_idx);
-        }
+        res = dir_remove_target(fs, file_inode_idx);
         if (res < 0) {
             free(buffer);
             return res;
         }
-
-        size_t filename_size = strlen(buffer + i) + 1;
-        i += filename_size;
+        i += dir_entry_size(buffer + i);
     }
     res = file_remove(fs, dir_inode_idx, 1);
     free(buffer);
+    dcache_invalidate_dir(&fs->dentry_cache, dir_inode_idx);
+    if (res < 0) return res;
+    return 0;
+}
+
+static int dir_hashed_remove_file(struct FS *fs, char *filename, size_t filename_length, size_t file_inode_idx,
+                                  size_t dir_inode_idx, size_t buckets_number) {
+    size_t block_size = fs->super_block.block_size;
+    size_t bucket_offset = (dir_hash(filename, filename_length) % buckets_number + 1) * block_size;
+    char *bucket = malloc(block_size);
+    int res = file_pread(fs, dir_inode_idx, bucket, block_size, bucket_offset, 1);
+    if (res < 0) {
+        free(bucket);
+        return res;
+    }
+
+    size_t used;
+    memcpy(&used, bucket, sizeof(size_t));
+    char *entries = bucket + sizeof(size_t);
+    size_t entry_offset;
+    if (!dir_entries_find(entries, used, filename, filename_length, file_inode_idx, &entry_offset)) {
+        free(bucket);
+        return NOT_FOUND;
+    }
+    dcache_invalidate(&fs->dentry_cache, dir_inode_idx, filename, filename_length);
+
+    memcpy(&file_inode_idx, entries + entry_offset, sizeof(size_t));
+    res = dir_remove_target(fs, file_inode_idx);
+    if (res < 0) {
+        free(bucket);
+        return res;
+    }
+
+    size_t entry_size = dir_entry_size(entries + entry_offset);
+    memmove(entries + entry_offset, entries + entry_offset + entry_size, used - entry_offset - entry_size);
+    used -= entry_size;
+    memcpy(bucket, &used, sizeof(size_t));
+    res = file_pwrite(fs, NULL, dir_inode_idx, bucket, sizeof(size_t) + used, bucket_offset, 1);
+    free(bucket);
     if (res < 0) return res;
     return 0;
 }
 
-int dir_remove_file(struct FS *fs, char *filename, size_t dir_inode_idx) {
+// Removes the entry named filename, the one pointing to file_inode_idx unless it is DIR_ANY_FILE, and its target
+int dir_remove_file(struct FS *fs, char *filename, size_t filename_length, size_t file_inode_idx,
+                    size_t dir_inode_idx) {
+    size_t buckets_number;
+    int res = dir_buckets_number(fs, dir_inode_idx, &buckets_number);
+    if (res < 0) return res;
+    if (buckets_number > 0) return dir_hashed_remove_file(fs, filename, filename_length, file_inode_idx,
+                                                          dir_inode_idx, buckets_number);
+
     int buffer_size = file_size(fs, dir_inode_idx, 1);
     if(buffer_size < 0) return buffer_size;
 
     char *buffer = malloc(buffer_size);
 
-    int res = file_read(fs, dir_inode_idx, buffer, buffer_size, 1);
+    res = file_read(fs, dir_inode_idx, buffer, buffer_size, 1);
     if (res < 0) {
         free(buffer);
         return res;
     }
 
-    size_t i = sizeof(size_t);
-    int found = 0;
-    size_t file_inode_idx = 0;
-    size_t filename_size = 0;
-
-    while (i < buffer_size && found == 0) {
-        memcpy(&file_inode_idx, buffer + i, sizeof(size_t));
-        i += sizeof(size_t);
-        if (strcmp(filename, buffer + i) == 0) {
-            found = 1;
-        }
-        filename_size = strlen(buffer + i) + 1;
-        i += filename_size;
-    }
-
-    if (found == 0) {
+    size_t entry_offset;
+    if (!dir_entries_find(buffer + sizeof(size_t), buffer_size - sizeof(size_t), filename, filename_length,
+                          file_inode_idx, &entry_offset)) {
         free(buffer);
         return NOT_FOUND;
     }
+    dcache_invalidate(&fs->dentry_cache, dir_inode_idx, filename, filename_length);
 
-    res = file_remove(fs, file_inode_idx, 0);
-    if (res == WRONG_FILE_TYPE) {
-        res = dir_remove_rec(fs, file_inode_idx);
-    }
+    size_t i = sizeof(size_t) + entry_offset;
+    memcpy(&file_inode_idx, buffer + i, sizeof(size_t));
+    size_t entry_size = dir_entry_size(buffer + i);
+
+    res = dir_remove_target(fs, file_inode_idx);
     if (res < 0) {
         free(buffer);
         return res;
@@ -120,8 +410,8 @@ int dir_remove_file(struct FS *fs, char *filename, size_t dir_inode_idx) {
     size--;
     memcpy(buffer, &size, sizeof(size_t));
 
-    memmove(buffer + i - sizeof(size_t) - filename_size, buffer + i, buffer_size - i);
-    res = file_update(fs, dir_inode_idx, buffer, buffer_size - sizeof(size_t) - filename_size, 1);
+    memmove(buffer + i, buffer + i + entry_size, buffer_size - i - entry_size);
+    res = file_update(fs, NULL, dir_inode_idx, buffer, buffer_size - entry_size, 1);
     free(buffer);
     if (res < 0) return res;
 
@@ -129,30 +419,22 @@ int dir_remove_file(struct FS *fs, char *filename, size_t dir_inode_idx) {
 }
 
 int dir_size(struct FS *fs, size_t dir_inode_idx) {
-    int size = file_size(fs, dir_inode_idx, 1);
+    char *buffer;
+    int size = dir_load(fs, dir_inode_idx, &buffer);
     if (size < 0) return size;
 
-    char* buffer = malloc(size);
-    file_read(fs, dir_inode_idx, buffer, size, 1);
-
     size_t dir_size;
     memcpy(&dir_size, buffer, sizeof(size_t));
+    free(buffer);
 
     return size - (dir_size + 1) * sizeof(size_t) + dir_size * 46 + 100;
 }
 
 int dir_list(struct FS *fs, size_t dir_inode_idx, char *content, size_t content_length) {
-    int buffer_size = file_size(fs, dir_inode_idx, 1);
+    char *buffer;
+    int buffer_size = dir_load(fs, dir_inode_idx, &buffer);
     if (buffer_size < 0) return buffer_size;
 
-    char *buffer = malloc(buffer_size);
-
-    int res = file_read(fs, dir_inode_idx, buffer, buffer_size, 1);
-    if (res < 0) {
-        free(buffer);
-        return res;
-    }
-
     size_t size;
     memcpy(&size, buffer, sizeof(size_t));
 
@@ -166,11 +448,23 @@ int dir_list(struct FS *fs, size_t dir_inode_idx, char *content, size_t content_
     size_t str_offset = strlen(content);
 
     size_t i = sizeof(size_t);
+    size_t listed = 0;
     while (i < buffer_size) {
+        // The inodes of the entries are read in batches instead of one by one
+        if (INODE_PREFETCH_MAX > 0 && listed % INODE_PREFETCH_MAX == 0) {
+            dir_prefetch_inodes(fs, buffer, buffer_size, i, INODE_PREFETCH_MAX);
+        }
+        listed++;
         size_t file_inode_idx;
         memcpy(&file_inode_idx, buffer + i, sizeof(size_t));
-        int dir_flag = file_is_dir(fs, file_inode_idx);
-        int f_size = file_size(fs, file_inode_idx, dir_flag);
+        struct Inode *inode;
+        int f_size = inode_lock(fs, file_inode_idx, 0, &inode);
+        int dir_flag = 0;
+        if (f_size >= 0) {
+            dir_flag = file_is_dir(fs, file_inode_idx);
+            f_size = file_size(fs, file_inode_idx, dir_flag);
+            inode_unlock(fs, inode);
+        }
         if (f_size < 0) {
             free(buffer);
             return f_size;
@@ -194,30 +488,179 @@ int dir_list(struct FS *fs, size_t dir_inode_idx, char *content, size_t content_
     return 0;
 }
 
-int dir_find(struct FS *fs, char *filename, size_t dir_inode_idx) {
-    int buffer_size = file_size(fs, dir_inode_idx, 1);
-    if (buffer_size < 0) return buffer_size;
+// Sets pos to where the entry was found when it is read from the directory, a cached one leaves it unknown
+static int dir_find_impl(struct FS *fs, char *filename, size_t filename_length, size_t dir_inode_idx,
+                         struct DirPos *pos) {
+    pos->end = 0;
+    size_t cached_inode_idx;
+    int state = dcache_lookup(&fs->dentry_cache, dir_inode_idx, filename, filename_length, &cached_inode_idx);
+    if (state == DENTRY_POSITIVE) return cached_inode_idx;
+    if (state == DENTRY_NEGATIVE) return NOT_FOUND;
+
+    size_t buckets_number;
+    int res = dir_buckets_number(fs, dir_inode_idx, &buckets_number);
+    if (res < 0) return res;
 
-    char *buffer = malloc(buffer_size);
+    // Only the bucket the name hashes to is read for a hashed directory
+    size_t offset = 0;
+    int buffer_size;
+    if (buckets_number > 0) {
+        buffer_size = fs->super_block.block_size;
+        offset = (dir_hash(filename, filename_length) % buckets_number + 1) * buffer_size;
+    } else {
+        buffer_size = file_size(fs, dir_inode_idx, 1);
+        if (buffer_size < 0) return buffer_size;
+    }
 
-    int res = file_read(fs, dir_inode_idx, buffer, buffer_size, 1);
+    char *buffer = malloc(buffer_size);
+    res = file_pread(fs, dir_inode_idx, buffer, buffer_size, offset, 1);
     if (res < 0) {
         free(buffer);
         return res;
     }
 
-    size_t i = sizeof(size_t);
-    while (i < buffer_size) {
+    size_t entries_length;
+    if (buckets_number > 0) {
+        memcpy(&entries_length, buffer, sizeof(size_t));
+    } else {
+        entries_length = buffer_size - sizeof(size_t);
+    }
+
+    size_t entry_offset;
+    if (dir_entries_find(buffer + sizeof(size_t), entries_length, filename, filename_length, DIR_ANY_FILE,
+                         &entry_offset)) {
         size_t file_inode_idx;
-        memcpy(&file_inode_idx, buffer + i, sizeof(size_t));
-        i += sizeof(size_t);
-        if (strcmp(filename, buffer + i) == 0) {
-            free(buffer);
-            return file_inode_idx;
-        }
-        size_t filename_size = strlen(buffer + i) + 1;
-        i += filename_size;
+        memcpy(&file_inode_idx, buffer + sizeof(size_t) + entry_offset, sizeof(size_t));
+        pos->buckets_number = buckets_number;
+        pos->bucket = buckets_number > 0 ? offset / buffer_size - 1 : 0;
+        pos->offset = entry_offset;
+        pos->end = entry_offset + dir_entry_size(buffer + sizeof(size_t) + entry_offset);
+        pos->used = entries_length;
+        free(buffer);
+        dcache_insert(&fs->dentry_cache, dir_inode_idx, filename, filename_length, DENTRY_POSITIVE,
+                      file_inode_idx);
+        return file_inode_idx;
     }
     free(buffer);
+    dcache_insert(&fs->dentry_cache, dir_inode_idx, filename, filename_length, DENTRY_NEGATIVE, 0);
     return NOT_FOUND;
-}
\ No newline at end of file
+}
+
+int dir_find(struct FS *fs, char *filename, size_t filename_length, size_t dir_inode_idx) {
+    struct StatsTimer timer;
+    stats_start(&timer);
+    struct DirPos pos;
+    int res = dir_find_impl(fs, filename, filename_length, dir_inode_idx, &pos);
+    stats_finish(&fs->stats, STATS_OP_DIR_FIND, &timer, res, 0);
+    return res;
+}
+
+// Whether the entry at pos comes right after the one the walk looked up last, empty buckets between aside
+static int dir_walk_follows(struct DirWalk *walk, struct FS *fs, size_t dir_inode_idx, struct DirPos *pos) {
+    struct DirPos *last = &walk->pos;
+    if (walk->fs != fs || walk->dir_inode_idx != dir_inode_idx || last->end == 0 || pos->end == 0) return 0;
+    if (last->buckets_number != pos->buckets_number) return 0;
+    if (pos->bucket == last->bucket) return pos->offset == last->end;
+    return pos->bucket > last->bucket && pos->offset == 0 && last->end == last->used;
+}
+
+// Entries a walk loads the inodes of at once, as many as inode_prefetch takes
+static size_t dir_walk_window(struct FS *fs) {
+    size_t half_cache = fs->inode_cache.capacity / 2;
+    return half_cache < INODE_PREFETCH_MAX ? half_cache : INODE_PREFETCH_MAX;
+}
+
+// Loads the inodes of up to window entries following the one at the walk position. Only the buckets holding
+// them are read: the rest of the current one, then the next ones together, as many as the entries still wanted
+// take at the number of entries per bucket seen so far. Returns the number of entries
+static size_t dir_walk_prefetch(struct FS *fs, struct DirWalk *walk, size_t window) {
+    struct DirPos *pos = &walk->pos;
+    size_t block_size = fs->super_block.block_size;
+    size_t *inode_idxs = malloc(sizeof(size_t) * window);
+    char *buffer = malloc(block_size);
+    if (inode_idxs == NULL || buffer == NULL) {
+        free(inode_idxs);
+        free(buffer);
+        return 0;
+    }
+
+    size_t inodes_number = 0;
+    size_t bucket = pos->bucket;
+    size_t buckets_read = 0;
+    size_t entries_seen = 0;
+    size_t batch = 1;
+    int res = 0;
+    while (inodes_number < window && res >= 0) {
+        size_t length;
+        if (pos->buckets_number == 0) {
+            res = file_size(fs, walk->dir_inode_idx, 1);
+            if (res < 0) break;
+            length = res;
+        } else {
+            if (bucket >= pos->buckets_number) break;
+            if (bucket + batch > pos->buckets_number) batch = pos->buckets_number - bucket;
+            length = batch * block_size;
+        }
+        char *grown = realloc(buffer, length);
+        if (grown == NULL) break;
+        buffer = grown;
+        size_t offset = pos->buckets_number > 0 ? (bucket + 1) * block_size : 0;
+        res = file_pread(fs, walk->dir_inode_idx, buffer, length, offset, 1);
+        if (res < 0) break;
+
+        for (size_t b = 0; b < batch && inodes_number < window; b++) {
+            char *entries = buffer + b * block_size + sizeof(size_t);
+            size_t used;
+            if (pos->buckets_number > 0) {
+                memcpy(&used, buffer + b * block_size, sizeof(size_t));
+                if (used > dir_bucket_capacity(fs)) used = 0;
+            } else {
+                used = length - sizeof(size_t);
+            }
+            // Entries before the walk position only count towards the entries per bucket
+            size_t first = bucket + b == pos->bucket ? pos->end : 0;
+            for (size_t i = 0; i < used; i += dir_entry_size(entries + i)) {
+                entries_seen++;
+                if (i >= first && inodes_number < window) {
+                    memcpy(&inode_idxs[inodes_number++], entries + i, sizeof(size_t));
+                }
+            }
+            buckets_read++;
+        }
+        if (pos->buckets_number == 0) break;
+        bucket += batch;
+        size_t per_bucket = entries_seen / buckets_read + 1;
+        batch = (window - inodes_number + per_bucket - 1) / per_bucket;
+    }
+    free(buffer);
+
+    inode_prefetch(fs, inode_idxs, inodes_number);
+    free(inode_idxs);
+    return inodes_number;
+}
+
+// Looks a file up like dir_find, called with the directory locked. A lookup of the entry right after the one the
+// calling thread looked up before continues a walk over the directory: the inodes of the entries following it
+// are loaded ahead, and again each time half of them may have been used. Other lookups cost nothing more
+int dir_find_file(struct FS *fs, char *filename, size_t filename_length, size_t dir_inode_idx) {
+    struct StatsTimer timer;
+    stats_start(&timer);
+    struct DirPos pos;
+    int res = dir_find_impl(fs, filename, filename_length, dir_inode_idx, &pos);
+    stats_finish(&fs->stats, STATS_OP_DIR_FIND, &timer, res, 0);
+    size_t window = dir_walk_window(fs);
+    if (window == 0 || res < 0) return res;
+
+    struct DirWalk *walk = &dir_walk;
+    int follows = dir_walk_follows(walk, fs, dir_inode_idx, &pos);
+    walk->fs = fs;
+    walk->dir_inode_idx = dir_inode_idx;
+    walk->pos = pos;
+    if (!follows) {
+        walk->ahead = 0;
+        return res;
+    }
+    if (walk->ahead > 0) walk->ahead--;
+    if (walk->ahead <= window / 2) walk->ahead = dir_walk_prefetch(fs, walk, window);
+    return res;
+}
@@ -3,18 +3,25 @@
 
 #include "files.h"
 
-int dir_init(struct FS *fs);
+// Matches an entry of any file in dir_remove_file
+#define DIR_ANY_FILE ((size_t) -1)
 
-int dir_add(struct FS *fs, char *filename, size_t file_inode_idx, size_t dir_inode_idx);
+int dir_init(struct FS *fs, struct Txn *txn);
+
+int dir_add(struct FS *fs, struct Txn *txn, char *filename, size_t filename_length, size_t file_inode_idx,
+            size_t dir_inode_idx);
 
 int dir_remove_rec(struct FS *fs, size_t dir_inode_idx);
 
-int dir_remove_file(struct FS *fs, char *filename, size_t dir_inode_idx);
+int dir_remove_file(struct FS *fs, char *filename, size_t filename_length, size_t file_inode_idx,
+                    size_t dir_inode_idx);
 
 int dir_size(struct FS *fs, size_t dir_inode_idx);
 
 int dir_list(struct FS *fs, size_t dir_inode_idx, char *content, size_t content_length);
 
-int dir_find(struct FS *fs, char *filename, size_t dir_inode_idx);
+int dir_find(struct FS *fs, char *filename, size_t filename_length, size_t dir_inode_idx);
+
+int dir_find_file(struct FS *fs, char *filename, size_t filename_length, size_t dir_inode_idx);
 
 #endif //TASK1_DIRS_H
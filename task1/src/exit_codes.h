@@ -8,5 +8,6 @@
 #define WRONG_FILE_TYPE -5
 #define NOT_FOUND -6
 #define WRONG_INPUT -7
+#define FRAGMENTED -8
 
 #endif //TASK1_EXIT_CODES_H
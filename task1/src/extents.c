@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "exit_codes.h"
+#include "extents.h"
+
+static size_t extents_lower_bound_start(struct ExtentIndex *index, size_t start) {
+    size_t left = 0;
+    size_t right = index->extents_number;
+    while (left < right) {
+        size_t middle = left + (right - left) / 2;
+        if (index->by_start[middle].start < start) {
+            left = middle + 1;
+        } else {
+            right = middle;
+        }
+    }
+    return left;
+}
+
+static size_t extents_lower_bound_length(struct ExtentIndex *index, size_t length, size_t start) {
+    size_t left = 0;
+    size_t right = index->extents_number;
+    while (left < right) {
+        size_t middle = left + (right - left) / 2;
+        struct Extent *extent = &index->by_length[middle];
+        if (extent->length < length || (extent->length == length && extent->start < start)) {
+            left = middle + 1;
+        } else {
+            right = middle;
+        }
+    }
+    return left;
+}
+
+static void extents_insert(struct ExtentIndex *index, struct Extent extent) {
+    if (index->extents_number == index->capacity) {
+        index->capacity = index->capacity == 0 ? 16 : index->capacity * 2;
+        index->by_start = realloc(index->by_start, sizeof(struct Extent) * index->capacity);
+        index->by_length = realloc(index->by_length, sizeof(struct Extent) * index->capacity);
+    }
+
+    size_t pos = extents_lower_bound_start(index, extent.start);
+    memmove(index->by_start + pos + 1, index->by_start + pos,
+            sizeof(struct Extent) * (index->extents_number - pos));
+    index->by_start[pos] = extent;
+
+    pos = extents_lower_bound_length(index, extent.length, extent.start);
+    memmove(index->by_length + pos + 1, index->by_length + pos,
+            sizeof(struct Extent) * (index->extents_number - pos));
+    index->by_length[pos] = extent;
+
+    index->extents_number++;
+}
+
+static void extents_erase(struct ExtentIndex *index, struct Extent extent) {
+    size_t pos = extents_lower_bound_start(index, extent.start);
+    memmove(index->by_start + pos, index->by_start + pos + 1,
+            sizeof(struct Extent) * (index->extents_number - pos - 1));
+
+    pos = extents_lower_bound_length(index, extent.length, extent.start);
+    memmove(index->by_length + pos, index->by_length + pos + 1,
+            sizeof(struct Extent) * (index->extents_number - pos - 1));
+
+    index->extents_number--;
+}
+
+// Cuts up to required blocks from the beginning of the extent, returns the number of blocks taken
+static size_t extents_take(struct ExtentIndex *index, struct Extent extent, size_t *results, size_t required) {
+    size_t taken = extent.length < required ? extent.length : required;
+    extents_erase(index, extent);
+    if (taken < extent.length) {
+        struct Extent rest = {extent.start + taken, extent.length - taken};
+        extents_insert(index, rest);
+    }
+    for (size_t i = 0; i < taken; i++) {
+        results[i] = extent.start + i;
+    }
+    index->free_number -= taken;
+    return taken;
+}
+
+int extents_build(struct ExtentIndex *index, struct Bitmap *bitmap) {
+    index->by_start = NULL;
+    index->by_length = NULL;
+    index->extents_number = 0;
+    index->capacity = 0;
+    index->free_number = 0;
+
+    size_t idx = 0;
+    while (idx < bitmap->bits_number) {
+        // Skip fully used words at once
+        if (idx % 64 == 0 && bitmap->words[idx / 64] == ~(uint64_t) 0) {
+            idx += 64;
+            continue;
+        }
+        if (bitmap_read(bitmap, idx) == 1) {
+            idx++;
+            continue;
+        }
+        struct Extent extent = {idx, 0};
+        while (idx < bitmap->bits_number && bitmap_read(bitmap, idx) == 0) {
+            if (idx % 64 == 0 && idx + 64 <= bitmap->bits_number && bitmap->words[idx / 64] == 0) {
+                idx += 64;
+            } else {
+                idx++;
+            }
+        }
+        extent.length = idx - extent.start;
+        extents_insert(index, extent);
+        index->free_number += extent.length;
+    }
+    return 0;
+}
+
+void extents_free(struct ExtentIndex *index) {
+    free(index->by_start);
+    free(index->by_length);
+    index->by_start = NULL;
+    index->by_length = NULL;
+    index->extents_number = 0;
+    index->capacity = 0;
+}
+
+int extents_alloc(struct ExtentIndex *index, size_t *results, size_t required) {
+    if (index->free_number < required) return NO_SPACE;
+
+    size_t found = 0;
+    while (found < required) {
+        // Best fit: the shortest extent holding the whole request, otherwise the longest one available
+        size_t pos = extents_lower_bound_length(index, required - found, 0);
+        if (pos == index->extents_number) pos = index->extents_number - 1;
+        found += extents_take(index, index->by_length[pos], results + found, required - found);
+    }
+    return 0;
+}
+
+int extents_alloc_after(struct ExtentIndex *index, size_t prev_idx, size_t *results, size_t required) {
+    if (index->free_number < required) return NO_SPACE;
+
+    // Prefer continuing the run that ends at prev_idx so that the file stays contiguous
+    size_t pos = extents_lower_bound_start(index, prev_idx + 1);
+    size_t found = 0;
+    if (pos < index->extents_number && index->by_start[pos].start == prev_idx + 1) {
+        found = extents_take(index, index->by_start[pos], results, required);
+    }
+    if (found == required) return 0;
+    return extents_alloc(index, results + found, required - found);
+}
+
+int extents_release(struct ExtentIndex *index, size_t start, size_t length) {
+    struct Extent extent = {start, length};
+    size_t pos = extents_lower_bound_start(index, start);
+
+    if (pos < index->extents_number && index->by_start[pos].start < start + length) return WRONG_INPUT;
+    if (pos > 0) {
+        struct Extent left = index->by_start[pos - 1];
+        if (left.start + left.length > start) return WRONG_INPUT;
+        if (left.start + left.length == start) {
+            extents_erase(index, left);
+            extent.start = left.start;
+            extent.length += left.length;
+            pos--;
+        }
+    }
+    if (pos < index->extents_number) {
+        struct Extent right = index->by_start[pos];
+        if (extent.start + extent.length == right.start) {
+            extents_erase(index, right);
+            extent.length += right.length;
+        }
+    }
+
+    extents_insert(index, extent);
+    index->free_number += length;
+    return 0;
+}
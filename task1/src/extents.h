@@ -0,0 +1,33 @@
+#ifndef TASK1_EXTENTS_H
+#define TASK1_EXTENTS_H
+
+#include <stdio.h>
+
+#include "bitmaps.h"
+
+struct Extent {
+    size_t start;
+    size_t length;
+};
+
+// Free extents of the blocks table, kept twice: ordered by start for merging neighbours on release
+// and ordered by (length, start) for best-fit allocation
+struct ExtentIndex {
+    struct Extent *by_start;
+    struct Extent *by_length;
+    size_t extents_number;
+    size_t capacity;
+    size_t free_number;
+};
+
+int extents_build(struct ExtentIndex *index, struct Bitmap *bitmap);
+
+void extents_free(struct ExtentIndex *index);
+
+int extents_alloc(struct ExtentIndex *index, size_t *results, size_t required);
+
+int extents_alloc_after(struct ExtentIndex *index, size_t prev_idx, size_t *results, size_t required);
+
+int extents_release(struct ExtentIndex *index, size_t start, size_t length);
+
+#endif //TASK1_EXTENTS_H
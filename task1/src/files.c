@@ -1,246 +1,756 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "bitmaps.h"
 #include "exit_codes.h"
+#include "extents.h"
 #include "files.h"
+#include "inodes.h"
+#include "tails.h"
+#include "trace.h"
+
+// Number of data blocks for content of length bytes, none when it fits inline in the inode slot
+static size_t file_blocks_required(struct FS *fs, size_t length) {
+    if (length <= inode_inline_capacity(fs)) return 0;
+    return (length + fs->super_block.block_size - 1) / fs->super_block.block_size;
+}
 
-int file_fill_with_data(struct FS *fs, size_t inode_idx, size_t *block_idxs, size_t blocks_required, char *content,
-                        size_t content_length, size_t dir_flag) {
-    // Write to inode block
-    fseek(fs->file, fs->inode_table_offset + inode_idx * fs->super_block.inode_size, SEEK_SET);
-    if (fwrite(&dir_flag, sizeof(size_t), 1, fs->file) != 1) return WRITE_FAILURE;
-    if (fwrite(&content_length, sizeof(size_t), 1, fs->file) != 1) return WRITE_FAILURE;
-    if (fwrite(block_idxs, sizeof(size_t), blocks_required, fs->file) != blocks_required) return WRITE_FAILURE;
-
-    // Write to data blocks
-    for (size_t i = 0; i < blocks_required - 1; i++) {
-        fseek(fs->file, fs->blocks_table_offset + block_idxs[i] * fs->super_block.block_size, SEEK_SET);
-        if (fwrite(content + i * fs->super_block.block_size, fs->super_block.block_size, 1, fs->file) != 1)
-            return WRITE_FAILURE;
-    }
-    fseek(fs->file, fs->blocks_table_offset + block_idxs[blocks_required - 1] * fs->super_block.block_size, SEEK_SET);
-    if (fwrite(content + (blocks_required - 1) * fs->super_block.block_size,
-               content_length % fs->super_block.block_size, 1, fs->file) != 1)
-        return WRITE_FAILURE;
+// Whether the partial last block of content of length bytes goes into a shared tail block. Only files addressed
+// by direct pointers pack their tails, so that opening the image finds all tails in the inode table
+static int file_tail_packable(struct FS *fs, size_t length) {
+    size_t blocks_required = file_blocks_required(fs, length);
+    return blocks_required > 0 && blocks_required <= inode_direct_number(fs) &&
+           tails_packable(&fs->tails, length % fs->super_block.block_size);
+}
 
-    return 0;
+// Whether file block i is the tail packed into a shared block
+static int file_block_shared(struct Inode *inode, size_t i) {
+    return inode->tail_offset != INODE_TAIL_NONE && i + 1 == inode->blocks_number;
 }
 
-int file_add(struct FS *fs, char *content, size_t content_length, size_t dir_flag) {
-    // Find free inode block
-    size_t inode_idx = 0;
-    int res = bitmap_find_first_free(fs->file, fs->inode_bitmap_offset, fs->inode_bitmap_length, &inode_idx, 1);
-    if (res < 0) return res;
+// Where the bytes of file block i start in its image block
+static size_t file_block_shift(struct Inode *inode, size_t i) {
+    return file_block_shared(inode, i) ? inode->tail_offset : 0;
+}
 
-    // Find free data blocks
-    size_t blocks_required = content_length / fs->super_block.block_size + 1;
-    if (sizeof(size_t) * (blocks_required + 2) > fs->super_block.inode_size) return NO_SPACE;
-    fseek(fs->file, fs->blocks_bitmap_offset, SEEK_SET);
-    size_t *block_idxs = malloc(sizeof(size_t) * blocks_required);
-    res = bitmap_find_first_free(fs->file, fs->blocks_bitmap_offset, fs->blocks_bitmap_length, block_idxs,
-                                 blocks_required);
-    if (res < 0) {
-        free(block_idxs);
-        return res;
+// File block position i stored in image block block
+struct FileBlockRef {
+    size_t block;
+    size_t i;
+};
+
+static int file_by_block(const void *a, const void *b) {
+    const struct FileBlockRef *first = a;
+    const struct FileBlockRef *second = b;
+    return first->block < second->block ? -1 : first->block > second->block;
+}
+
+// Reads a block that is only partly wanted whole, so that it can be cached, and copies bytes [begin, end) out.
+// Other files write to a shared block without this file's lock, it is only cached if none did meanwhile
+static int file_block_read_through(struct FS *fs, struct Inode *inode, size_t block_idx, size_t begin, size_t end,
+                                   char *buffer, int shared) {
+    size_t block_size = fs->super_block.block_size;
+    char *block = malloc(block_size);
+    if (block == NULL) return NO_SPACE;
+    size_t generation;
+    int cacheable = !shared || bcache_prefetch_begin(&fs->block_cache, &generation);
+    size_t image_offset = fs->blocks_table_offset + block_idx * block_size;
+    uint64_t started = trace_begin();
+    int res = io_read(&fs->io, image_offset, block, block_size);
+    trace_end(started, TRACE_OP_FILE_READ, inode->idx, block_idx, image_offset, block_size);
+    if (res >= 0) {
+        memcpy(buffer, block + begin, end - begin);
+        if (shared && cacheable) {
+            bcache_fill_shared(&fs->block_cache, &fs->io, generation, block_idx, block);
+        } else if (!shared) {
+            res = bcache_fill(&fs->block_cache, &fs->io, block_idx, block);
+        }
     }
+    free(block);
+    return res;
+}
 
-    // Reserve inode block
-    res = bitmap_set(fs->file, fs->inode_bitmap_offset, inode_idx, 1);
-    if (res < 0) {
-        free(block_idxs);
-        return res;
+// Read stream of the calling thread over regular files: where its last read ended, in the file and in the image,
+// and how many blocks it reads ahead of that
+struct ReadStream {
+    struct FS *fs;
+    size_t inode_idx;
+    size_t next_i;
+    size_t next_block;
+    size_t window;
+};
+
+static _Thread_local struct ReadStream file_read_stream;
+
+// Follows the stream with a read of file blocks [first, last] and picks the blocks to read ahead of it, at most
+// the window. A read starting where the last one ended in the file, or at most a window past it in the image,
+// continues the stream and doubles the window. Any other read starts over without reading ahead, so random
+// readers do not pay for it. Past the end of the file the allocated blocks following it in the image are taken:
+// files written one after another are usually read one after another. Returns the number of blocks, 0 when
+// too few of them are missing from the cache to be worth a request
+static size_t file_read_ahead_blocks(struct FS *fs, struct Inode *inode, size_t first, size_t last,
+                                     size_t **block_idxs) {
+    struct ReadStream *stream = &file_read_stream;
+    size_t last_block = inode->blocks[first];
+    for (size_t i = first + 1; i <= last; i++) {
+        if (inode->blocks[i] > last_block) last_block = inode->blocks[i];
     }
+    size_t first_block = inode->blocks[first];
+    size_t slack = stream->window > READAHEAD_BLOCKS_MIN ? stream->window : READAHEAD_BLOCKS_MIN;
+    int sequential = stream->fs == fs && ((stream->inode_idx == inode->idx && stream->next_i == first) ||
+                                          (first_block >= stream->next_block &&
+                                           first_block - stream->next_block <= slack));
+
+    // A quarter of the cache at most, read ahead blocks must not push out the ones they are read for
+    size_t window_max = fs->block_cache.capacity / 4 < READAHEAD_BLOCKS_MAX ? fs->block_cache.capacity / 4
+                                                                            : READAHEAD_BLOCKS_MAX;
+    size_t window = 0;
+    if (sequential) window = stream->window == 0 ? READAHEAD_BLOCKS_MIN : stream->window * 2;
+    if (window > window_max) window = window_max < READAHEAD_BLOCKS_MIN ? 0 : window_max;
+    if (window != stream->window) stats_set_readahead_window(&fs->stats, window);
+    stream->fs = fs;
+    stream->inode_idx = inode->idx;
+    stream->next_i = last + 1;
+    stream->next_block = last_block + 1;
+    stream->window = window;
+    if (window == 0) return 0;
+
+    *block_idxs = malloc(sizeof(size_t) * window);
+    if (*block_idxs == NULL) return 0;
+    size_t number = 0;
+    size_t next_block = last_block + 1;
+    for (size_t i = last + 1; i < inode->blocks_number && number < window; i++) {
+        (*block_idxs)[number++] = inode->blocks[i];
+        if (inode->blocks[i] >= next_block) next_block = inode->blocks[i] + 1;
+    }
+    pthread_mutex_lock(&fs->alloc_mutex);
+    while (number < window && next_block < fs->super_block.blocks_number) {
+        if (bitmap_read(&fs->blocks_bitmap, next_block) == 1) (*block_idxs)[number++] = next_block;
+        next_block++;
+    }
+    pthread_mutex_unlock(&fs->alloc_mutex);
 
-    // Reserve data block
-    for (size_t i = 0; i < blocks_required; i++) {
-        res = bitmap_set(fs->file, fs->blocks_bitmap_offset, block_idxs[i], 1);
-        if (res < 0) {
-            free(block_idxs);
-            return res;
-        }
+    number = bcache_missing(&fs->block_cache, *block_idxs, number);
+    if (number < window / 2 || number == 0) {
+        free(*block_idxs);
+        *block_idxs = NULL;
+        return 0;
     }
+    return number;
+}
 
-    res = file_fill_with_data(fs, inode_idx, block_idxs, blocks_required, content, content_length, dir_flag);
-    if (res < 0) {
-        free(block_idxs);
-        return res;
+// Adds a request per run of blocks adjacent in the image, reading them one after another into blocks
+static size_t file_read_ahead_requests(struct FS *fs, size_t *block_idxs, size_t blocks_number, char *blocks,
+                                       struct iovec *vectors, struct IoRequest *requests) {
+    size_t block_size = fs->super_block.block_size;
+    size_t requests_number = 0;
+    for (size_t k = 0; k < blocks_number; k++) {
+        if (k > 0 && block_idxs[k] == block_idxs[k - 1] + 1) {
+            requests[requests_number - 1].vectors->iov_len += block_size;
+            continue;
+        }
+        vectors[requests_number].iov_base = blocks + k * block_size;
+        vectors[requests_number].iov_len = block_size;
+        requests[requests_number].offset = fs->blocks_table_offset + block_idxs[k] * block_size;
+        requests[requests_number].vectors = &vectors[requests_number];
+        requests[requests_number].vectors_number = 1;
+        requests_number++;
     }
-    free(block_idxs);
-    return inode_idx;
+    return requests_number;
 }
 
-int file_update(struct FS *fs, size_t inode_idx, char *content, size_t new_content_length, size_t dir_flag) {
-    int res;
+// Transfers bytes [offset, offset + length) of the file to or from content. Cached blocks are served from and
+// written to the block cache. The rest is taken in image order, every run of blocks adjacent in the image becomes
+// one vectored request scattering over the parts of content they hold, so a file stored in one piece takes one
+// request whatever the order of its blocks. The requests go out as one batch, all in flight together with the
+// uring engine, and the whole blocks read are cached. Reads of regular files also carry the blocks read ahead of
+// their stream in the same batch. A file without blocks is transferred from or to its inline content instead, the
+// last block of a file with a packed tail from or to its part of the shared block
+static int file_blocks_io(struct FS *fs, struct Inode *inode, char *content, size_t offset, size_t length,
+                          int write) {
+    size_t block_size = fs->super_block.block_size;
+    size_t end = offset + length;
+    if (inode->blocks_number == 0) {
+        if (end > inode_inline_capacity(fs)) end = inode_inline_capacity(fs);
+        if (offset >= end) return 0;
+        if (write) {
+            memcpy(inode->inline_data + offset, content, end - offset);
+            inode_mark_dirty(inode);
+        } else {
+            memcpy(content, inode->inline_data + offset, end - offset);
+        }
+        return 0;
+    }
+    if (end > inode->blocks_number * block_size) end = inode->blocks_number * block_size;
+    if (inode->tail_offset != INODE_TAIL_NONE && end > inode->length) end = inode->length;
+    if (offset >= end) return 0;
+    size_t first = offset / block_size;
+    size_t blocks_number = (end - 1) / block_size - first + 1;
+
+    size_t *ahead = NULL;
+    size_t ahead_number = 0;
+    size_t generation;
+    if (!write && inode->dir_flag == 0 && bcache_prefetch_begin(&fs->block_cache, &generation)) {
+        ahead_number = file_read_ahead_blocks(fs, inode, first, first + blocks_number - 1, &ahead);
+    }
 
-    res = bitmap_read(fs->file, fs->inode_bitmap_offset, inode_idx);
-    if (res < 0) return res;
-    if (res != 1) return NOT_FOUND;
+    // Every block takes at most one vector and starts at most one request
+    struct FileBlockRef *refs = malloc(sizeof(struct FileBlockRef) * blocks_number);
+    struct iovec *vectors = malloc(sizeof(struct iovec) * (blocks_number + ahead_number));
+    struct IoRequest *requests = malloc(sizeof(struct IoRequest) * (blocks_number + ahead_number));
+    char *ahead_blocks = ahead_number > 0 ? malloc(ahead_number * block_size) : NULL;
+    if (refs == NULL || vectors == NULL || requests == NULL || (ahead_number > 0 && ahead_blocks == NULL)) {
+        free(refs);
+        free(vectors);
+        free(requests);
+        free(ahead);
+        free(ahead_blocks);
+        return NO_SPACE;
+    }
+    if (write) bcache_write_begin(&fs->block_cache);
+    int sorted = 1;
+    size_t missed = 0;
+    int res = 0;
+    for (size_t i = first; i < first + blocks_number && res >= 0; i++) {
+        size_t block_idx = inode->blocks[i];
+        size_t piece_begin = i * block_size > offset ? i * block_size : offset;
+        size_t piece_end = (i + 1) * block_size < end ? (i + 1) * block_size : end;
+        size_t begin = piece_begin - i * block_size + file_block_shift(inode, i);
+        size_t block_end = begin + (piece_end - piece_begin);
+        char *buffer = content + (piece_begin - offset);
+        if (write) {
+            if (bcache_write(&fs->block_cache, &fs->io, block_idx, begin, block_end, buffer)) continue;
+        } else {
+            if (bcache_read(&fs->block_cache, block_idx, begin, block_end, buffer)) continue;
+            if (fs->block_cache.capacity > 0 && piece_end - piece_begin < block_size) {
+                res = file_block_read_through(fs, inode, block_idx, begin, block_end, buffer,
+                                              file_block_shared(inode, i));
+                continue;
+            }
+        }
+        refs[missed].block = block_idx;
+        refs[missed].i = i;
+        if (missed > 0 && refs[missed].block < refs[missed - 1].block) sorted = 0;
+        missed++;
+    }
+    // Files written in one go are laid out in order, only reshuffled ones need the sort
+    if (!sorted) qsort(refs, missed, sizeof(struct FileBlockRef), file_by_block);
+    blocks_number = missed;
+
+    size_t requests_number = 0;
+    size_t vectors_used = 0;
+    size_t k = 0;
+    while (k < blocks_number) {
+        struct FileBlockRef *run_first = &refs[k];
+        size_t begin = run_first->i * block_size > offset ? run_first->i * block_size : offset;
+        struct IoRequest *request = &requests[requests_number];
+        request->offset = fs->blocks_table_offset + run_first->block * block_size + begin % block_size +
+                          file_block_shift(inode, run_first->i);
+        request->vectors = vectors + vectors_used;
+        request->vectors_number = 0;
+        size_t previous_end = 0;
+
+        // Extend while the next block in image order follows the previous one and both are transferred whole
+        // where they meet. A packed tail only follows at the start of its shared block
+        for (; k < blocks_number; k++) {
+            struct FileBlockRef *ref = &refs[k];
+            size_t piece_begin = ref->i * block_size > offset ? ref->i * block_size : offset;
+            size_t piece_end = (ref->i + 1) * block_size < end ? (ref->i + 1) * block_size : end;
+            if (ref != run_first) {
+                struct FileBlockRef *previous = ref - 1;
+                if (ref->block != previous->block + 1 || piece_begin % block_size != 0) break;
+                if (previous_end != (previous->i + 1) * block_size) break;
+                if (file_block_shift(inode, ref->i) != 0) break;
+            }
+            if (request->vectors_number > 0 && ref->i == (ref - 1)->i + 1) {
+                request->vectors[request->vectors_number - 1].iov_len += piece_end - piece_begin;
+            } else if (request->vectors_number < IO_VECTORS_MAX) {
+                request->vectors[request->vectors_number].iov_base = content + (piece_begin - offset);
+                request->vectors[request->vectors_number].iov_len = piece_end - piece_begin;
+                request->vectors_number++;
+            } else {
+                break;
+            }
+            previous_end = piece_end;
+        }
+        vectors_used += request->vectors_number;
+        requests_number++;
+    }
 
-    size_t content_length;
-    size_t old_dir_flag;
+    size_t demand_number = requests_number;
+    requests_number += file_read_ahead_requests(fs, ahead, ahead_number, ahead_blocks, vectors + vectors_used,
+                                                requests + requests_number);
 
-    fseek(fs->file, fs->inode_table_offset + inode_idx * fs->super_block.inode_size, SEEK_SET);
-    if (fread(&old_dir_flag, sizeof(size_t), 1, fs->file) != 1) return READ_FAILURE;
-    if (old_dir_flag != dir_flag) return WRONG_FILE_TYPE;
-    if (fread(&content_length, sizeof(size_t), 1, fs->file) != 1) return READ_FAILURE;
+    uint64_t started = trace_begin();
+    if (res >= 0) res = io_submit(&fs->io, requests, requests_number, write);
+    if (write) bcache_write_end(&fs->block_cache);
+    for (size_t k = 0; k < blocks_number && res >= 0 && !write; k++) {
+        if (refs[k].i * block_size < offset || (refs[k].i + 1) * block_size > end) continue;
+        res = bcache_fill(&fs->block_cache, &fs->io, refs[k].block, content + (refs[k].i * block_size - offset));
+    }
+    if (res >= 0 && ahead_number > 0) {
+        bcache_prefetch_fill(&fs->block_cache, &fs->io, generation, ahead, ahead_number, ahead_blocks);
+    }
+    for (size_t i = 0; i < requests_number && started != 0; i++) {
+        size_t request_length = 0;
+        for (int j = 0; j < requests[i].vectors_number; j++) request_length += requests[i].vectors[j].iov_len;
+        int ahead_request = i >= demand_number;
+        trace_end(started, ahead_request ? TRACE_OP_READ_AHEAD : write ? TRACE_OP_FILE_WRITE : TRACE_OP_FILE_READ,
+                  ahead_request ? TRACE_NONE : inode->idx, (requests[i].offset - fs->blocks_table_offset) / block_size,
+                  requests[i].offset, request_length);
+    }
+    free(refs);
+    free(vectors);
+    free(requests);
+    free(ahead);
+    free(ahead_blocks);
+    return res;
+}
 
-    size_t blocks_required = content_length / fs->super_block.block_size + 1;
-    size_t *block_idxs = malloc(sizeof(size_t) * blocks_required);
-    if (fread(block_idxs, sizeof(size_t), blocks_required, fs->file) != blocks_required) {
-        free(block_idxs);
-        return READ_FAILURE;
+static int file_reserve_blocks(struct FS *fs, size_t *block_idxs, size_t blocks_number) {
+    for (size_t i = 0; i < blocks_number; i++) {
+        int res = bitmap_set(&fs->blocks_bitmap, block_idxs[i], 1);
+        if (res < 0) return res;
     }
+    return 0;
+}
 
-    size_t new_blocks_required = new_content_length / fs->super_block.block_size + 1;
-    size_t *new_block_idxs = malloc(sizeof(size_t) * new_blocks_required);
+static int file_release_blocks(struct FS *fs, size_t *block_idxs, size_t blocks_number) {
+    size_t i = 0;
+    while (i < blocks_number) {
+        size_t run = 1;
+        while (i + run < blocks_number && block_idxs[i + run] == block_idxs[i] + run) run++;
 
-    if (new_blocks_required < blocks_required) {
-        for (size_t i = new_blocks_required; i < blocks_required; i++) {
-            res = bitmap_set(fs->file, fs->blocks_bitmap_offset, block_idxs[i], 0);
-            if (res < 0) {
-                free(block_idxs);
-                free(new_block_idxs);
-                return res;
-            }
+        for (size_t j = i; j < i + run; j++) {
+            int res = bitmap_set(&fs->blocks_bitmap, block_idxs[j], 0);
+            if (res < 0) return res;
+            bcache_drop(&fs->block_cache, block_idxs[j]);
         }
-        memcpy(new_block_idxs, block_idxs, sizeof(size_t) * new_blocks_required);
-    } else if (new_blocks_required > blocks_required) {
-        size_t extra_blocks_required = new_blocks_required - blocks_required;
-
-        if (sizeof(size_t) * (new_blocks_required + 2) > fs->super_block.inode_size) {
-            free(block_idxs);
-            free(new_block_idxs);
-            return NO_SPACE;
+        int res = extents_release(&fs->free_extents, block_idxs[i], run);
+        if (res < 0) return res;
+        i += run;
+    }
+    return 0;
+}
+
+// Grows or shrinks the file to blocks_required data blocks, allocating or releasing indirect blocks as needed.
+// Called with the allocator mutex held
+static int file_resize_own(struct FS *fs, struct Inode *inode, size_t blocks_required) {
+    size_t blocks_number = inode->blocks_number;
+    size_t meta_number = inode->meta_number;
+    size_t meta_required;
+    int res = inode_meta_number(fs, blocks_required, &meta_required);
+    if (res < 0) return res;
+
+    if (blocks_required < blocks_number) {
+        res = file_release_blocks(fs, inode->blocks + blocks_required, blocks_number - blocks_required);
+        if (res < 0) return res;
+    }
+    if (meta_required < meta_number) {
+        res = file_release_blocks(fs, inode->meta + meta_required, meta_number - meta_required);
+        if (res < 0) return res;
+    }
+    res = inode_resize(inode, blocks_required, meta_required);
+    if (res < 0) return res;
+
+    if (blocks_required > blocks_number) {
+        // Keep growing files contiguous, indirect blocks are taken separately so they do not split the data
+        size_t extra_blocks_required = blocks_required - blocks_number;
+        size_t *extra_block_idxs = inode->blocks + blocks_number;
+        if (blocks_number > 0) {
+            res = extents_alloc_after(&fs->free_extents, inode->blocks[blocks_number - 1], extra_block_idxs,
+                                      extra_blocks_required);
+        } else {
+            res = extents_alloc(&fs->free_extents, extra_block_idxs, extra_blocks_required);
         }
-        fseek(fs->file, fs->blocks_bitmap_offset, SEEK_SET);
-        size_t *extra_block_idxs = malloc(sizeof(size_t) * extra_blocks_required);
-        res = bitmap_find_first_free(fs->file, fs->blocks_bitmap_offset, fs->blocks_bitmap_length,
-                                     extra_block_idxs, extra_blocks_required);
+        if (res >= 0) res = file_reserve_blocks(fs, extra_block_idxs, extra_blocks_required);
         if (res < 0) {
-            free(block_idxs);
-            free(new_block_idxs);
-            free(extra_block_idxs);
+            inode_resize(inode, blocks_number, meta_required < meta_number ? meta_required : meta_number);
             return res;
         }
-
-        for (size_t i = 0; i < extra_blocks_required; i++) {
-            res = bitmap_set(fs->file, fs->blocks_bitmap_offset, extra_block_idxs[i], 1);
-            if (res < 0) {
-                free(block_idxs);
-                free(new_block_idxs);
-                free(extra_block_idxs);
-                return res;
+    }
+    if (meta_required > meta_number) {
+        size_t *extra_meta_idxs = inode->meta + meta_number;
+        res = extents_alloc(&fs->free_extents, extra_meta_idxs, meta_required - meta_number);
+        if (res >= 0) res = file_reserve_blocks(fs, extra_meta_idxs, meta_required - meta_number);
+        if (res < 0) {
+            if (blocks_required > blocks_number) {
+                file_release_blocks(fs, inode->blocks + blocks_number, blocks_required - blocks_number);
             }
+            inode_resize(inode, blocks_number, meta_number);
+            return res;
         }
+    }
+    return 0;
+}
 
-        memcpy(new_block_idxs, block_idxs, sizeof(size_t) * blocks_required);
-        memcpy(new_block_idxs + blocks_required, extra_block_idxs, sizeof(size_t) * extra_blocks_required);
+// Finds a place for a packed tail of tail_length bytes following the first blocks_required blocks of the file, in
+// place of its old tail when that has room. Called with the allocator mutex held
+static int file_place_tail(struct FS *fs, struct Inode *inode, size_t blocks_required, size_t tail_length,
+                           size_t old_block, size_t old_offset, size_t *block_idx, size_t *offset) {
+    if (old_offset != INODE_TAIL_NONE &&
+        tails_resize(&fs->tails, old_block, old_offset, inode->length % fs->super_block.block_size, tail_length) >= 0) {
+        *block_idx = old_block;
+        *offset = old_offset;
+        return 0;
+    }
+    size_t after = blocks_required > 0 ? inode->blocks[blocks_required - 1] : TAIL_AFTER_NONE;
+    return tails_alloc(&fs->tails, &fs->blocks_bitmap, &fs->free_extents, tail_length, after, block_idx, offset);
+}
 
-        free(extra_block_idxs);
-    } else {
-        memcpy(new_block_idxs, block_idxs, sizeof(size_t) * blocks_required);
+// Resizes the file to blocks_required data blocks of its own, followed by a packed tail of tail_length bytes unless
+// it is 0, or by one more block of its own when no shared block has room for the tail. Blocks are taken before any
+// is given back, a resize failing for want of space leaves the file as it was. The old tail is sized by the length,
+// callers set the new one after this. Called with the allocator mutex held
+static int file_resize_blocks(struct FS *fs, struct Inode *inode, size_t blocks_required, size_t tail_length) {
+    size_t old_block = 0;
+    size_t old_offset = inode->tail_offset;
+    if (old_offset != INODE_TAIL_NONE) {
+        old_block = inode->blocks[inode->blocks_number - 1];
+        inode->tail_offset = INODE_TAIL_NONE;
+        inode_resize(inode, inode->blocks_number - 1, inode->meta_number);
+    }
+    size_t blocks_number = inode->blocks_number;
+
+    int res = 0;
+    if (blocks_required > blocks_number) res = file_resize_own(fs, inode, blocks_required);
+    size_t tail_block = 0;
+    size_t tail_offset = INODE_TAIL_NONE;
+    if (res >= 0 && tail_length > 0 &&
+        file_place_tail(fs, inode, blocks_required, tail_length, old_block, old_offset, &tail_block,
+                        &tail_offset) < 0) {
+        tail_offset = INODE_TAIL_NONE;
+        blocks_required++;
+        if (blocks_required > inode->blocks_number) res = file_resize_own(fs, inode, blocks_required);
+    }
+    if (res < 0) {
+        file_resize_own(fs, inode, blocks_number);
+        if (old_offset != INODE_TAIL_NONE) {
+            inode_resize(inode, blocks_number + 1, inode->meta_number);
+            inode->blocks[blocks_number] = old_block;
+            inode->tail_offset = old_offset;
+        }
+        return res;
+    }
+
+    res = file_resize_own(fs, inode, blocks_required);
+    if (res >= 0 && tail_offset != INODE_TAIL_NONE) {
+        res = inode_resize(inode, blocks_required + 1, inode->meta_number);
+        if (res >= 0) {
+            inode->blocks[blocks_required] = tail_block;
+            inode->tail_offset = tail_offset;
+        } else if (tails_release(&fs->tails, &fs->blocks_bitmap, &fs->free_extents, tail_block, tail_offset,
+                                 tail_length) == 1) {
+            bcache_drop(&fs->block_cache, tail_block);
+        }
+    }
+    if (old_offset != INODE_TAIL_NONE && (old_block != tail_block || old_offset != tail_offset)) {
+        int release_res = tails_release(&fs->tails, &fs->blocks_bitmap, &fs->free_extents, old_block, old_offset,
+                                        inode->length % fs->super_block.block_size);
+        if (release_res == 1) bcache_drop(&fs->block_cache, old_block);
+        if (release_res < 0 && res >= 0) res = release_res;
     }
+    return res;
+}
+
+// Resizes within txn when given, so the old pointers can be restored if the operation fails later. The blocks
+// tracked count the packed tail
+static int file_resize_tail(struct FS *fs, struct Txn *txn, struct Inode *inode, size_t blocks_required,
+                            size_t tail_length) {
+    if (txn != NULL) {
+        int res = txn_track(txn, inode, blocks_required + (tail_length > 0), 0);
+        if (res < 0) return res;
+    }
+    pthread_mutex_lock(&fs->alloc_mutex);
+    int res = file_resize_blocks(fs, inode, blocks_required, tail_length);
+    pthread_mutex_unlock(&fs->alloc_mutex);
+    return res;
+}
+
+static int file_resize(struct FS *fs, struct Txn *txn, struct Inode *inode, size_t blocks_required) {
+    return file_resize_tail(fs, txn, inode, blocks_required, 0);
+}
+
+// Resizes the file for content of length bytes, packing its tail when it is small enough to share a block
+static int file_resize_for(struct FS *fs, struct Txn *txn, struct Inode *inode, size_t length) {
+    size_t blocks_required = file_blocks_required(fs, length);
+    if (!file_tail_packable(fs, length)) return file_resize(fs, txn, inode, blocks_required);
+    return file_resize_tail(fs, txn, inode, blocks_required - 1, length % fs->super_block.block_size);
+}
 
-    res = file_fill_with_data(fs, inode_idx, new_block_idxs, new_blocks_required, content, new_content_length,
-                              dir_flag);
-    free(block_idxs);
-    free(new_block_idxs);
+// Callers hold the inode lock, or the inode is not linked into any directory yet
+int file_fill_with_data(struct FS *fs, struct Txn *txn, size_t inode_idx, char *content, size_t content_length,
+                        size_t dir_flag) {
+    // Update cached inode, it is written back on flush
+    struct Inode *inode;
+    int res = inode_get(fs, inode_idx, &inode);
     if (res < 0) return res;
+    if (inode->dir_flag != dir_flag) {
+        inode_put(fs, inode);
+        return WRONG_FILE_TYPE;
+    }
 
-    return 0;
+    res = file_resize_for(fs, txn, inode, content_length);
+    if (res >= 0) {
+        inode->length = content_length;
+        // Write to data blocks
+        res = file_blocks_io(fs, inode, content, 0, content_length, 1);
+    }
+    inode_put(fs, inode);
+    return res;
 }
 
-int file_remove(struct FS *fs, size_t inode_idx, size_t dir_flag) {
-    size_t new_content_length;
-    size_t new_dir_flag;
+int file_add(struct FS *fs, struct Txn *txn, char *content, size_t content_length, size_t dir_flag) {
+    // Lengths and inode indexes are returned as int
+    if (content_length > INT_MAX) return NO_SPACE;
+
+    // Find and reserve free inode block
+    size_t inode_idx = 0;
+    pthread_mutex_lock(&fs->alloc_mutex);
+    struct StatsTimer timer;
+    stats_start(&timer);
+    int res = bitmap_find_first_free(&fs->inode_bitmap, &inode_idx, 1);
+    stats_finish(&fs->stats, STATS_OP_BITMAP_FIND, &timer, res, 0);
+    if (res >= 0) res = bitmap_set(&fs->inode_bitmap, inode_idx, 1);
+    pthread_mutex_unlock(&fs->alloc_mutex);
+    if (res < 0) return res;
 
-    fseek(fs->file, fs->inode_table_offset + inode_idx * fs->super_block.inode_size, SEEK_SET);
-    if (fread(&new_dir_flag, sizeof(size_t), 1, fs->file) != 1) return READ_FAILURE;
-    if (new_dir_flag != dir_flag) return WRONG_FILE_TYPE;
-    if (fread(&new_content_length, sizeof(size_t), 1, fs->file) != 1) return READ_FAILURE;
-    size_t blocks_required = new_content_length / fs->super_block.block_size + 1;
-    size_t *block_idxs = malloc(sizeof(size_t) * blocks_required);
-    if (fread(block_idxs, sizeof(size_t), blocks_required, fs->file) != blocks_required) {
-        free(block_idxs);
-        return READ_FAILURE;
+    struct Inode *inode;
+    res = inode_create(fs, inode_idx, dir_flag, &inode);
+    if (res < 0) {
+        pthread_mutex_lock(&fs->alloc_mutex);
+        bitmap_set(&fs->inode_bitmap, inode_idx, 0);
+        pthread_mutex_unlock(&fs->alloc_mutex);
+        return res;
+    }
+    // Once in a transaction the inode is released by its rollback, also when anything later in the operation fails
+    int tracked = 0;
+    if (txn != NULL) {
+        res = txn_track(txn, inode, 0, 1);
+        tracked = res >= 0;
+    }
+    if (res >= 0) res = file_fill_with_data(fs, NULL, inode_idx, content, content_length, dir_flag);
+    if (res < 0 && !tracked) {
+        file_resize(fs, NULL, inode, 0);
+        inode_forget(fs, inode_idx);
+        pthread_mutex_lock(&fs->alloc_mutex);
+        bitmap_set(&fs->inode_bitmap, inode_idx, 0);
+        pthread_mutex_unlock(&fs->alloc_mutex);
     }
+    inode_unlock(fs, inode);
+    if (res < 0) return res;
+    return inode_idx;
+}
 
-    int res = 0;
-    for (size_t i = 0; i < blocks_required; i++) {
-        res = bitmap_set(fs->file, fs->blocks_bitmap_offset, block_idxs[i], 0);
-        if (res < 0) {
-            free(block_idxs);
-            return res;
-        }
+int file_update(struct FS *fs, struct Txn *txn, size_t inode_idx, char *content, size_t new_content_length,
+                size_t dir_flag) {
+    if (new_content_length > INT_MAX) return NO_SPACE;
+    return file_fill_with_data(fs, txn, inode_idx, content, new_content_length, dir_flag);
+}
+
+int file_remove(struct FS *fs, size_t inode_idx, size_t dir_flag) {
+    struct Inode *inode;
+    int res = inode_get(fs, inode_idx, &inode);
+    if (res < 0) return res;
+    if (inode->dir_flag != dir_flag) {
+        inode_put(fs, inode);
+        return WRONG_FILE_TYPE;
     }
 
-    res = bitmap_set(fs->file, fs->inode_bitmap_offset, inode_idx, 0);
-    fseek(fs->file, fs->inode_bitmap_offset + inode_idx / 8, SEEK_SET);
-    free(block_idxs);
+    res = file_resize(fs, NULL, inode, 0);
+    if (res >= 0) {
+        // Forget the cached inode before its index can be taken again
+        inode_forget(fs, inode_idx);
+        pthread_mutex_lock(&fs->alloc_mutex);
+        res = bitmap_set(&fs->inode_bitmap, inode_idx, 0);
+        pthread_mutex_unlock(&fs->alloc_mutex);
+    }
+    inode_put(fs, inode);
     if (res < 0) return res;
     return 0;
 }
 
 int file_is_dir(struct FS* fs, size_t inode_idx) {
-    if (bitmap_read(fs->file, fs->inode_bitmap_offset, inode_idx) == 0) return NOT_FOUND;
+    struct Inode *inode;
+    int res = inode_get(fs, inode_idx, &inode);
+    if (res < 0) return res;
+    res = inode->dir_flag;
+    inode_put(fs, inode);
+    return res;
+}
 
-    size_t new_dir_flag;
+int file_size(struct FS* fs, size_t inode_idx, size_t dir_flag) {
+    struct Inode *inode;
+    int res = inode_get(fs, inode_idx, &inode);
+    if (res < 0) return res;
+    res = inode->dir_flag != dir_flag ? WRONG_FILE_TYPE : (int) inode->length;
+    inode_put(fs, inode);
+    return res;
+}
 
-    fseek(fs->file, fs->inode_table_offset + inode_idx * fs->super_block.inode_size, SEEK_SET);
-    if (fread(&new_dir_flag, sizeof(size_t), 1, fs->file) != 1) return READ_FAILURE;
-    return new_dir_flag;
+int file_read(struct FS *fs, size_t inode_idx, char *content, size_t content_length, size_t dir_flag) {
+    struct Inode *inode;
+    int res = inode_get(fs, inode_idx, &inode);
+    if (res < 0) return res;
+    if (inode->dir_flag != dir_flag) {
+        res = WRONG_FILE_TYPE;
+    } else if (inode->length > content_length) {
+        res = TOO_SMALL_BUFFER;
+    } else {
+        res = file_blocks_io(fs, inode, content, 0, inode->length, 0);
+    }
+    inode_put(fs, inode);
+    return res;
 }
 
-int file_size(struct FS* fs, size_t inode_idx, size_t dir_flag) {
-    if (bitmap_read(fs->file, fs->inode_bitmap_offset, inode_idx) == 0) return NOT_FOUND;
+int file_pread(struct FS *fs, size_t inode_idx, char *content, size_t length, size_t offset, size_t dir_flag) {
+    struct Inode *inode;
+    int res = inode_get(fs, inode_idx, &inode);
+    if (res < 0) return res;
+    if (inode->dir_flag != dir_flag) {
+        inode_put(fs, inode);
+        return WRONG_FILE_TYPE;
+    }
+    if (offset >= inode->length) {
+        length = 0;
+    } else if (length > inode->length - offset) {
+        length = inode->length - offset;
+    }
 
-    size_t new_dir_flag;
+    res = file_blocks_io(fs, inode, content, offset, length, 0);
+    inode_put(fs, inode);
+    if (res < 0) return res;
+    return length;
+}
 
-    fseek(fs->file, fs->inode_table_offset + inode_idx * fs->super_block.inode_size, SEEK_SET);
-    if (fread(&new_dir_flag, sizeof(size_t), 1, fs->file) != 1) return READ_FAILURE;
-    if (new_dir_flag != dir_flag) return WRONG_FILE_TYPE;
+// Zeroes bytes [from, to) of the file, they may hold stale data of released or newly allocated blocks
+static int file_zero(struct FS *fs, struct Inode *inode, size_t from, size_t to) {
+    size_t block_size = fs->super_block.block_size;
+    char *zeros = calloc(block_size, 1);
+    int res = 0;
+    while (from < to && res >= 0) {
+        size_t length = block_size - from % block_size;
+        if (length > to - from) length = to - from;
+        res = file_blocks_io(fs, inode, zeros, from, length, 1);
+        from += length;
+    }
+    free(zeros);
+    return res;
+}
 
-    size_t new_content_length;
-    if (fread(&new_content_length, sizeof(size_t), 1, fs->file) != 1) return READ_FAILURE;
-    return new_content_length;
+// Moves the content between the inode slot, data blocks and a shared tail block for a new length, keeping the bytes
+// before it and zeroing the ones after the old length
+static int file_move(struct FS *fs, struct Txn *txn, struct Inode *inode, size_t length) {
+    size_t kept = inode->length < length ? inode->length : length;
+    char *content = calloc(length + 1, 1);
+    if (content == NULL) return NO_SPACE;
+    int res = file_blocks_io(fs, inode, content, 0, kept, 0);
+    if (res >= 0) res = file_resize_for(fs, txn, inode, length);
+    if (res >= 0) {
+        inode->length = length;
+        inode_mark_dirty(inode);
+        res = file_blocks_io(fs, inode, content, 0, length, 1);
+    }
+    free(content);
+    return res;
 }
 
-int file_read(struct FS *fs, size_t inode_idx, char *content, size_t content_length, size_t dir_flag) {
-    size_t new_content_length;
-    size_t new_dir_flag;
-
-    if (bitmap_read(fs->file, fs->inode_bitmap_offset, inode_idx) == 0) return NOT_FOUND;
-
-    fseek(fs->file, fs->inode_table_offset + inode_idx * fs->super_block.inode_size, SEEK_SET);
-    if (fread(&new_dir_flag, sizeof(size_t), 1, fs->file) != 1) return READ_FAILURE;
-    if (new_dir_flag != dir_flag) return WRONG_FILE_TYPE;
-    if (fread(&new_content_length, sizeof(size_t), 1, fs->file) != 1) return READ_FAILURE;
-    if (new_content_length > content_length) {
-        return TOO_SMALL_BUFFER;
-    }
-    size_t blocks_required = new_content_length / fs->super_block.block_size + 1;
-    size_t *block_idxs = malloc(sizeof(size_t) * blocks_required);
-    if (fread(block_idxs, sizeof(size_t), blocks_required, fs->file) != blocks_required) {
-        free(block_idxs);
-        return READ_FAILURE;
-    }
-
-    for (size_t i = 0; i < blocks_required - 1; i++) {
-        fseek(fs->file, fs->blocks_table_offset + block_idxs[i] * fs->super_block.block_size, SEEK_SET);
-        if (fread(content + i * fs->super_block.block_size, fs->super_block.block_size, 1, fs->file) != 1) {
-            free(block_idxs);
-            return READ_FAILURE;
-        }
+// Sets the file length, dropping blocks past it or extending the file with zeroes. Content moves inline into the
+// inode slot once it fits there and out to data blocks once it does not. A packed tail is sized for the length,
+// the file is moved to change it
+static int file_set_length(struct FS *fs, struct Txn *txn, struct Inode *inode, size_t length) {
+    if (length > INT_MAX) return NO_SPACE;
+    size_t blocks_required = file_blocks_required(fs, length);
+    if ((blocks_required == 0) != (inode->blocks_number == 0) || inode->tail_offset != INODE_TAIL_NONE) {
+        return file_move(fs, txn, inode, length);
     }
-    fseek(fs->file, fs->blocks_table_offset + block_idxs[blocks_required - 1] * fs->super_block.block_size, SEEK_SET);
-    if (fread(content + (blocks_required - 1) * fs->super_block.block_size,
-              new_content_length % fs->super_block.block_size, 1, fs->file) != 1) {
-        free(block_idxs);
-        return READ_FAILURE;
+    int res = file_resize(fs, txn, inode, blocks_required);
+    if (res < 0) return res;
+    if (length > inode->length) {
+        res = file_zero(fs, inode, inode->length, length);
+        if (res < 0) return res;
+    }
+    inode->length = length;
+    inode_mark_dirty(inode);
+    return 0;
+}
+
+// Writes only the blocks covering [offset, offset + length), growing the file if the range ends past it
+int file_pwrite(struct FS *fs, struct Txn *txn, size_t inode_idx, char *content, size_t length, size_t offset,
+                size_t dir_flag) {
+    struct Inode *inode;
+    int res = inode_get(fs, inode_idx, &inode);
+    if (res < 0) return res;
+    if (inode->dir_flag != dir_flag) {
+        res = WRONG_FILE_TYPE;
+    } else if (length > INT_MAX || offset > INT_MAX - length) {
+        res = NO_SPACE;
+    } else if (offset + length > inode->length) {
+        res = file_set_length(fs, txn, inode, offset + length);
     }
 
-    free(block_idxs);
+    if (res >= 0) res = file_blocks_io(fs, inode, content, offset, length, 1);
+    inode_put(fs, inode);
+    if (res < 0) return res;
+    return length;
+}
+
+int file_append(struct FS *fs, struct Txn *txn, size_t inode_idx, char *content, size_t length, size_t dir_flag) {
+    struct Inode *inode;
+    int res = inode_get(fs, inode_idx, &inode);
+    if (res < 0) return res;
+    size_t offset = inode->length;
+    inode_put(fs, inode);
+    return file_pwrite(fs, txn, inode_idx, content, length, offset, dir_flag);
+}
+
+int file_truncate(struct FS *fs, struct Txn *txn, size_t inode_idx, size_t length, size_t dir_flag) {
+    struct Inode *inode;
+    int res = inode_get(fs, inode_idx, &inode);
+    if (res < 0) return res;
+    res = inode->dir_flag != dir_flag ? WRONG_FILE_TYPE : file_set_length(fs, txn, inode, length);
+    inode_put(fs, inode);
+    return res;
+}
+
+// Gives back the pointers past blocks_number and sets the length, undoing the resizes of a transaction. A tail
+// packed for the same length is kept. Called with the inode locked for writing, or unlinked
+int file_restore(struct FS *fs, struct Inode *inode, size_t blocks_number, size_t length) {
+    if (inode->tail_offset != INODE_TAIL_NONE && inode->blocks_number == blocks_number && inode->length == length) {
+        return 0;
+    }
+    int res = file_resize(fs, NULL, inode, blocks_number);
+    if (res < 0) return res;
+    inode->length = length;
+    inode_mark_dirty(inode);
     return 0;
 }
+
+// Finds where the content of a file starts in the image if its blocks follow each other, so it can be read
+// with a single transfer. A packed tail follows them only at the start of its shared block, unless it is all the
+// content. Returns the length, FRAGMENTED if the blocks are scattered or the content is inline
+int file_extent(struct FS *fs, size_t inode_idx, size_t dir_flag, size_t *image_offset) {
+    struct Inode *inode;
+    int res = inode_get(fs, inode_idx, &inode);
+    if (res < 0) return res;
+    size_t block_size = fs->super_block.block_size;
+    size_t used_blocks = (inode->length + block_size - 1) / block_size;
+    if (inode->dir_flag != dir_flag) {
+        res = WRONG_FILE_TYPE;
+    } else if (inode->length > INT_MAX || inode->blocks_number == 0) {
+        res = FRAGMENTED;
+    } else {
+        res = inode->length;
+        for (size_t i = 1; i < used_blocks; i++) {
+            if (inode->blocks[i] != inode->blocks[0] + i || file_block_shift(inode, i) != 0) {
+                res = FRAGMENTED;
+                break;
+            }
+        }
+        *image_offset = fs->blocks_table_offset + inode->blocks[0] * block_size + file_block_shift(inode, 0);
+    }
+    inode_put(fs, inode);
+    return res;
+}
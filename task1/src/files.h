@@ -1,8 +1,25 @@
 #ifndef TASK1_FILES_H
 #define TASK1_FILES_H
 
+#include <pthread.h>
 #include <stdio.h>
 
+#include "bcache.h"
+#include "bitmaps.h"
+#include "dcache.h"
+#include "extents.h"
+#include "inodes.h"
+#include "io.h"
+#include "stats.h"
+#include "tails.h"
+#include "txn.h"
+
+// Read-ahead window of a read stream in blocks, it starts at the minimum and doubles with every sequential read
+#define READAHEAD_BLOCKS_MIN 4
+#ifndef READAHEAD_BLOCKS_MAX
+#define READAHEAD_BLOCKS_MAX 64
+#endif
+
 struct SuperBlock {
     size_t blocks_number;
     size_t inodes_number;
@@ -13,7 +30,7 @@ struct SuperBlock {
 };
 
 struct FS {
-    FILE *file;
+    struct Io io;
     struct SuperBlock super_block;
     size_t inode_bitmap_length;
     size_t blocks_bitmap_length;
@@ -24,14 +41,29 @@ struct FS {
     size_t blocks_bitmap_offset;
     size_t inode_table_offset;
     size_t blocks_table_offset;
+
+    struct Bitmap inode_bitmap;
+    struct Bitmap blocks_bitmap;
+    struct ExtentIndex free_extents;
+    struct TailIndex tails;
+    struct InodeCache inode_cache;
+    struct DentryCache dentry_cache;
+    struct BlockCache block_cache;
+
+    // Guards both bitmaps, the free extents and the tails. Lock order: inode locks, parent before child, then the inode
+    // cache mutex, then this
+    pthread_mutex_t alloc_mutex;
+
+    struct Stats stats;
 };
 
-int file_fill_with_data(struct FS *fs, size_t inode_idx, size_t *block_idxs, size_t blocks_required, char *content,
-                        size_t content_length, size_t dir_flag);
+int file_fill_with_data(struct FS *fs, struct Txn *txn, size_t inode_idx, char *content, size_t content_length,
+                        size_t dir_flag);
 
-int file_add(struct FS *fs, char *content, size_t content_length, size_t dir_flag);
+int file_add(struct FS *fs, struct Txn *txn, char *content, size_t content_length, size_t dir_flag);
 
-int file_update(struct FS *fs, size_t inode_idx, char *content, size_t new_content_length, size_t dir_flag);
+int file_update(struct FS *fs, struct Txn *txn, size_t inode_idx, char *content, size_t new_content_length,
+                size_t dir_flag);
 
 int file_remove(struct FS *fs, size_t inode_idx, size_t dir_flag);
 
@@ -41,4 +73,17 @@ int file_size(struct FS* fs, size_t inode_idx, size_t dir_flag);
 
 int file_read(struct FS *fs, size_t inode_idx, char *content, size_t content_length, size_t dir_flag);
 
+int file_pread(struct FS *fs, size_t inode_idx, char *content, size_t length, size_t offset, size_t dir_flag);
+
+int file_pwrite(struct FS *fs, struct Txn *txn, size_t inode_idx, char *content, size_t length, size_t offset,
+                size_t dir_flag);
+
+int file_append(struct FS *fs, struct Txn *txn, size_t inode_idx, char *content, size_t length, size_t dir_flag);
+
+int file_restore(struct FS *fs, struct Inode *inode, size_t blocks_number, size_t length);
+
+int file_extent(struct FS *fs, size_t inode_idx, size_t dir_flag, size_t *image_offset);
+
+int file_truncate(struct FS *fs, struct Txn *txn, size_t inode_idx, size_t length, size_t dir_flag);
+
 #endif //TASK1_FILES_H
@@ -5,207 +5,491 @@
 
 #include "exit_codes.h"
 #include "dirs.h"
+#include "fs.h"
 
 struct SuperBlock init_default_super_block() {
     struct SuperBlock super_block = {
-            1024,
-            256,
-            1024,
-            256,
-            1024,
+            FS_BLOCKS_NUMBER,
+            FS_INODES_NUMBER,
+            FS_BLOCKS_NUMBER,
+            FS_INODES_NUMBER,
+            FS_BLOCK_SIZE,
             128
     };
     return super_block;
 }
 
-int fs_add(struct FS *fs, char *path, char *content, size_t content_length) {
-    size_t current_dir_inode_idx = 0;
-    size_t word_start = 1;
-    size_t path_length = strlen(path);
-    int res;
+struct PathWalk {
+    size_t dir_inode_idx;
+    size_t word_start;
+    // The last directory of the path, left locked for the caller
+    struct Inode *dir;
+};
+
+// Resolves every '/'-terminated component among the first path_length bytes of path, creating missing
+// directories if create is set. Components are looked up in place, without copying them out of path.
+// Directories are locked hand over hand, the last one stays locked, for writing if write is set
+static int fs_walk(struct FS *fs, char *path, size_t path_length, int create, int write, struct PathWalk *walk) {
+    walk->dir_inode_idx = 0;
+    walk->word_start = 1;
 
     if (path[0] != '/') return NOT_FOUND;
+    size_t last_slash = 0;
     for (size_t i = 1; i < path_length; i++) {
+        if (path[i] == '/') last_slash = i;
+    }
+
+    int dir_write = write && last_slash == 0;
+    int res = inode_lock(fs, 0, dir_write, &walk->dir);
+    if (res < 0) return res;
+    for (size_t i = 1; i <= last_slash; i++) {
         if (path[i] == '/') {
-            if (i - word_start == 0) return NOT_FOUND;
-            char *dirname = malloc(i - word_start + 1);
-            memcpy(dirname, path + word_start, i - word_start);
-            dirname[i - word_start] = '\0';
-            res = dir_find(fs, dirname, current_dir_inode_idx);
-            if (res == NOT_FOUND) {
-                res = dir_init(fs);
+            size_t name_length = i - walk->word_start;
+            if (name_length == 0) {
+                res = NOT_FOUND;
+                break;
+            }
+            res = dir_find(fs, path + walk->word_start, name_length, walk->dir_inode_idx);
+            if (res == NOT_FOUND && create && !dir_write) {
+                // Relock for writing and look again, someone may have added it meanwhile
+                inode_unlock(fs, walk->dir);
+                dir_write = 1;
+                res = inode_lock(fs, walk->dir_inode_idx, 1, &walk->dir);
+                if (res < 0) return res;
+                res = dir_find(fs, path + walk->word_start, name_length, walk->dir_inode_idx);
+            }
+            if (res == NOT_FOUND && create) {
+                // Every created directory is committed on its own, they stay even if the operation fails later
+                struct Txn txn;
+                txn_begin(&txn, fs);
+                res = dir_init(fs, &txn);
                 if (res >= 0) {
-                    int res2 = dir_add(fs, dirname, res, current_dir_inode_idx);
-                    if (res2 < 0) {
-                        free(dirname);
-                        return res;
-                    }
+                    int res2 = dir_add(fs, &txn, path + walk->word_start, name_length, res, walk->dir_inode_idx);
+                    if (res2 < 0) res = res2;
+                }
+                if (res < 0) {
+                    txn_rollback(&txn);
+                } else {
+                    txn_commit(&txn);
                 }
             }
-            free(dirname);
-            if (res < 0) return res;
-            current_dir_inode_idx = res;
-            word_start = i + 1;
+            if (res < 0) break;
+
+            struct Inode *child;
+            int child_write = write && i == last_slash;
+            int child_idx = res;
+            res = inode_lock(fs, child_idx, child_write, &child);
+            if (res < 0) break;
+            inode_unlock(fs, walk->dir);
+            walk->dir = child;
+            dir_write = child_write;
+            walk->dir_inode_idx = child_idx;
+            walk->word_start = i + 1;
         }
     }
+    if (res < 0) {
+        inode_unlock(fs, walk->dir);
+        return res;
+    }
+    return 0;
+}
+
+// Paths are absolute, checked before anything indexes into them
+static int fs_path_valid(char *path, size_t path_length) {
+    return path_length > 0 && path[0] == '/';
+}
+
+// Resolves path to a file and locks it, directories are rejected
+static int fs_lock_file(struct FS *fs, char *path, int write, struct Inode **inode) {
+    size_t path_length = strlen(path);
+    if (!fs_path_valid(path, path_length)) return NOT_FOUND;
+    struct PathWalk walk;
+    int res = fs_walk(fs, path, path_length, 0, 0, &walk);
+    if (res < 0) return res;
+
+    if (path[path_length - 1] == '/') {
+        res = WRONG_FILE_TYPE;
+    } else {
+        res = dir_find_file(fs, path + walk.word_start, path_length - walk.word_start, walk.dir_inode_idx);
+    }
+    if (res >= 0) {
+        size_t file_inode_idx = res;
+        res = inode_lock(fs, file_inode_idx, write, inode);
+        if (res >= 0) res = file_inode_idx;
+    }
+    inode_unlock(fs, walk.dir);
+    return res;
+}
+
+static int fs_add_impl(struct FS *fs, char *path, char *content, size_t content_length, struct Inode **file) {
+    size_t path_length = strlen(path);
+    if (!fs_path_valid(path, path_length)) return NOT_FOUND;
+    if (file != NULL && path[path_length - 1] == '/') return WRONG_FILE_TYPE;
+    struct PathWalk walk;
+    int res = fs_walk(fs, path, path_length, 1, 1, &walk);
+    if (res < 0) return res;
 
     if (path[path_length - 1] != '/') {
-        res = file_add(fs, content, content_length, 0);
-        if (res < 0) return res;
-        res = dir_add(fs, path + word_start, res, current_dir_inode_idx);
-        if (res < 0) return res;
+        struct Txn txn;
+        txn_begin(&txn, fs);
+        int file_inode_idx = file_add(fs, &txn, content, content_length, 0);
+        res = file_inode_idx;
+        if (res >= 0) {
+            res = dir_add(fs, &txn, path + walk.word_start, path_length - walk.word_start, file_inode_idx,
+                          walk.dir_inode_idx);
+        }
+        // Pinned while the directory is still locked, nobody can have removed the file yet
+        if (res >= 0 && file != NULL) res = inode_get(fs, file_inode_idx, file);
+        if (res < 0) {
+            txn_rollback(&txn);
+        } else {
+            txn_commit(&txn);
+        }
     }
 
+    inode_unlock(fs, walk.dir);
+    if (res < 0) return res;
     return 0;
 }
 
-int fs_update(struct FS *fs, char *path, char *content, size_t content_length) {
-    size_t current_dir_inode_idx = 0;
-    size_t word_start = 1;
+int fs_add(struct FS *fs, char *path, char *content, size_t content_length) {
+    return fs_add_pinned(fs, path, content, content_length, NULL);
+}
+
+// Adds a file like fs_add and leaves it pinned in file, unless that is NULL. Its content can then be written with
+// fs_pwrite_pinned even after the path is removed or added again, until fs_unpin
+int fs_add_pinned(struct FS *fs, char *path, char *content, size_t content_length, struct Inode **file) {
+    struct StatsTimer timer;
+    stats_start(&timer);
+    int res = fs_add_impl(fs, path, content, content_length, file);
+    int flush_res = fs_flush(fs);
+    if (res >= 0 && flush_res < 0) {
+        res = flush_res;
+        if (file != NULL) fs_unpin(fs, *file);
+    }
+    stats_finish(&fs->stats, STATS_OP_ADD, &timer, res, content_length);
+    return res;
+}
+
+static int fs_update_impl(struct FS *fs, char *path, char *content, size_t content_length, struct Inode **file) {
     size_t path_length = strlen(path);
-    int res;
+    if (!fs_path_valid(path, path_length)) return NOT_FOUND;
+    struct PathWalk walk;
+    int res = fs_walk(fs, path, path_length, 1, 0, &walk);
+    if (res < 0) return res;
+    if (path[path_length - 1] == '/') {
+        inode_unlock(fs, walk.dir);
+        return WRONG_FILE_TYPE;
+    }
 
-    if (path[0] != '/') return NOT_FOUND;
-    for (size_t i = 1; i < path_length; i++) {
-        if (path[i] == '/') {
-            if (i - word_start == 0) return NOT_FOUND;
-            char *dirname = malloc(i - word_start + 1);
-            memcpy(dirname, path + word_start, i - word_start);
-            dirname[i - word_start] = '\0';
-            res = dir_find(fs, dirname, current_dir_inode_idx);
-            if (res == NOT_FOUND) {
-                res = dir_init(fs);
-                if (res >= 0) {
-                    int res2 = dir_add(fs, dirname, res, current_dir_inode_idx);
-                    if (res2 < 0) {
-                        free(dirname);
-                        return res2;
-                    }
-                }
-            }
-            free(dirname);
-            if (res < 0) return res;
-            current_dir_inode_idx = res;
-            word_start = i + 1;
+    int file_inode_idx = dir_find(fs, path + walk.word_start, path_length - walk.word_start, walk.dir_inode_idx);
+    struct Inode *inode;
+    res = file_inode_idx;
+    if (res >= 0) res = inode_lock(fs, file_inode_idx, 1, &inode);
+    inode_unlock(fs, walk.dir);
+    if (res < 0) return res;
+
+    struct Txn txn;
+    txn_begin(&txn, fs);
+    res = file_update(fs, &txn, file_inode_idx, content, content_length, 0);
+    if (res < 0) {
+        txn_rollback(&txn);
+    } else {
+        txn_commit(&txn);
+        if (file != NULL) {
+            inode_pin(fs, inode);
+            *file = inode;
         }
     }
+    inode_unlock(fs, inode);
+    if (res < 0) return res;
+    return 0;
+}
 
+int fs_update(struct FS *fs, char *path, char *content, size_t content_length) {
+    return fs_update_pinned(fs, path, content, content_length, NULL);
+}
+
+// Updates a file like fs_update and leaves it pinned in file, unless that is NULL, as fs_add_pinned does
+int fs_update_pinned(struct FS *fs, char *path, char *content, size_t content_length, struct Inode **file) {
+    struct StatsTimer timer;
+    stats_start(&timer);
+    int res = fs_update_impl(fs, path, content, content_length, file);
+    int flush_res = fs_flush(fs);
+    if (res >= 0 && flush_res < 0) {
+        res = flush_res;
+        if (file != NULL) fs_unpin(fs, *file);
+    }
+    stats_finish(&fs->stats, STATS_OP_UPDATE, &timer, res, content_length);
+    return res;
+}
+
+static int fs_size_impl(struct FS *fs, char *path) {
+    size_t path_length = strlen(path);
+    if (!fs_path_valid(path, path_length)) return NOT_FOUND;
     if (path[path_length - 1] != '/') {
-        int file_inode_idx = dir_find(fs, path + word_start, current_dir_inode_idx);
+        struct Inode *inode;
+        int file_inode_idx = fs_lock_file(fs, path, 0, &inode);
         if (file_inode_idx < 0) return file_inode_idx;
-        res = file_update(fs, file_inode_idx, content, content_length, 0);
-        if (res < 0) return res;
-    } else {
-        return WRONG_FILE_TYPE;
+        int res = file_size(fs, file_inode_idx, 0);
+        inode_unlock(fs, inode);
+        return res;
     }
 
-    return 0;
+    struct PathWalk walk;
+    int res = fs_walk(fs, path, path_length, 0, 0, &walk);
+    if (res < 0) return res;
+    res = dir_size(fs, walk.dir_inode_idx);
+    inode_unlock(fs, walk.dir);
+    return res;
 }
 
 int fs_size(struct FS *fs, char *path) {
-    size_t current_dir_inode_idx = 0;
-    size_t word_start = 1;
+    struct StatsTimer timer;
+    stats_start(&timer);
+    int res = fs_size_impl(fs, path);
+    stats_finish(&fs->stats, STATS_OP_SIZE, &timer, res, 0);
+    return res;
+}
+
+static int fs_read_impl(struct FS *fs, char *path, char *content, size_t content_length) {
     size_t path_length = strlen(path);
-    int res;
+    if (!fs_path_valid(path, path_length)) return NOT_FOUND;
+    if (path[path_length - 1] != '/') {
+        struct Inode *inode;
+        int file_inode_idx = fs_lock_file(fs, path, 0, &inode);
+        if (file_inode_idx < 0) return file_inode_idx;
+        int res = file_read(fs, file_inode_idx, content, content_length, 0);
+        // Taken under the same lock, the file may change as soon as it is released
+        if (res >= 0) res = file_size(fs, file_inode_idx, 0);
+        inode_unlock(fs, inode);
+        return res;
+    }
 
-    if (path[0] != '/') return NOT_FOUND;
-    for (size_t i = 1; i < path_length; i++) {
-        if (path[i] == '/') {
-            if (i - word_start == 0) return NOT_FOUND;
-            char *dirname = malloc(i - word_start + 1);
-            memcpy(dirname, path + word_start, i - word_start);
-            dirname[i - word_start] = '\0';
-            res = dir_find(fs, dirname, current_dir_inode_idx);
-            free(dirname);
-            if (res < 0) return res;
-            current_dir_inode_idx = res;
-            word_start = i + 1;
-        }
+    struct PathWalk walk;
+    int res = fs_walk(fs, path, path_length, 0, 0, &walk);
+    if (res < 0) return res;
+    res = dir_list(fs, walk.dir_inode_idx, content, content_length);
+    if (res >= 0) res = strlen(content) + 1;
+    inode_unlock(fs, walk.dir);
+    return res;
+}
+
+// Reads the whole file, or the listing of a directory for a path ending with '/'. fs_size gives the buffer length
+// it needs. Returns the number of bytes copied, TOO_SMALL_BUFFER when the content does not fit
+int fs_read(struct FS *fs, char *path, char *content, size_t content_length) {
+    struct StatsTimer timer;
+    stats_start(&timer);
+    int res = fs_read_impl(fs, path, content, content_length);
+    stats_finish(&fs->stats, STATS_OP_READ, &timer, res, res);
+    return res;
+}
+
+int fs_pread(struct FS *fs, char *path, char *content, size_t length, size_t offset) {
+    struct StatsTimer timer;
+    stats_start(&timer);
+    struct Inode *inode;
+    int res = fs_lock_file(fs, path, 0, &inode);
+    if (res >= 0) {
+        res = file_pread(fs, res, content, length, offset, 0);
+        inode_unlock(fs, inode);
     }
+    stats_finish(&fs->stats, STATS_OP_PREAD, &timer, res, res);
+    return res;
+}
 
-    if (path[path_length - 1] != '/') {
-        int buffer_size = file_size(fs, current_dir_inode_idx, 1);
-        if (buffer_size < 0) return buffer_size;
-        size_t file_inode_idx = dir_find(fs, path + word_start, current_dir_inode_idx);
-        return file_size(fs, file_inode_idx, 0);
-    } else {
-        return dir_size(fs, current_dir_inode_idx);
+// Writes to the file locked by the caller for writing, res is its inode or the error locking it
+static int fs_pwrite_locked(struct FS *fs, int res, struct Inode *inode, char *content, size_t length, size_t offset,
+                            struct StatsTimer *timer) {
+    if (res >= 0) {
+        struct Txn txn;
+        txn_begin(&txn, fs);
+        res = file_pwrite(fs, &txn, res, content, length, offset, 0);
+        if (res < 0) {
+            txn_rollback(&txn);
+        } else {
+            txn_commit(&txn);
+        }
+        inode_unlock(fs, inode);
     }
+    int flush_res = fs_flush(fs);
+    if (res >= 0 && flush_res < 0) res = flush_res;
+    stats_finish(&fs->stats, STATS_OP_PWRITE, timer, res, res);
+    return res;
 }
 
-int fs_read(struct FS *fs, char *path, char *content, size_t content_length) {
-    size_t current_dir_inode_idx = 0;
-    size_t word_start = 1;
-    size_t path_length = strlen(path);
-    int res;
+int fs_pwrite(struct FS *fs, char *path, char *content, size_t length, size_t offset) {
+    struct StatsTimer timer;
+    stats_start(&timer);
+    struct Inode *inode;
+    int res = fs_lock_file(fs, path, 1, &inode);
+    return fs_pwrite_locked(fs, res, inode, content, length, offset, &timer);
+}
 
-    if (path[0] != '/') return NOT_FOUND;
-    for (size_t i = 1; i < path_length; i++) {
-        if (path[i] == '/') {
-            if (i - word_start == 0) return NOT_FOUND;
-            char *dirname = malloc(i - word_start + 1);
-            memcpy(dirname, path + word_start, i - word_start);
-            dirname[i - word_start] = '\0';
-            res = dir_find(fs, dirname, current_dir_inode_idx);
-            free(dirname);
-            if (res < 0) return res;
-            current_dir_inode_idx = res;
-            word_start = i + 1;
+// Writes to a file pinned by fs_add_pinned or fs_update_pinned, NOT_FOUND once it has been removed
+int fs_pwrite_pinned(struct FS *fs, struct Inode *file, char *content, size_t length, size_t offset) {
+    struct StatsTimer timer;
+    stats_start(&timer);
+    int res = inode_relock(fs, file, 1);
+    if (res >= 0) res = file->idx;
+    return fs_pwrite_locked(fs, res, file, content, length, offset, &timer);
+}
+
+int fs_append(struct FS *fs, char *path, char *content, size_t length) {
+    struct StatsTimer timer;
+    stats_start(&timer);
+    struct Inode *inode;
+    int res = fs_lock_file(fs, path, 1, &inode);
+    if (res >= 0) {
+        struct Txn txn;
+        txn_begin(&txn, fs);
+        res = file_append(fs, &txn, res, content, length, 0);
+        if (res < 0) {
+            txn_rollback(&txn);
+        } else {
+            txn_commit(&txn);
         }
+        inode_unlock(fs, inode);
     }
+    int flush_res = fs_flush(fs);
+    if (res >= 0 && flush_res < 0) res = flush_res;
+    stats_finish(&fs->stats, STATS_OP_APPEND, &timer, res, res);
+    return res;
+}
 
-    if (path[path_length - 1] != '/') {
-        int buffer_size = file_size(fs, current_dir_inode_idx, 1);
-        if (buffer_size < 0) return buffer_size;
-        size_t file_inode_idx = dir_find(fs, path + word_start, current_dir_inode_idx);
-        return file_read(fs, file_inode_idx, content, content_length, 0);
-    } else {
-        return dir_list(fs, current_dir_inode_idx, content, content_length);
+int fs_truncate(struct FS *fs, char *path, size_t length) {
+    struct StatsTimer timer;
+    stats_start(&timer);
+    struct Inode *inode;
+    int res = fs_lock_file(fs, path, 1, &inode);
+    if (res >= 0) {
+        struct Txn txn;
+        txn_begin(&txn, fs);
+        res = file_truncate(fs, &txn, res, length, 0);
+        if (res < 0) {
+            txn_rollback(&txn);
+        } else {
+            txn_commit(&txn);
+        }
+        inode_unlock(fs, inode);
     }
+    int flush_res = fs_flush(fs);
+    if (res >= 0) res = flush_res;
+    stats_finish(&fs->stats, STATS_OP_TRUNCATE, &timer, res, 0);
+    return res;
 }
 
-int fs_remove(struct FS *fs, char *path) {
-    if (strcmp(path, "/") == 0) return WRONG_INPUT;
+static int fs_lock_extent_impl(struct FS *fs, char *path, struct Inode **inode, size_t *image_offset) {
+    int res = fs_lock_file(fs, path, 0, inode);
+    if (res < 0) return res;
+    res = file_extent(fs, res, 0, image_offset);
+    // Cached and buffered writes have to reach the descriptor before the content is read from it
+    if (res > 0) {
+        size_t block_size = fs->super_block.block_size;
+        size_t first_block = (*image_offset - fs->blocks_table_offset) / block_size;
+        int flush_res = bcache_flush_range(&fs->block_cache, &fs->io, first_block, (res + block_size - 1) / block_size);
+        if (flush_res < 0) res = flush_res;
+    }
+    if (res >= 0 && io_flush(&fs->io) < 0) res = WRITE_FAILURE;
+    if (res < 0) inode_unlock(fs, *inode);
+    return res;
+}
+
+// Read-locks a file whose blocks are contiguous in the image, so its content can be sent straight from
+// fs->io.fd until fs_unlock_extent. Returns the length, FRAGMENTED if the file has to be read with fs_read.
+// Counted as a read, without the time the caller spends sending
+int fs_lock_extent(struct FS *fs, char *path, struct Inode **inode, size_t *image_offset) {
+    struct StatsTimer timer;
+    stats_start(&timer);
+    int res = fs_lock_extent_impl(fs, path, inode, image_offset);
+    if (res != FRAGMENTED) stats_finish(&fs->stats, STATS_OP_READ, &timer, res, res);
+    return res;
+}
+
+void fs_unlock_extent(struct FS *fs, struct Inode *inode) {
+    inode_unlock(fs, inode);
+}
 
-    size_t prev_dir_inode_idx = 0;
-    size_t current_dir_inode_idx = 0;
-    size_t prev_word_start = 1;
-    size_t word_start = 1;
+// Releases a file pinned by fs_add_pinned or fs_update_pinned
+void fs_unpin(struct FS *fs, struct Inode *file) {
+    inode_put(fs, file);
+}
+
+static int fs_remove_impl(struct FS *fs, char *path, struct Inode *file) {
     size_t path_length = strlen(path);
-    int res;
+    if (!fs_path_valid(path, path_length)) return NOT_FOUND;
+    if (path_length == 1) return WRONG_INPUT;
+    if (file != NULL && path[path_length - 1] == '/') return WRONG_FILE_TYPE;
 
-    if (path[0] != '/') return NOT_FOUND;
-    for (size_t i = 1; i < path_length; i++) {
-        if (path[i] == '/') {
-            if (i - word_start == 0) return NOT_FOUND;
-            char *dirname = malloc(i - word_start + 1);
-            memcpy(dirname, path + word_start, i - word_start);
-            dirname[i - word_start] = '\0';
-            res = dir_find(fs, dirname, current_dir_inode_idx);
-            free(dirname);
-            if (res < 0) return res;
-            prev_dir_inode_idx = current_dir_inode_idx;
-            current_dir_inode_idx = res;
-            prev_word_start = word_start;
-            word_start = i + 1;
+    // Walk to the directory holding the target, a directory target is the last component before the slash
+    size_t name_end = path[path_length - 1] == '/' ? path_length - 1 : path_length;
+    size_t name_start = name_end;
+    while (name_start > 0 && path[name_start - 1] != '/') name_start--;
+
+    struct PathWalk walk;
+    int res = fs_walk(fs, path, name_start, 0, 1, &walk);
+    if (res < 0) return res;
+    size_t file_inode_idx = DIR_ANY_FILE;
+    if (file != NULL) {
+        // Checked under the directory lock, the inode number may only be reused once the file is removed
+        res = inode_relock(fs, file, 0);
+        if (res >= 0) {
+            file_inode_idx = file->idx;
+            inode_unlock(fs, file);
         }
     }
+    if (res >= 0) res = dir_remove_file(fs, path + name_start, name_end - name_start, file_inode_idx,
+                                        walk.dir_inode_idx);
+    inode_unlock(fs, walk.dir);
+    if (res < 0) return res;
+    return 0;
+}
 
-    if (path[path_length - 1] == '/') {
-        char *dir_name = malloc(path_length - prev_word_start + 1);
-        memcpy(dir_name, path + prev_word_start, path_length - prev_word_start - 1);
-        dir_name[path_length - prev_word_start - 1] = '\0';
-        res = dir_remove_file(fs, dir_name, prev_dir_inode_idx);
-        free(dir_name);
-    } else {
-        res = dir_remove_file(fs, path + word_start, current_dir_inode_idx);
+int fs_remove(struct FS *fs, char *path) {
+    return fs_remove_pinned(fs, path, NULL);
+}
+
+// Removes path only if it still names the file pinned in file, or whatever it names if that is NULL
+int fs_remove_pinned(struct FS *fs, char *path, struct Inode *file) {
+    struct StatsTimer timer;
+    stats_start(&timer);
+    int res = fs_remove_impl(fs, path, file);
+    int flush_res = fs_flush(fs);
+    if (res >= 0) res = flush_res;
+    stats_finish(&fs->stats, STATS_OP_REMOVE, &timer, res, 0);
+    return res;
+}
+
+static int fs_load_bitmaps(struct FS *fs) {
+    pthread_mutex_init(&fs->alloc_mutex, NULL);
+    int res = bitmap_load(&fs->inode_bitmap, &fs->io, fs->inode_bitmap_offset, fs->inode_bitmap_length,
+                          fs->super_block.inodes_number);
+    if (res < 0) return res;
+    res = bitmap_load(&fs->blocks_bitmap, &fs->io, fs->blocks_bitmap_offset, fs->blocks_bitmap_length,
+                      fs->super_block.blocks_number);
+    if (res < 0) {
+        bitmap_free(&fs->inode_bitmap);
+        return res;
     }
+    res = extents_build(&fs->free_extents, &fs->blocks_bitmap);
     if (res < 0) return res;
-    return 0;
+    res = tails_init(&fs->tails, fs->super_block.block_size, fs->super_block.blocks_number, &fs->stats);
+    if (res < 0) return res;
+    res = inode_load_tails(fs);
+    if (res < 0) return res;
+
+    size_t inode_cache_capacity = fs->super_block.inodes_number;
+    if (inode_cache_capacity > INODE_CACHE_CAPACITY) inode_cache_capacity = INODE_CACHE_CAPACITY;
+    res = inode_cache_init(&fs->inode_cache, inode_cache_capacity);
+    if (res < 0) return res;
+    res = bcache_init(&fs->block_cache, BLOCK_CACHE_BYTES, fs->super_block.block_size, fs->blocks_table_offset,
+                      &fs->stats);
+    if (res < 0) return res;
+    return dcache_init(&fs->dentry_cache, DENTRY_CACHE_CAPACITY);
 }
 
 int fs_init(struct FS *fs) {
-    fwrite(&(fs->super_block), sizeof(struct SuperBlock), 1, fs->file);
+    if (io_write(&fs->io, 0, &(fs->super_block), sizeof(struct SuperBlock)) < 0) return WRITE_FAILURE;
 
     size_t total_length =
             fs->inode_bitmap_length +
@@ -215,31 +499,47 @@ int fs_init(struct FS *fs) {
 
     char *bytes = malloc(total_length);
     memset(bytes, 0, total_length);
-    fwrite(bytes, total_length, 1, fs->file);
+    int res = io_write(&fs->io, sizeof(struct SuperBlock), bytes, total_length);
     free(bytes);
+    if (res < 0) return res;
 
-    if (dir_init(fs) != 0) return WRITE_FAILURE;
-    return 0;
+    res = fs_load_bitmaps(fs);
+    if (res < 0) return res;
+
+    if (dir_init(fs, NULL) != 0) return WRITE_FAILURE;
+    return fs_flush(fs);
 }
 
 int fs_open(struct FS *fs, char *filename) {
+    return fs_open_engine(fs, filename, IO_ENGINE_PREAD);
+}
+
+int fs_open_engine(struct FS *fs, char *filename, int engine) {
+    return fs_create_engine(fs, filename, engine, NULL);
+}
+
+// Creates a new image with the given geometry, replacing any file at filename. Without a geometry an existing
+// image is opened and a missing one is created with the default geometry
+int fs_create_engine(struct FS *fs, char *filename, int engine, struct SuperBlock *super_block) {
     FILE *file;
 
-    int file_exists = access(filename, F_OK) != -1;
+    int file_exists = super_block == NULL && access(filename, F_OK) != -1;
 
     if (file_exists) {
         file = fopen(filename, "rb+");
+        if (file == NULL) return READ_FAILURE;
         struct SuperBlock super_block;
         if (fread(&super_block, sizeof(struct SuperBlock), 1, file) != 1) return READ_FAILURE;
         fs->super_block = super_block;
     } else {
         file = fopen(filename, "wb+");
-        fs->super_block = init_default_super_block();
+        fs->super_block = super_block != NULL ? *super_block : init_default_super_block();
+        fs->super_block.free_blocks_number = fs->super_block.blocks_number;
+        fs->super_block.free_inodes_number = fs->super_block.inodes_number;
     }
 
     if (file == NULL) return READ_FAILURE;
 
-    fs->file = file;
     fs->inode_bitmap_length = fs->super_block.inodes_number / 8 + 1;
     fs->blocks_bitmap_length = fs->super_block.blocks_number / 8 + 1;
     fs->inode_table_length = fs->super_block.inode_size * fs->super_block.inodes_number;
@@ -250,17 +550,60 @@ int fs_open(struct FS *fs, char *filename) {
     fs->inode_table_offset = fs->blocks_bitmap_offset + fs->blocks_bitmap_length;
     fs->blocks_table_offset = fs->inode_table_offset + fs->inode_table_length;
 
-    if (!file_exists) {
-        int res = fs_init(fs);
-        if (res < 0) return res;
+    int res = io_open(&fs->io, file, engine, fs->blocks_table_offset + fs->blocks_table_length);
+    if (res < 0) {
+        fclose(file);
+        return res;
     }
+    stats_init(&fs->stats);
+    fs->io.stats = &fs->stats;
 
-    return 0;
+    if (!file_exists) return fs_init(fs);
+    return fs_load_bitmaps(fs);
+}
+
+int fs_flush(struct FS *fs) {
+    int res = inode_cache_flush(fs);
+    if (res < 0) return res;
+    pthread_mutex_lock(&fs->alloc_mutex);
+    res = bitmap_flush_adjacent(&fs->inode_bitmap, &fs->blocks_bitmap, &fs->io);
+    pthread_mutex_unlock(&fs->alloc_mutex);
+    if (res < 0) return res;
+    return io_flush(&fs->io);
+}
+
+// Writes back the block cache too, fs_flush leaves data blocks cached
+int fs_sync(struct FS *fs) {
+    int res = bcache_flush(&fs->block_cache, &fs->io);
+    if (res < 0) return res;
+    res = fs_flush(fs);
+    if (res < 0) return res;
+    return io_sync(&fs->io);
+}
+
+// Writes back the block cache and starts a new one of budget bytes, no other thread may use the image meanwhile
+int fs_set_block_cache(struct FS *fs, size_t budget) {
+    int res = bcache_flush(&fs->block_cache, &fs->io);
+    if (res < 0) return res;
+    bcache_free(&fs->block_cache);
+    return bcache_init(&fs->block_cache, budget, fs->super_block.block_size, fs->blocks_table_offset, &fs->stats);
 }
 
 int fs_close(struct FS *fs) {
-    if (fclose(fs->file) < 0) return WRITE_FAILURE;
-    return 0;
+    int res = bcache_flush(&fs->block_cache, &fs->io);
+    int flush_res = fs_flush(fs);
+    if (res >= 0) res = flush_res;
+    bcache_free(&fs->block_cache);
+    bitmap_free(&fs->inode_bitmap);
+    bitmap_free(&fs->blocks_bitmap);
+    extents_free(&fs->free_extents);
+    tails_free(&fs->tails);
+    inode_cache_free(&fs->inode_cache);
+    dcache_free(&fs->dentry_cache);
+    pthread_mutex_destroy(&fs->alloc_mutex);
+    int close_res = io_close(&fs->io);
+    if (res < 0) return res;
+    return close_res;
 }
 
 void dump_super_block(struct SuperBlock *super_block) {
@@ -7,22 +7,67 @@
 #include "exit_codes.h"
 #include "files.h"
 
+// Geometry of new images
+#ifndef FS_BLOCKS_NUMBER
+#define FS_BLOCKS_NUMBER 1024
+#endif
+
+#ifndef FS_INODES_NUMBER
+#define FS_INODES_NUMBER 256
+#endif
+
+#ifndef FS_BLOCK_SIZE
+#define FS_BLOCK_SIZE 1024
+#endif
+
 struct SuperBlock init_default_super_block();
 
 int fs_add(struct FS *fs, char *path, char *content, size_t content_length);
 
+int fs_add_pinned(struct FS *fs, char *path, char *content, size_t content_length, struct Inode **file);
+
 int fs_update(struct FS *fs, char *path, char *content, size_t content_length);
 
+int fs_update_pinned(struct FS *fs, char *path, char *content, size_t content_length, struct Inode **file);
+
 int fs_size(struct FS *fs, char *path);
 
 int fs_read(struct FS *fs, char *path, char *content, size_t content_length);
 
+int fs_pread(struct FS *fs, char *path, char *content, size_t length, size_t offset);
+
+int fs_pwrite(struct FS *fs, char *path, char *content, size_t length, size_t offset);
+
+int fs_pwrite_pinned(struct FS *fs, struct Inode *file, char *content, size_t length, size_t offset);
+
+int fs_append(struct FS *fs, char *path, char *content, size_t length);
+
+int fs_truncate(struct FS *fs, char *path, size_t length);
+
+int fs_lock_extent(struct FS *fs, char *path, struct Inode **inode, size_t *image_offset);
+
+void fs_unlock_extent(struct FS *fs, struct Inode *inode);
+
+void fs_unpin(struct FS *fs, struct Inode *file);
+
 int fs_remove(struct FS *fs, char *path);
 
+int fs_remove_pinned(struct FS *fs, char *path, struct Inode *file);
+
 int fs_init(struct FS *file);
 
 int fs_open(struct FS *fs, char *filename);
 
+int fs_open_engine(struct FS *fs, char *filename, int engine);
+
+int fs_create_engine(struct FS *fs, char *filename, int engine, struct SuperBlock *super_block);
+
+int fs_flush(struct FS *fs);
+
+int fs_sync(struct FS *fs);
+
+int fs_set_block_cache(struct FS *fs, size_t budget);
+
 int fs_close(struct FS *fs);
 
 void dump_super_block(struct SuperBlock *super_block);
@@ -0,0 +1,694 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmaps.h"
+#include "exit_codes.h"
+#include "files.h"
+#include "inodes.h"
+#include "trace.h"
+
+static size_t inode_offset(struct FS *fs, size_t inode_idx) {
+    return fs->inode_table_offset + inode_idx * fs->super_block.inode_size;
+}
+
+static void inode_lru_unlink(struct InodeCache *cache, struct Inode *inode) {
+    if (inode->lru_prev != NULL) {
+        inode->lru_prev->lru_next = inode->lru_next;
+    } else {
+        cache->lru_head = inode->lru_next;
+    }
+    if (inode->lru_next != NULL) {
+        inode->lru_next->lru_prev = inode->lru_prev;
+    } else {
+        cache->lru_tail = inode->lru_prev;
+    }
+    inode->lru_prev = NULL;
+    inode->lru_next = NULL;
+}
+
+static void inode_lru_push_front(struct InodeCache *cache, struct Inode *inode) {
+    inode->lru_prev = NULL;
+    inode->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL) cache->lru_head->lru_prev = inode;
+    cache->lru_head = inode;
+    if (cache->lru_tail == NULL) cache->lru_tail = inode;
+}
+
+static void inode_hash_unlink(struct InodeCache *cache, struct Inode *inode) {
+    struct Inode **link = &cache->buckets[inode->idx % cache->buckets_number];
+    while (*link != inode) link = &(*link)->hash_next;
+    *link = inode->hash_next;
+    inode->hash_next = NULL;
+}
+
+static struct Inode *inode_lookup(struct InodeCache *cache, size_t inode_idx) {
+    struct Inode *inode = cache->buckets[inode_idx % cache->buckets_number];
+    while (inode != NULL && inode->idx != inode_idx) inode = inode->hash_next;
+    return inode;
+}
+
+// Dirty flags are also peeked at by inode_cache_flush without the inode lock
+static void inode_set_dirty(struct Inode *inode, int dirty) {
+    __atomic_store_n(&inode->dirty, dirty, __ATOMIC_RELAXED);
+}
+
+static size_t inode_pointers_per_block(struct FS *fs) {
+    return fs->super_block.block_size / sizeof(size_t);
+}
+
+static size_t inode_direct_slots(struct FS *fs) {
+    return fs->super_block.inode_size / sizeof(size_t) - 2;
+}
+
+// Most data blocks an inode addresses without indirect trees
+size_t inode_direct_number(struct FS *fs) {
+    return inode_direct_slots(fs);
+}
+
+// Bytes of content a slot holds inline, all but the dir_flag and length words
+size_t inode_inline_capacity(struct FS *fs) {
+    return fs->super_block.inode_size - 2 * sizeof(size_t);
+}
+
+// Number of indirect blocks in a tree of the given depth addressing count data blocks
+static size_t inode_tree_nodes(size_t pointers, size_t depth, size_t count) {
+    size_t nodes = 1;
+    size_t span = 1;
+    for (size_t level = 1; level < depth; level++) {
+        span *= pointers;
+        nodes += (count + span - 1) / span;
+    }
+    return nodes;
+}
+
+static size_t inode_tree_span(size_t pointers, size_t depth) {
+    size_t span = 1;
+    for (size_t level = 0; level < depth; level++) span *= pointers;
+    return span;
+}
+
+int inode_meta_number(struct FS *fs, size_t blocks_number, size_t *meta_number) {
+    size_t direct_slots = inode_direct_slots(fs);
+    *meta_number = 0;
+    if (blocks_number <= direct_slots) return 0;
+    if (direct_slots < INODE_INDIRECT_LEVELS) return NO_SPACE;
+
+    size_t pointers = inode_pointers_per_block(fs);
+    size_t rest = blocks_number - (direct_slots - INODE_INDIRECT_LEVELS);
+    for (size_t depth = 1; depth <= INODE_INDIRECT_LEVELS && rest > 0; depth++) {
+        size_t span = inode_tree_span(pointers, depth);
+        size_t count = rest < span ? rest : span;
+        *meta_number += inode_tree_nodes(pointers, depth, count);
+        rest -= count;
+    }
+    if (rest > 0) return NO_SPACE;
+    return 0;
+}
+
+// Indirect blocks are kept in meta in depth-first pre-order, which is also the order of the data they address.
+// Subtrees addressing only blocks before dirty_from are unchanged and skipped
+static int inode_store_tree(struct FS *fs, struct Inode *inode, size_t depth, size_t *data_pos, size_t *meta_pos,
+                            size_t *node_idx) {
+    size_t pointers_number = inode_pointers_per_block(fs);
+    size_t span = inode_tree_span(pointers_number, depth);
+    size_t count = inode->blocks_number - *data_pos < span ? inode->blocks_number - *data_pos : span;
+
+    *node_idx = inode->meta[*meta_pos];
+    if (*data_pos + count <= inode->dirty_from) {
+        *meta_pos += inode_tree_nodes(pointers_number, depth, count);
+        *data_pos += count;
+        return 0;
+    }
+    (*meta_pos)++;
+
+    size_t *pointers = calloc(pointers_number, sizeof(size_t));
+    for (size_t i = 0; i < pointers_number && *data_pos < inode->blocks_number; i++) {
+        if (depth == 1) {
+            pointers[i] = inode->blocks[*data_pos];
+            (*data_pos)++;
+        } else {
+            int res = inode_store_tree(fs, inode, depth - 1, data_pos, meta_pos, &pointers[i]);
+            if (res < 0) {
+                free(pointers);
+                return res;
+            }
+        }
+    }
+    size_t image_offset = fs->blocks_table_offset + *node_idx * fs->super_block.block_size;
+    uint64_t started = trace_begin();
+    // Written around the block cache, which may hold the block from a read ahead past the end of another file.
+    // The copy is dropped and fills racing with the write are discarded
+    bcache_write_begin(&fs->block_cache);
+    int res = io_write(&fs->io, image_offset, pointers, fs->super_block.block_size);
+    bcache_drop(&fs->block_cache, *node_idx);
+    bcache_write_end(&fs->block_cache);
+    trace_end(started, TRACE_OP_TREE_WRITE, inode->idx, *node_idx, image_offset, fs->super_block.block_size);
+    free(pointers);
+    return res;
+}
+
+static int inode_write_back(struct FS *fs, struct Inode *inode) {
+    size_t direct_slots = inode_direct_slots(fs);
+    size_t slot_length = sizeof(size_t) * (inode->blocks_number + 2);
+    if (inode->blocks_number == 0) slot_length += inode->length;
+    if (slot_length > fs->super_block.inode_size) slot_length = fs->super_block.inode_size;
+
+    size_t *slot = calloc(slot_length, 1);
+    slot[0] = inode->dir_flag;
+    slot[1] = inode->length;
+    size_t block_size = fs->super_block.block_size;
+    if (inode->blocks_number > 0 && inode->blocks_number == (inode->length + block_size - 1) / block_size) {
+        slot[0] |= INODE_FLAG_EXACT;
+    }
+    if (inode->blocks_number == 0) {
+        slot[0] |= INODE_FLAG_INLINE;
+        memcpy(slot + 2, inode->inline_data, inode->length);
+    } else if (inode->blocks_number <= direct_slots) {
+        if (inode->tail_offset != INODE_TAIL_NONE) {
+            slot[0] |= INODE_FLAG_TAIL | inode->tail_offset << INODE_TAIL_SHIFT;
+        }
+        memcpy(slot + 2, inode->blocks, sizeof(size_t) * inode->blocks_number);
+    } else {
+        // Small files keep all pointers direct, larger ones give the last slots to the indirect trees roots
+        size_t direct_number = direct_slots - INODE_INDIRECT_LEVELS;
+        memcpy(slot + 2, inode->blocks, sizeof(size_t) * direct_number);
+        size_t data_pos = direct_number;
+        size_t meta_pos = 0;
+        for (size_t depth = 1; depth <= INODE_INDIRECT_LEVELS && data_pos < inode->blocks_number; depth++) {
+            int res = inode_store_tree(fs, inode, depth, &data_pos, &meta_pos, &slot[2 + direct_number + depth - 1]);
+            if (res < 0) {
+                free(slot);
+                return res;
+            }
+        }
+    }
+    struct InodeCache *cache = &fs->inode_cache;
+    __atomic_fetch_add(&cache->writers, 1, __ATOMIC_SEQ_CST);
+    uint64_t started = trace_begin();
+    int res = io_write(&fs->io, inode_offset(fs, inode->idx), slot, slot_length);
+    trace_end(started, TRACE_OP_INODE_WRITE, inode->idx, TRACE_NONE, inode_offset(fs, inode->idx), slot_length);
+    __atomic_fetch_add(&cache->generation, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_sub(&cache->writers, 1, __ATOMIC_SEQ_CST);
+    free(slot);
+    if (res < 0) return res;
+
+    inode_set_dirty(inode, 0);
+    inode->dirty_from = inode->blocks_number;
+    return 0;
+}
+
+static int inode_reserve(struct Inode *inode, size_t blocks_number, size_t meta_number) {
+    if (blocks_number > inode->blocks_capacity) {
+        size_t *blocks = realloc(inode->blocks, sizeof(size_t) * blocks_number);
+        if (blocks == NULL) return NO_SPACE;
+        inode->blocks = blocks;
+        inode->blocks_capacity = blocks_number;
+    }
+    if (meta_number > inode->meta_capacity) {
+        size_t *meta = realloc(inode->meta, sizeof(size_t) * meta_number);
+        if (meta == NULL) return NO_SPACE;
+        inode->meta = meta;
+        inode->meta_capacity = meta_number;
+    }
+    return 0;
+}
+
+static int inode_load_tree(struct FS *fs, struct Inode *inode, size_t depth, size_t node_idx, size_t *data_pos) {
+    size_t pointers_number = inode_pointers_per_block(fs);
+    if (node_idx >= fs->super_block.blocks_number) return READ_FAILURE;
+    inode->meta[inode->meta_number] = node_idx;
+    inode->meta_number++;
+
+    size_t *pointers = malloc(fs->super_block.block_size);
+    size_t image_offset = fs->blocks_table_offset + node_idx * fs->super_block.block_size;
+    uint64_t started = trace_begin();
+    int res = io_read(&fs->io, image_offset, pointers, fs->super_block.block_size);
+    trace_end(started, TRACE_OP_TREE_READ, inode->idx, node_idx, image_offset, fs->super_block.block_size);
+    for (size_t i = 0; res >= 0 && i < pointers_number && *data_pos < inode->blocks_number; i++) {
+        if (depth == 1) {
+            inode->blocks[*data_pos] = pointers[i];
+            (*data_pos)++;
+        } else {
+            res = inode_load_tree(fs, inode, depth - 1, pointers[i], data_pos);
+        }
+    }
+    free(pointers);
+    return res;
+}
+
+// Fills the entry from its slot of the inode table, reading the indirect trees it points to
+static int inode_decode(struct FS *fs, struct Inode *inode, const char *slot) {
+    int res = 0;
+    memcpy(&inode->dir_flag, slot, sizeof(size_t));
+    memcpy(&inode->length, slot + sizeof(size_t), sizeof(size_t));
+    size_t flags = inode->dir_flag;
+    inode->dir_flag &= INODE_DIR_FLAG_MASK;
+    inode->tail_offset = INODE_TAIL_NONE;
+    if (flags & INODE_FLAG_INLINE) {
+        if (inode->length > inode_inline_capacity(fs)) return READ_FAILURE;
+        memcpy(inode->inline_data, slot + 2 * sizeof(size_t), inode->length);
+        inode->blocks_number = 0;
+        inode->meta_number = 0;
+        inode->dirty_from = 0;
+        return 0;
+    }
+    size_t block_size = fs->super_block.block_size;
+    size_t blocks_number = inode->length / block_size + 1;
+    if (flags & INODE_FLAG_EXACT) blocks_number = (inode->length + block_size - 1) / block_size;
+    size_t meta_number;
+    if (inode_meta_number(fs, blocks_number, &meta_number) < 0 ||
+        inode_reserve(inode, blocks_number, meta_number) < 0) {
+        return READ_FAILURE;
+    }
+    inode->blocks_number = blocks_number;
+    inode->meta_number = 0;
+    inode->dirty_from = blocks_number;
+
+    size_t direct_slots = inode_direct_slots(fs);
+    if (blocks_number <= direct_slots) {
+        memcpy(inode->blocks, slot + 2 * sizeof(size_t), sizeof(size_t) * blocks_number);
+        if (flags & INODE_FLAG_TAIL) {
+            if (blocks_number == 0) return READ_FAILURE;
+            inode->tail_offset = flags >> INODE_TAIL_SHIFT & INODE_TAIL_MASK;
+        }
+    } else if (flags & INODE_FLAG_TAIL) {
+        return READ_FAILURE;
+    } else {
+        size_t direct_number = direct_slots - INODE_INDIRECT_LEVELS;
+        memcpy(inode->blocks, slot + 2 * sizeof(size_t), sizeof(size_t) * direct_number);
+        size_t data_pos = direct_number;
+        for (size_t depth = 1; depth <= INODE_INDIRECT_LEVELS && data_pos < blocks_number && res >= 0; depth++) {
+            size_t root_idx;
+            memcpy(&root_idx, slot + (2 + direct_number + depth - 1) * sizeof(size_t), sizeof(size_t));
+            res = inode_load_tree(fs, inode, depth, root_idx, &data_pos);
+        }
+    }
+    return res;
+}
+
+static int inode_load(struct FS *fs, struct Inode *inode) {
+    size_t inode_size = fs->super_block.inode_size;
+    char *slot = malloc(inode_size);
+    uint64_t started = trace_begin();
+    int res = io_read(&fs->io, inode_offset(fs, inode->idx), slot, inode_size);
+    trace_end(started, TRACE_OP_INODE_READ, inode->idx, TRACE_NONE, inode_offset(fs, inode->idx), inode_size);
+    if (res >= 0) res = inode_decode(fs, inode, slot);
+    free(slot);
+    return res;
+}
+
+// Takes an entry for inode_idx, evicting the least recently used unpinned one when the cache is full.
+// Called with the cache mutex held, the entry is returned pinned
+static int inode_slot(struct FS *fs, size_t inode_idx, struct Inode **inode) {
+    struct InodeCache *cache = &fs->inode_cache;
+    struct Inode *entry;
+
+    if (cache->used < cache->capacity) {
+        entry = &cache->entries[cache->used];
+        // Reused entries keep their inline buffer
+        entry->inline_data = malloc(inode_inline_capacity(fs));
+        if (entry->inline_data == NULL) return NO_SPACE;
+        cache->used++;
+    } else {
+        entry = cache->lru_tail;
+        while (entry != NULL && entry->refs > 0) entry = entry->lru_prev;
+        if (entry == NULL) return NO_SPACE;
+        if (entry->valid && entry->dirty) {
+            int res = inode_write_back(fs, entry);
+            if (res < 0) return res;
+        }
+        inode_lru_unlink(cache, entry);
+        if (entry->valid) inode_hash_unlink(cache, entry);
+    }
+    entry->idx = inode_idx;
+    inode_set_dirty(entry, 0);
+    entry->valid = 1;
+    entry->refs = 1;
+    entry->hash_next = cache->buckets[inode_idx % cache->buckets_number];
+    cache->buckets[inode_idx % cache->buckets_number] = entry;
+    inode_lru_push_front(cache, entry);
+
+    *inode = entry;
+    return 0;
+}
+
+static void inode_drop(struct InodeCache *cache, struct Inode *inode) {
+    inode_hash_unlink(cache, inode);
+    inode->valid = 0;
+    inode_set_dirty(inode, 0);
+    // Invalid entries are reused first
+    inode_lru_unlink(cache, inode);
+    inode->lru_prev = cache->lru_tail;
+    if (cache->lru_tail != NULL) cache->lru_tail->lru_next = inode;
+    cache->lru_tail = inode;
+    if (cache->lru_head == NULL) cache->lru_head = inode;
+}
+
+int inode_cache_init(struct InodeCache *cache, size_t capacity) {
+    if (capacity == 0) capacity = 1;
+    cache->capacity = capacity;
+    cache->used = 0;
+    cache->entries = calloc(capacity, sizeof(struct Inode));
+    cache->buckets_number = capacity * 2;
+    cache->buckets = calloc(cache->buckets_number, sizeof(struct Inode *));
+    cache->lru_head = NULL;
+    cache->lru_tail = NULL;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->generation = 0;
+    cache->writers = 0;
+    pthread_mutex_init(&cache->mutex, NULL);
+    if (cache->entries == NULL || cache->buckets == NULL) {
+        inode_cache_free(cache);
+        return NO_SPACE;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        pthread_rwlock_init(&cache->entries[i].lock, NULL);
+    }
+    return 0;
+}
+
+void inode_cache_free(struct InodeCache *cache) {
+    if (cache->entries != NULL) {
+        for (size_t i = 0; i < cache->used; i++) {
+            free(cache->entries[i].blocks);
+            free(cache->entries[i].meta);
+            free(cache->entries[i].inline_data);
+        }
+        for (size_t i = 0; i < cache->capacity; i++) {
+            pthread_rwlock_destroy(&cache->entries[i].lock);
+        }
+    }
+    free(cache->entries);
+    free(cache->buckets);
+    cache->entries = NULL;
+    cache->buckets = NULL;
+    cache->used = 0;
+    pthread_mutex_destroy(&cache->mutex);
+}
+
+// Returns the cached inode pinned, it has to be released with inode_put
+int inode_get(struct FS *fs, size_t inode_idx, struct Inode **inode) {
+    struct InodeCache *cache = &fs->inode_cache;
+
+    pthread_mutex_lock(&cache->mutex);
+    struct Inode *entry = inode_lookup(cache, inode_idx);
+    if (entry != NULL) {
+        cache->hits++;
+        entry->refs++;
+        inode_lru_unlink(cache, entry);
+        inode_lru_push_front(cache, entry);
+        pthread_mutex_unlock(&cache->mutex);
+        *inode = entry;
+        return 0;
+    }
+
+    // Cached inodes are allocated, only the ones read from the image are checked
+    pthread_mutex_lock(&fs->alloc_mutex);
+    int res = bitmap_read(&fs->inode_bitmap, inode_idx);
+    pthread_mutex_unlock(&fs->alloc_mutex);
+    if (res <= 0) {
+        pthread_mutex_unlock(&cache->mutex);
+        return res < 0 ? res : NOT_FOUND;
+    }
+
+    cache->misses++;
+    res = inode_slot(fs, inode_idx, &entry);
+    if (res < 0) {
+        pthread_mutex_unlock(&cache->mutex);
+        return res;
+    }
+    // The entry is published before it is read, write-locked: nobody holds the lock of an unpinned entry, and
+    // whoever finds it meanwhile waits in inode_lock instead of every lookup waiting on the mutex
+    pthread_rwlock_trywrlock(&entry->lock);
+    pthread_mutex_unlock(&cache->mutex);
+
+    res = inode_load(fs, entry);
+    if (res < 0) {
+        // Dropped while still pinned, so the entry is not reused before its lock is released
+        pthread_mutex_lock(&cache->mutex);
+        if (entry->valid) inode_drop(cache, entry);
+        pthread_mutex_unlock(&cache->mutex);
+    }
+    pthread_rwlock_unlock(&entry->lock);
+    if (res < 0) {
+        inode_put(fs, entry);
+        return res;
+    }
+    *inode = entry;
+    return 0;
+}
+
+static int inode_by_idx(const void *a, const void *b) {
+    size_t first = *(const size_t *) a;
+    size_t second = *(const size_t *) b;
+    return first < second ? -1 : first > second;
+}
+
+// Loads the listed inodes that are not cached yet, unpinned, up to INODE_PREFETCH_MAX and half the cache.
+// Slots near each other in the inode table are read with one request instead of one slot at a time, without
+// holding the cache mutex. A run is dropped if the inode table was written meanwhile, and only the inodes still
+// missing and allocated are taken from it. Returns the number loaded
+int inode_prefetch(struct FS *fs, const size_t *inode_idxs, size_t inodes_number) {
+    struct InodeCache *cache = &fs->inode_cache;
+    size_t inode_size = fs->super_block.inode_size;
+    size_t limit = cache->capacity / 2 < INODE_PREFETCH_MAX ? cache->capacity / 2 : INODE_PREFETCH_MAX;
+    size_t *missing = malloc(sizeof(size_t) * (limit + 1));
+    char *slots = malloc(inode_size * INODE_PREFETCH_SPAN);
+    if (missing == NULL || slots == NULL) {
+        free(missing);
+        free(slots);
+        return NO_SPACE;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    size_t missing_number = 0;
+    pthread_mutex_lock(&fs->alloc_mutex);
+    for (size_t i = 0; i < inodes_number && missing_number < limit; i++) {
+        size_t inode_idx = inode_idxs[i];
+        if (inode_idx >= fs->super_block.inodes_number || inode_lookup(cache, inode_idx) != NULL) continue;
+        if (bitmap_read(&fs->inode_bitmap, inode_idx) == 1) missing[missing_number++] = inode_idx;
+    }
+    pthread_mutex_unlock(&fs->alloc_mutex);
+    pthread_mutex_unlock(&cache->mutex);
+    qsort(missing, missing_number, sizeof(size_t), inode_by_idx);
+
+    size_t loaded = 0;
+    int res = 0;
+    size_t k = 0;
+    while (k < missing_number && res >= 0) {
+        size_t run_first = missing[k];
+        size_t run_end = k + 1;
+        while (run_end < missing_number && missing[run_end] - run_first < INODE_PREFETCH_SPAN) run_end++;
+        size_t run_length = (missing[run_end - 1] - run_first + 1) * inode_size;
+        size_t generation = __atomic_load_n(&cache->generation, __ATOMIC_SEQ_CST);
+        uint64_t started = trace_begin();
+        res = io_read(&fs->io, inode_offset(fs, run_first), slots, run_length);
+        trace_end(started, TRACE_OP_INODE_READ, run_first, TRACE_NONE, inode_offset(fs, run_first), run_length);
+        if (res < 0) break;
+
+        pthread_mutex_lock(&cache->mutex);
+        if (__atomic_load_n(&cache->generation, __ATOMIC_SEQ_CST) != generation ||
+            __atomic_load_n(&cache->writers, __ATOMIC_SEQ_CST) != 0) {
+            pthread_mutex_unlock(&cache->mutex);
+            k = run_end;
+            continue;
+        }
+        for (; k < run_end && res >= 0; k++) {
+            if (k > 0 && missing[k] == missing[k - 1]) continue;
+            if (inode_lookup(cache, missing[k]) != NULL) continue;
+            pthread_mutex_lock(&fs->alloc_mutex);
+            int allocated = bitmap_read(&fs->inode_bitmap, missing[k]) == 1;
+            pthread_mutex_unlock(&fs->alloc_mutex);
+            if (!allocated) continue;
+
+            struct Inode *entry;
+            res = inode_slot(fs, missing[k], &entry);
+            if (res < 0) break;
+            entry->refs--;
+            res = inode_decode(fs, entry, slots + (missing[k] - run_first) * inode_size);
+            if (res < 0) {
+                inode_drop(cache, entry);
+            } else {
+                loaded++;
+            }
+        }
+        pthread_mutex_unlock(&cache->mutex);
+    }
+    free(missing);
+    free(slots);
+    stats_count_inode_prefetch(&fs->stats, loaded);
+    if (res < 0) return res;
+    return loaded;
+}
+
+// Registers the tails packed into shared blocks by the inodes in use, reading the inode table in runs of
+// INODE_PREFETCH_SPAN slots. Called while opening the image, before anything else touches it
+int inode_load_tails(struct FS *fs) {
+    size_t inode_size = fs->super_block.inode_size;
+    size_t block_size = fs->super_block.block_size;
+    char *slots = malloc(inode_size * INODE_PREFETCH_SPAN);
+    if (slots == NULL) return NO_SPACE;
+
+    size_t inodes_number = fs->super_block.inodes_number;
+    int res = 0;
+    for (size_t run_first = 0; run_first < inodes_number && res >= 0; run_first += INODE_PREFETCH_SPAN) {
+        size_t run_number = inodes_number - run_first;
+        if (run_number > INODE_PREFETCH_SPAN) run_number = INODE_PREFETCH_SPAN;
+        uint64_t started = trace_begin();
+        res = io_read(&fs->io, inode_offset(fs, run_first), slots, run_number * inode_size);
+        trace_end(started, TRACE_OP_INODE_READ, run_first, TRACE_NONE, inode_offset(fs, run_first),
+                  run_number * inode_size);
+        for (size_t i = 0; i < run_number && res >= 0; i++) {
+            if (bitmap_read(&fs->inode_bitmap, run_first + i) != 1) continue;
+            char *slot = slots + i * inode_size;
+            size_t flags, length;
+            memcpy(&flags, slot, sizeof(size_t));
+            memcpy(&length, slot + sizeof(size_t), sizeof(size_t));
+            if (!(flags & INODE_FLAG_TAIL) || (flags & INODE_FLAG_INLINE)) continue;
+
+            size_t blocks_number = (length + block_size - 1) / block_size;
+            if (blocks_number == 0 || blocks_number > inode_direct_slots(fs)) {
+                res = READ_FAILURE;
+                break;
+            }
+            size_t block_idx;
+            memcpy(&block_idx, slot + (2 + blocks_number - 1) * sizeof(size_t), sizeof(size_t));
+            if (block_idx >= fs->super_block.blocks_number) {
+                res = READ_FAILURE;
+                break;
+            }
+            res = tails_add(&fs->tails, block_idx, flags >> INODE_TAIL_SHIFT & INODE_TAIL_MASK, length % block_size);
+        }
+    }
+    free(slots);
+    return res;
+}
+
+// Returns the new inode pinned and locked for writing, it has to be released with inode_unlock
+int inode_create(struct FS *fs, size_t inode_idx, size_t dir_flag, struct Inode **inode) {
+    pthread_mutex_lock(&fs->inode_cache.mutex);
+    struct Inode *entry = inode_lookup(&fs->inode_cache, inode_idx);
+    if (entry == NULL) {
+        int res = inode_slot(fs, inode_idx, &entry);
+        if (res < 0) {
+            pthread_mutex_unlock(&fs->inode_cache.mutex);
+            return res;
+        }
+    } else {
+        entry->refs++;
+    }
+    entry->dir_flag = dir_flag;
+    entry->length = 0;
+    entry->blocks_number = 0;
+    entry->meta_number = 0;
+    entry->tail_offset = INODE_TAIL_NONE;
+    inode_set_dirty(entry, 1);
+    entry->dirty_from = 0;
+    pthread_mutex_unlock(&fs->inode_cache.mutex);
+
+    // Nobody else can reach the new inode yet, this only waits for a flush in progress
+    pthread_rwlock_wrlock(&entry->lock);
+    *inode = entry;
+    return 0;
+}
+
+void inode_put(struct FS *fs, struct Inode *inode) {
+    pthread_mutex_lock(&fs->inode_cache.mutex);
+    inode->refs--;
+    pthread_mutex_unlock(&fs->inode_cache.mutex);
+}
+
+// Pins an entry the caller already holds, it stays in the cache until inode_put even if the inode is removed
+void inode_pin(struct FS *fs, struct Inode *inode) {
+    pthread_mutex_lock(&fs->inode_cache.mutex);
+    inode->refs++;
+    pthread_mutex_unlock(&fs->inode_cache.mutex);
+}
+
+static int inode_lock_entry(struct FS *fs, struct Inode *entry, int write, struct Inode **inode) {
+    if (write) {
+        pthread_rwlock_wrlock(&entry->lock);
+    } else {
+        pthread_rwlock_rdlock(&entry->lock);
+    }
+    if (!entry->valid) {
+        inode_unlock(fs, entry);
+        return NOT_FOUND;
+    }
+    *inode = entry;
+    return 0;
+}
+
+// Pins the inode and takes its lock, fails with NOT_FOUND if it was removed while waiting
+int inode_lock(struct FS *fs, size_t inode_idx, int write, struct Inode **inode) {
+    struct Inode *entry;
+    int res = inode_get(fs, inode_idx, &entry);
+    if (res < 0) return res;
+    return inode_lock_entry(fs, entry, write, inode);
+}
+
+// Locks an entry kept pinned by the caller, fails with NOT_FOUND if the inode was removed since
+int inode_relock(struct FS *fs, struct Inode *inode, int write) {
+    inode_pin(fs, inode);
+    return inode_lock_entry(fs, inode, write, &inode);
+}
+
+void inode_unlock(struct FS *fs, struct Inode *inode) {
+    pthread_rwlock_unlock(&inode->lock);
+    inode_put(fs, inode);
+}
+
+// Changes the numbers of data and indirect blocks, new entries are filled in by the caller
+int inode_resize(struct Inode *inode, size_t blocks_number, size_t meta_number) {
+    if (inode_reserve(inode, blocks_number, meta_number) < 0) return NO_SPACE;
+
+    size_t unchanged = blocks_number < inode->blocks_number ? blocks_number : inode->blocks_number;
+    // Switching from direct pointers to indirect trees moves every pointer past the direct ones
+    if (inode->meta_number == 0) unchanged = 0;
+    if (unchanged < inode->dirty_from) inode->dirty_from = unchanged;
+
+    inode->blocks_number = blocks_number;
+    inode->meta_number = meta_number;
+    inode_set_dirty(inode, 1);
+    return 0;
+}
+
+void inode_mark_dirty(struct Inode *inode) {
+    inode_set_dirty(inode, 1);
+}
+
+void inode_forget(struct FS *fs, size_t inode_idx) {
+    pthread_mutex_lock(&fs->inode_cache.mutex);
+    struct Inode *entry = inode_lookup(&fs->inode_cache, inode_idx);
+    if (entry != NULL) inode_drop(&fs->inode_cache, entry);
+    pthread_mutex_unlock(&fs->inode_cache.mutex);
+}
+
+// Writes back every dirty inode. Each one is pinned and locked on its own, so no inode lock is held while
+// waiting for another
+int inode_cache_flush(struct FS *fs) {
+    struct InodeCache *cache = &fs->inode_cache;
+    pthread_mutex_lock(&cache->mutex);
+    for (size_t i = 0; i < cache->used; i++) {
+        struct Inode *entry = &cache->entries[i];
+        // A hint only, inodes are dirtied under their own lock and whoever dirties one flushes afterwards
+        if (!entry->valid || !__atomic_load_n(&entry->dirty, __ATOMIC_RELAXED)) continue;
+        entry->refs++;
+        pthread_mutex_unlock(&cache->mutex);
+
+        pthread_rwlock_wrlock(&entry->lock);
+        int res = 0;
+        if (entry->valid && entry->dirty) res = inode_write_back(fs, entry);
+        pthread_rwlock_unlock(&entry->lock);
+
+        pthread_mutex_lock(&cache->mutex);
+        entry->refs--;
+        if (res < 0) {
+            pthread_mutex_unlock(&cache->mutex);
+            return res;
+        }
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return 0;
+}
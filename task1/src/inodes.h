@@ -0,0 +1,126 @@
+#ifndef TASK1_INODES_H
+#define TASK1_INODES_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#ifndef INODE_CACHE_CAPACITY
+#define INODE_CACHE_CAPACITY 1024
+#endif
+
+// Inodes loaded ahead for one directory at most, and the most inode table slots read with one request for them
+#ifndef INODE_PREFETCH_MAX
+#define INODE_PREFETCH_MAX 256
+#endif
+#define INODE_PREFETCH_SPAN 64
+
+// Set in the dir_flag word of a slot holding the content of its file in place of the block pointers
+#define INODE_FLAG_INLINE ((size_t) 1 << 63)
+// Set when the last block pointer is a shared tail block, the offset of the tail in it is kept in the bits from
+// INODE_TAIL_SHIFT up
+#define INODE_FLAG_TAIL ((size_t) 1 << 62)
+// Set when the slot points to exactly the blocks the length needs, older slots have one more block when the length
+// is a multiple of the block size
+#define INODE_FLAG_EXACT ((size_t) 1 << 61)
+#define INODE_TAIL_SHIFT 32
+#define INODE_TAIL_MASK (((size_t) 1 << 29) - 1)
+#define INODE_DIR_FLAG_MASK (((size_t) 1 << INODE_TAIL_SHIFT) - 1)
+
+#define INODE_TAIL_NONE ((size_t) -1)
+
+// Depth of the deepest indirect tree, large inodes point to one tree of each depth from 1 to this
+#define INODE_INDIRECT_LEVELS 3
+
+struct FS;
+
+struct Inode {
+    size_t idx;
+    size_t dir_flag;
+    size_t length;
+    size_t *blocks;
+    size_t blocks_number;
+    size_t blocks_capacity;
+
+    // Indirect blocks holding pointers past the direct ones
+    size_t *meta;
+    size_t meta_number;
+    size_t meta_capacity;
+
+    // Content of a file without data blocks, inline in the slot
+    char *inline_data;
+    // Offset of the last block of content in the shared block it is packed into, INODE_TAIL_NONE when the last
+    // block is the file's own
+    size_t tail_offset;
+
+    int dirty;
+    // Index of the first data block whose pointer changed since the last write-back
+    size_t dirty_from;
+
+    int valid;
+    // Callers holding the entry, pinned entries are never evicted
+    int refs;
+    // Guards the inode and the content of its blocks, taken in path order from parent to child
+    pthread_rwlock_t lock;
+
+    struct Inode *hash_next;
+    struct Inode *lru_prev;
+    struct Inode *lru_next;
+};
+
+// Write-back cache of decoded inodes, bounded by capacity and evicted in LRU order
+struct InodeCache {
+    struct Inode *entries;
+    size_t capacity;
+    size_t used;
+    struct Inode **buckets;
+    size_t buckets_number;
+    struct Inode *lru_head;
+    struct Inode *lru_tail;
+    // Guards the table, the LRU list and the pins, never held while waiting for an inode lock
+    pthread_mutex_t mutex;
+    // Bumped after every write to the inode table, writers counts the ones in progress. Slots read without the
+    // mutex are only taken in if neither moved meanwhile
+    size_t generation;
+    size_t writers;
+
+    size_t hits;
+    size_t misses;
+};
+
+int inode_cache_init(struct InodeCache *cache, size_t capacity);
+
+void inode_cache_free(struct InodeCache *cache);
+
+int inode_get(struct FS *fs, size_t inode_idx, struct Inode **inode);
+
+int inode_create(struct FS *fs, size_t inode_idx, size_t dir_flag, struct Inode **inode);
+
+int inode_prefetch(struct FS *fs, const size_t *inode_idxs, size_t inodes_number);
+
+void inode_put(struct FS *fs, struct Inode *inode);
+
+void inode_pin(struct FS *fs, struct Inode *inode);
+
+int inode_lock(struct FS *fs, size_t inode_idx, int write, struct Inode **inode);
+
+int inode_relock(struct FS *fs, struct Inode *inode, int write);
+
+void inode_unlock(struct FS *fs, struct Inode *inode);
+
+size_t inode_inline_capacity(struct FS *fs);
+
+size_t inode_direct_number(struct FS *fs);
+
+int inode_load_tails(struct FS *fs);
+
+int inode_meta_number(struct FS *fs, size_t blocks_number, size_t *meta_number);
+
+int inode_resize(struct Inode *inode, size_t blocks_number, size_t meta_number);
+
+void inode_mark_dirty(struct Inode *inode);
+
+void inode_forget(struct FS *fs, size_t inode_idx);
+
+int inode_cache_flush(struct FS *fs);
+
+#endif //TASK1_INODES_H
@@ -0,0 +1,455 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "exit_codes.h"
+#include "io.h"
+
+int io_engine_by_name(const char *name) {
+    if (strcmp(name, "stdio") == 0) return IO_ENGINE_STDIO;
+    if (strcmp(name, "mmap") == 0) return IO_ENGINE_MMAP;
+    if (strcmp(name, "pread") == 0) return IO_ENGINE_PREAD;
+    if (strcmp(name, "uring") == 0) return IO_ENGINE_URING;
+    return WRONG_INPUT;
+}
+
+const char *io_engine_name(int engine) {
+    if (engine == IO_ENGINE_STDIO) return "stdio";
+    if (engine == IO_ENGINE_MMAP) return "mmap";
+    if (engine == IO_ENGINE_URING) return "uring";
+    return "pread";
+}
+
+static void io_ring_close(struct IoRing *ring) {
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_length);
+    if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_length);
+    if (ring->sq_map != NULL) munmap(ring->sq_map, ring->sq_map_length);
+    if (ring->fd >= 0) close(ring->fd);
+    pthread_mutex_destroy(&ring->mutex);
+}
+
+// Sets up a ring through the raw system calls, there is no liburing to rely on
+static int io_ring_open(struct IoRing *ring) {
+    memset(ring, 0, sizeof(struct IoRing));
+    pthread_mutex_init(&ring->mutex, NULL);
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, IO_URING_DEPTH, &params);
+    if (ring->fd < 0) {
+        io_ring_close(ring);
+        return READ_FAILURE;
+    }
+
+    ring->sq_map_length = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_length = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_map && ring->cq_map_length > ring->sq_map_length) ring->sq_map_length = ring->cq_map_length;
+    ring->sq_map = mmap(NULL, ring->sq_map_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) ring->sq_map = NULL;
+    ring->cq_map = ring->sq_map;
+    if (ring->sq_map != NULL && !single_map) {
+        ring->cq_map = mmap(NULL, ring->cq_map_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) ring->cq_map = NULL;
+    }
+    ring->sqes_length = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (ring->cq_map != NULL) {
+        ring->sqes = mmap(NULL, ring->sqes_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+    }
+    if (ring->sqes == NULL) {
+        io_ring_close(ring);
+        return READ_FAILURE;
+    }
+
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return 0;
+}
+
+// Falls back to the pread engine when the kernel is too old or io_uring is forbidden to the process
+static void io_rings_open(struct Io *io) {
+    io->rings = malloc(sizeof(struct IoRing) * IO_URING_RINGS);
+    size_t opened = 0;
+    while (io->rings != NULL && opened < IO_URING_RINGS && io_ring_open(&io->rings[opened]) >= 0) opened++;
+    if (opened == IO_URING_RINGS) return;
+
+    for (size_t i = 0; i < opened; i++) io_ring_close(&io->rings[i]);
+    free(io->rings);
+    io->rings = NULL;
+    io->engine = IO_ENGINE_PREAD;
+}
+
+static void io_rings_close(struct Io *io) {
+    if (io->rings == NULL) return;
+    for (size_t i = 0; i < IO_URING_RINGS; i++) io_ring_close(&io->rings[i]);
+    free(io->rings);
+    io->rings = NULL;
+}
+
+int io_open(struct Io *io, FILE *file, int engine, size_t image_length) {
+    io->engine = engine;
+    io->file = file;
+    io->fd = fileno(file);
+    io->map = NULL;
+    io->map_length = 0;
+    io->rings = NULL;
+    io->next_ring = 0;
+    io->stats = NULL;
+    pthread_mutex_init(&io->mutex, NULL);
+
+    if (engine == IO_ENGINE_STDIO || engine == IO_ENGINE_PREAD) return 0;
+    if (engine == IO_ENGINE_URING) {
+        io_rings_open(io);
+        return 0;
+    }
+    if (engine != IO_ENGINE_MMAP) return WRONG_INPUT;
+
+    struct stat file_stat;
+    if (fstat(io->fd, &file_stat) < 0) return READ_FAILURE;
+    if ((size_t) file_stat.st_size < image_length) {
+        if (ftruncate(io->fd, image_length) < 0) return WRITE_FAILURE;
+    }
+
+    void *map = mmap(NULL, image_length, PROT_READ | PROT_WRITE, MAP_SHARED, io->fd, 0);
+    if (map == MAP_FAILED) return READ_FAILURE;
+    io->map = map;
+    io->map_length = image_length;
+    return 0;
+}
+
+// Single transfers of the uring engine go through pread and pwrite, a ring only pays off for batches
+static int io_positional(struct Io *io) {
+    return io->engine == IO_ENGINE_PREAD || io->engine == IO_ENGINE_URING;
+}
+
+int io_read(struct Io *io, size_t offset, void *buffer, size_t length) {
+    if (length == 0) return 0;
+    stats_count_io(io->stats, 0, length);
+    if (io->engine == IO_ENGINE_MMAP) {
+        if (offset + length > io->map_length) return READ_FAILURE;
+        memcpy(buffer, io->map + offset, length);
+        return 0;
+    }
+    if (io_positional(io)) {
+        while (length > 0) {
+            ssize_t bytes_read = pread(io->fd, buffer, length, offset);
+            if (bytes_read < 0 && errno == EINTR) continue;
+            if (bytes_read <= 0) return READ_FAILURE;
+            buffer = (char *) buffer + bytes_read;
+            offset += bytes_read;
+            length -= bytes_read;
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&io->mutex);
+    fseek(io->file, offset, SEEK_SET);
+    int res = fread(buffer, length, 1, io->file) == 1 ? 0 : READ_FAILURE;
+    pthread_mutex_unlock(&io->mutex);
+    return res;
+}
+
+int io_write(struct Io *io, size_t offset, const void *buffer, size_t length) {
+    if (length == 0) return 0;
+    stats_count_io(io->stats, 1, length);
+    if (io->engine == IO_ENGINE_MMAP) {
+        if (offset + length > io->map_length) return WRITE_FAILURE;
+        memcpy(io->map + offset, buffer, length);
+        return 0;
+    }
+    if (io_positional(io)) {
+        while (length > 0) {
+            ssize_t bytes_written = pwrite(io->fd, buffer, length, offset);
+            if (bytes_written < 0 && errno == EINTR) continue;
+            if (bytes_written <= 0) return WRITE_FAILURE;
+            buffer = (const char *) buffer + bytes_written;
+            offset += bytes_written;
+            length -= bytes_written;
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&io->mutex);
+    fseek(io->file, offset, SEEK_SET);
+    int res = fwrite(buffer, length, 1, io->file) == 1 ? 0 : WRITE_FAILURE;
+    pthread_mutex_unlock(&io->mutex);
+    return res;
+}
+
+static size_t io_vectors_length(const struct iovec *vectors, int vectors_number) {
+    size_t length = 0;
+    for (int i = 0; i < vectors_number; i++) length += vectors[i].iov_len;
+    return length;
+}
+
+// Drops the first done bytes from the vectors, returns the number of vectors used up entirely
+static int io_vectors_advance(struct iovec *vectors, int vectors_number, size_t done) {
+    int first = 0;
+    while (first < vectors_number && done >= vectors[first].iov_len) {
+        done -= vectors[first].iov_len;
+        first++;
+    }
+    if (first < vectors_number) {
+        vectors[first].iov_base = (char *) vectors[first].iov_base + done;
+        vectors[first].iov_len -= done;
+    }
+    return first;
+}
+
+// Transfers the vectors with preadv or pwritev, skipping their first done bytes
+static int io_vectored(int fd, size_t offset, const struct iovec *vectors, int vectors_number, size_t done,
+                       int write) {
+    struct iovec vectors_copy[IO_VECTORS_MAX];
+    memcpy(vectors_copy, vectors, sizeof(struct iovec) * vectors_number);
+    struct iovec *left = vectors_copy;
+    size_t length = io_vectors_length(vectors, vectors_number) - done;
+    offset += done;
+    while (1) {
+        int used_up = io_vectors_advance(left, vectors_number, done);
+        left += used_up;
+        vectors_number -= used_up;
+        if (length == 0) return 0;
+
+        ssize_t bytes = write ? pwritev(fd, left, vectors_number, offset) : preadv(fd, left, vectors_number, offset);
+        if (bytes < 0 && errno == EINTR) {
+            done = 0;
+            continue;
+        }
+        if (bytes <= 0) return write ? WRITE_FAILURE : READ_FAILURE;
+        done = bytes;
+        offset += bytes;
+        length -= bytes;
+    }
+}
+
+// Reads image bytes [offset, offset + total length) scattered over the vectors in order, in one call when the
+// engine allows
+int io_readv(struct Io *io, size_t offset, const struct iovec *vectors, int vectors_number) {
+    if (vectors_number == 1) return io_read(io, offset, vectors[0].iov_base, vectors[0].iov_len);
+    size_t length = io_vectors_length(vectors, vectors_number);
+    if (length == 0) return 0;
+    if (vectors_number > IO_VECTORS_MAX) return READ_FAILURE;
+    stats_count_io(io->stats, 0, length);
+    if (io->engine == IO_ENGINE_MMAP) {
+        if (offset + length > io->map_length) return READ_FAILURE;
+        for (int i = 0; i < vectors_number; i++) {
+            memcpy(vectors[i].iov_base, io->map + offset, vectors[i].iov_len);
+            offset += vectors[i].iov_len;
+        }
+        return 0;
+    }
+    if (io_positional(io)) return io_vectored(io->fd, offset, vectors, vectors_number, 0, 0);
+
+    pthread_mutex_lock(&io->mutex);
+    fseek(io->file, offset, SEEK_SET);
+    int res = 0;
+    for (int i = 0; i < vectors_number && res >= 0; i++) {
+        if (vectors[i].iov_len > 0 && fread(vectors[i].iov_base, vectors[i].iov_len, 1, io->file) != 1) {
+            res = READ_FAILURE;
+        }
+    }
+    pthread_mutex_unlock(&io->mutex);
+    return res;
+}
+
+// Writes the vectors in order to image bytes [offset, offset + total length), in one call when the engine allows
+int io_writev(struct Io *io, size_t offset, const struct iovec *vectors, int vectors_number) {
+    if (vectors_number == 1) return io_write(io, offset, vectors[0].iov_base, vectors[0].iov_len);
+    size_t length = io_vectors_length(vectors, vectors_number);
+    if (length == 0) return 0;
+    if (vectors_number > IO_VECTORS_MAX) return WRITE_FAILURE;
+    stats_count_io(io->stats, 1, length);
+    if (io->engine == IO_ENGINE_MMAP) {
+        if (offset + length > io->map_length) return WRITE_FAILURE;
+        for (int i = 0; i < vectors_number; i++) {
+            memcpy(io->map + offset, vectors[i].iov_base, vectors[i].iov_len);
+            offset += vectors[i].iov_len;
+        }
+        return 0;
+    }
+    if (io_positional(io)) return io_vectored(io->fd, offset, vectors, vectors_number, 0, 1);
+
+    pthread_mutex_lock(&io->mutex);
+    fseek(io->file, offset, SEEK_SET);
+    int res = 0;
+    for (int i = 0; i < vectors_number && res >= 0; i++) {
+        if (vectors[i].iov_len > 0 && fwrite(vectors[i].iov_base, vectors[i].iov_len, 1, io->file) != 1) {
+            res = WRITE_FAILURE;
+        }
+    }
+    pthread_mutex_unlock(&io->mutex);
+    return res;
+}
+
+// Takes the completions posted so far, short transfers are finished with preadv or pwritev. Returns res, or the
+// failure of one of them
+static int io_ring_reap(struct Io *io, struct IoRing *ring, struct IoRequest *requests, size_t *completed, int res,
+                        int write) {
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        struct IoRequest *request = &requests[cqe->user_data];
+        size_t length = io_vectors_length(request->vectors, request->vectors_number);
+        if (cqe->res < 0) {
+            res = write ? WRITE_FAILURE : READ_FAILURE;
+        } else if ((size_t) cqe->res < length && res >= 0) {
+            res = io_vectored(io->fd, request->offset, request->vectors, request->vectors_number, cqe->res, write);
+        }
+        head++;
+        (*completed)++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return res;
+}
+
+// Runs a batch on one ring: requests are queued as long as there is room, the kernel is entered once per refill
+// and the completions are reaped together. Short transfers are finished with preadv or pwritev
+static int io_ring_submit(struct Io *io, struct IoRing *ring, struct IoRequest *requests, size_t requests_number,
+                          int write) {
+    int res = 0;
+    size_t submitted = 0;
+    size_t completed = 0;
+    while (completed < requests_number) {
+        unsigned tail = *ring->sq_tail;
+        unsigned queued = 0;
+        while (submitted < requests_number && submitted - completed < ring->sq_entries) {
+            unsigned idx = tail & *ring->sq_mask;
+            struct io_uring_sqe *sqe = &ring->sqes[idx];
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = io->fd;
+            sqe->off = requests[submitted].offset;
+            sqe->addr = (uintptr_t) requests[submitted].vectors;
+            sqe->len = requests[submitted].vectors_number;
+            sqe->user_data = submitted;
+            ring->sq_array[idx] = idx;
+            tail++;
+            queued++;
+            submitted++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        int entered = (int) syscall(__NR_io_uring_enter, ring->fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        // Interrupted before anything was taken from the queue
+        while (entered < 0 && errno == EINTR) {
+            entered = (int) syscall(__NR_io_uring_enter, ring->fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        }
+        if (entered < 0 || (unsigned) entered < queued) {
+            // Entries the kernel did not take are taken back, nothing else reads the queue without SQPOLL
+            unsigned taken = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+            submitted -= tail - taken;
+            __atomic_store_n(ring->sq_tail, taken, __ATOMIC_RELEASE);
+            // The transfers it took use the caller's buffers until they complete, even the ones of earlier refills
+            while (completed < submitted) {
+                res = io_ring_reap(io, ring, requests, &completed, res, write);
+                if (completed == submitted) break;
+                syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            }
+            ring->broken = 1;
+            for (size_t i = submitted; i < requests_number && res >= 0; i++) {
+                res = io_vectored(io->fd, requests[i].offset, requests[i].vectors, requests[i].vectors_number, 0,
+                                  write);
+            }
+            return res;
+        }
+
+        res = io_ring_reap(io, ring, requests, &completed, res, write);
+    }
+    return res;
+}
+
+// Transfers a batch of requests, all in flight at once with the uring engine and one after another otherwise
+int io_submit(struct Io *io, struct IoRequest *requests, size_t requests_number, int write) {
+    if (io->engine != IO_ENGINE_URING || requests_number <= 1) {
+        for (size_t i = 0; i < requests_number; i++) {
+            int res;
+            if (write) {
+                res = io_writev(io, requests[i].offset, requests[i].vectors, requests[i].vectors_number);
+            } else {
+                res = io_readv(io, requests[i].offset, requests[i].vectors, requests[i].vectors_number);
+            }
+            if (res < 0) return res;
+        }
+        return 0;
+    }
+
+    size_t length = 0;
+    for (size_t i = 0; i < requests_number; i++) {
+        if (requests[i].vectors_number > IO_VECTORS_MAX) return write ? WRITE_FAILURE : READ_FAILURE;
+        length += io_vectors_length(requests[i].vectors, requests[i].vectors_number);
+    }
+    stats_count_io(io->stats, write, length);
+
+    // Threads spread over the rings and only wait for one when all are busy
+    unsigned first = __atomic_fetch_add(&io->next_ring, 1, __ATOMIC_RELAXED) % IO_URING_RINGS;
+    struct IoRing *ring = NULL;
+    for (unsigned i = 0; i < IO_URING_RINGS && ring == NULL; i++) {
+        struct IoRing *candidate = &io->rings[(first + i) % IO_URING_RINGS];
+        if (pthread_mutex_trylock(&candidate->mutex) == 0) ring = candidate;
+    }
+    if (ring == NULL) {
+        ring = &io->rings[first];
+        pthread_mutex_lock(&ring->mutex);
+    }
+
+    int res = 0;
+    if (!ring->broken) {
+        res = io_ring_submit(io, ring, requests, requests_number, write);
+    } else {
+        for (size_t i = 0; i < requests_number && res >= 0; i++) {
+            res = io_vectored(io->fd, requests[i].offset, requests[i].vectors, requests[i].vectors_number, 0, write);
+        }
+    }
+    pthread_mutex_unlock(&ring->mutex);
+    return res;
+}
+
+// Hands buffered changes to the kernel, the mapping and positional writes already go to the page cache
+int io_flush(struct Io *io) {
+    if (io->engine != IO_ENGINE_STDIO) return 0;
+    pthread_mutex_lock(&io->mutex);
+    int res = fflush(io->file) == 0 ? 0 : WRITE_FAILURE;
+    pthread_mutex_unlock(&io->mutex);
+    return res;
+}
+
+// Makes all changes durable in the image file
+int io_sync(struct Io *io) {
+    if (io->engine == IO_ENGINE_MMAP) {
+        if (msync(io->map, io->map_length, MS_SYNC) < 0) return WRITE_FAILURE;
+        return 0;
+    }
+    if (io_flush(io) < 0) return WRITE_FAILURE;
+    if (fsync(io->fd) < 0) return WRITE_FAILURE;
+    return 0;
+}
+
+int io_close(struct Io *io) {
+    int res = 0;
+    if (io->map != NULL && munmap(io->map, io->map_length) < 0) res = WRITE_FAILURE;
+    io->map = NULL;
+    io_rings_close(io);
+    if (fclose(io->file) < 0) res = WRITE_FAILURE;
+    pthread_mutex_destroy(&io->mutex);
+    return res;
+}
@@ -0,0 +1,104 @@
+#ifndef TASK1_IO_H
+#define TASK1_IO_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+#include "stats.h"
+
+#define IO_ENGINE_STDIO 0
+#define IO_ENGINE_MMAP 1
+// Positional pread/pwrite on the descriptor, no shared file position
+#define IO_ENGINE_PREAD 2
+
+// pread engine that sends batches of transfers through io_uring, falls back to pread when the kernel refuses rings
+#define IO_ENGINE_URING 3
+
+// Most buffers one vectored call takes, the Linux IOV_MAX
+#define IO_VECTORS_MAX 1024
+
+// Rings per image, a batch holds its ring until all its transfers complete
+#ifndef IO_URING_RINGS
+#define IO_URING_RINGS 4
+#endif
+
+// Submission queue entries per ring, larger batches are fed in as earlier transfers complete
+#ifndef IO_URING_DEPTH
+#define IO_URING_DEPTH 64
+#endif
+
+// One transfer of a batch: image bytes from offset on to or from the vectors in order
+struct IoRequest {
+    size_t offset;
+    struct iovec *vectors;
+    int vectors_number;
+};
+
+struct IoRing {
+    pthread_mutex_t mutex;
+    int fd;
+    // Set when the kernel refused entries, its batches are done with pread from then on
+    int broken;
+
+    void *sq_map;
+    size_t sq_map_length;
+    void *cq_map;
+    size_t cq_map_length;
+    struct io_uring_sqe *sqes;
+    size_t sqes_length;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+struct Io {
+    int engine;
+    FILE *file;
+    int fd;
+
+    // IO_ENGINE_STDIO only: serializes seeks and transfers on the shared FILE
+    pthread_mutex_t mutex;
+
+    // IO_ENGINE_MMAP only: the whole image mapped shared
+    char *map;
+    size_t map_length;
+
+    // IO_ENGINE_URING only
+    struct IoRing *rings;
+    unsigned next_ring;
+
+    // Counts image calls when set
+    struct Stats *stats;
+};
+
+int io_engine_by_name(const char *name);
+
+const char *io_engine_name(int engine);
+
+int io_open(struct Io *io, FILE *file, int engine, size_t image_length);
+
+int io_read(struct Io *io, size_t offset, void *buffer, size_t length);
+
+int io_write(struct Io *io, size_t offset, const void *buffer, size_t length);
+
+int io_readv(struct Io *io, size_t offset, const struct iovec *vectors, int vectors_number);
+
+int io_writev(struct Io *io, size_t offset, const struct iovec *vectors, int vectors_number);
+
+int io_submit(struct Io *io, struct IoRequest *requests, size_t requests_number, int write);
+
+int io_flush(struct Io *io);
+
+int io_sync(struct Io *io);
+
+int io_close(struct Io *io);
+
+#endif //TASK1_IO_H
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "fs.h"
+#include "trace.h"
 
 void handle_error(int res) {
     switch (res) {
@@ -34,12 +35,21 @@ void handle_error(int res) {
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        printf("Use: %s [filename]\n", argv[0]);
+        printf("Use: %s [filename] [pread|stdio|mmap|uring]\n", argv[0]);
         return 1;
     }
 
+    int engine = IO_ENGINE_PREAD;
+    if (argc > 2) {
+        engine = io_engine_by_name(argv[2]);
+        if (engine < 0) {
+            printf("Unknown I/O engine: %s\n", argv[2]);
+            return 1;
+        }
+    }
+
     struct FS fs;
-    fs_open(&fs, argv[1]);
+    fs_open_engine(&fs, argv[1], engine);
 
     const size_t buffer_size = 8192;
     char buffer[buffer_size];
@@ -52,9 +62,30 @@ int main(int argc, char *argv[]) {
 
         if (strcmp(buffer, "exit") == 0) {
             fs_close(&fs);
+            trace_free();
             return 0;
         } else if (strcmp(buffer, "help") == 0) {
-            printf("add <path> <content> - add file\nadd <path> - add dir\nread <path> - print file or dir\nupdate <path> <content> - update file\nremove <path> - remove file or dir (recursively)\nexit - leave\n/a/b/c/ - example path to dir\n/a/b/c - example path to file\n");
+            printf("add <path> <content> - add file\nadd <path> - add dir\nread <path> - print file or dir\nupdate <path> <content> - update file\nremove <path> - remove file or dir (recursively)\nstats [table|prometheus] - print operation counters and latencies\ncache <bytes> - write back the block cache and resize it\ntrace on [records per thread] - record image accesses\ntrace off - stop recording\ntrace dump <file> - write recorded accesses for minifs_trace\nexit - leave\n/a/b/c/ - example path to dir\n/a/b/c - example path to file\n");
+            continue;
+        } else if (strcmp(buffer, "stats") == 0 || strncmp(buffer, "stats ", 6) == 0) {
+            int format = buffer[5] == '\0' ? STATS_FORMAT_TABLE : stats_format_by_name(buffer + 6);
+            if (format < 0) {
+                printf("Unknown stats format: '%s'\n", buffer + 6);
+            } else {
+                stats_dump(&fs.stats, format, stdout);
+            }
+            continue;
+        } else if (strncmp(buffer, "cache ", 6) == 0) {
+            handle_error(fs_set_block_cache(&fs, strtoull(buffer + 6, NULL, 10)));
+            continue;
+        } else if (strcmp(buffer, "trace on") == 0 || strncmp(buffer, "trace on ", 9) == 0) {
+            trace_start(buffer[8] == '\0' ? 0 : strtoull(buffer + 9, NULL, 10));
+            continue;
+        } else if (strcmp(buffer, "trace off") == 0) {
+            trace_stop();
+            continue;
+        } else if (strncmp(buffer, "trace dump ", 11) == 0) {
+            handle_error(trace_dump(buffer + 11));
             continue;
         }
 
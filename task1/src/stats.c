@@ -0,0 +1,231 @@
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include "exit_codes.h"
+#include "stats.h"
+
+static const char *stats_op_names[STATS_OPS_NUMBER] = {
+        "add", "read", "update", "remove", "size", "pread", "pwrite", "append", "truncate", "dir_find",
+        "bitmap_find_first_free"
+};
+
+static const char *stats_cache_names[STATS_CACHE_EVENTS] = {
+        "hit", "miss", "eviction", "writeback", "prefetch", "prefetch_hit"
+};
+
+static const char *stats_error_names[STATS_ERRORS_NUMBER] = {
+        "NO_SPACE", "READ_FAILURE", "WRITE_FAILURE", "TOO_SMALL_BUFFER", "WRONG_FILE_TYPE", "NOT_FOUND",
+        "WRONG_INPUT", "FRAGMENTED"
+};
+
+// Image calls made by this thread so far, a counted call is charged the difference over its duration
+static _Thread_local uint64_t stats_thread_io_calls;
+
+static uint64_t stats_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Counters are only ever added to with relaxed atomics: no locks and no ordering, a dump may see one call
+// counted and its latency not yet
+static void stats_add(uint64_t *counter, uint64_t value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static uint64_t stats_get(uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void stats_init(struct Stats *stats) {
+    memset(stats, 0, sizeof(struct Stats));
+}
+
+// stats may be NULL for an image without counters, the call is still charged to the running operation
+void stats_count_io(struct Stats *stats, int write, size_t length) {
+    stats_thread_io_calls++;
+    if (stats == NULL) return;
+    if (write) {
+        stats_add(&stats->io_writes, 1);
+        stats_add(&stats->io_write_bytes, length);
+    } else {
+        stats_add(&stats->io_reads, 1);
+        stats_add(&stats->io_read_bytes, length);
+    }
+}
+
+void stats_count_cache(struct Stats *stats, int event, size_t number) {
+    if (stats != NULL) stats_add(&stats->cache[event], number);
+}
+
+void stats_set_readahead_window(struct Stats *stats, size_t window) {
+    if (stats != NULL) __atomic_store_n(&stats->readahead_window, window, __ATOMIC_RELAXED);
+}
+
+void stats_count_inode_prefetch(struct Stats *stats, size_t number) {
+    if (stats != NULL) stats_add(&stats->inodes_prefetched, number);
+}
+
+void stats_set_tails(struct Stats *stats, size_t blocks, size_t bytes) {
+    if (stats == NULL) return;
+    __atomic_store_n(&stats->tail_blocks, blocks, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->tail_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void stats_start(struct StatsTimer *timer) {
+    timer->io_calls = stats_thread_io_calls;
+    timer->started = stats_now();
+}
+
+// Records a call that returned res, bytes moved are only counted when it succeeded
+void stats_finish(struct Stats *stats, int op, struct StatsTimer *timer, int res, size_t bytes) {
+    uint64_t latency = stats_now() - timer->started;
+    struct OpStats *op_stats = &stats->ops[op];
+    stats_add(&op_stats->calls, 1);
+    if (res < 0) {
+        if (res >= -STATS_ERRORS_NUMBER) stats_add(&op_stats->errors[-res - 1], 1);
+    } else {
+        stats_add(&op_stats->bytes, bytes);
+    }
+    stats_add(&op_stats->io_calls, stats_thread_io_calls - timer->io_calls);
+    stats_add(&op_stats->latency_sum, latency);
+
+    size_t bucket = latency == 0 ? 0 : 63 - __builtin_clzll(latency);
+    if (bucket >= STATS_LATENCY_BUCKETS) bucket = STATS_LATENCY_BUCKETS - 1;
+    stats_add(&op_stats->latency[bucket], 1);
+}
+
+int stats_format_by_name(const char *name) {
+    if (strcmp(name, "table") == 0) return STATS_FORMAT_TABLE;
+    if (strcmp(name, "prometheus") == 0) return STATS_FORMAT_PROMETHEUS;
+    return WRONG_INPUT;
+}
+
+// Upper bound of the bucket holding the given fraction of calls, in microseconds
+static double stats_percentile(struct OpStats *op_stats, uint64_t calls, double fraction) {
+    uint64_t rank = (uint64_t) (fraction * calls);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+        seen += stats_get(&op_stats->latency[i]);
+        if (seen > rank) return (double) (2ULL << i) / 1000;
+    }
+    return (double) (2ULL << (STATS_LATENCY_BUCKETS - 1)) / 1000;
+}
+
+static void stats_dump_table(struct Stats *stats, FILE *file) {
+    fprintf(file, "%-24s %10s %8s %12s %10s %10s %10s %10s\n", "op", "calls", "errors", "bytes", "io calls",
+            "avg(us)", "p50(us)", "p99(us)");
+    for (size_t op = 0; op < STATS_OPS_NUMBER; op++) {
+        struct OpStats *op_stats = &stats->ops[op];
+        uint64_t calls = stats_get(&op_stats->calls);
+        if (calls == 0) continue;
+        uint64_t errors = 0;
+        for (size_t code = 0; code < STATS_ERRORS_NUMBER; code++) errors += stats_get(&op_stats->errors[code]);
+        fprintf(file, "%-24s %10llu %8llu %12llu %10llu %10.1f %10.1f %10.1f\n", stats_op_names[op],
+                (unsigned long long) calls, (unsigned long long) errors,
+                (unsigned long long) stats_get(&op_stats->bytes), (unsigned long long) stats_get(&op_stats->io_calls),
+                (double) stats_get(&op_stats->latency_sum) / calls / 1000, stats_percentile(op_stats, calls, 0.5),
+                stats_percentile(op_stats, calls, 0.99));
+    }
+    for (size_t op = 0; op < STATS_OPS_NUMBER; op++) {
+        for (size_t code = 0; code < STATS_ERRORS_NUMBER; code++) {
+            uint64_t errors = stats_get(&stats->ops[op].errors[code]);
+            if (errors == 0) continue;
+            fprintf(file, "%s %s: %llu\n", stats_op_names[op], stats_error_names[code], (unsigned long long) errors);
+        }
+    }
+    fprintf(file, "image reads: %llu (%llu bytes), writes: %llu (%llu bytes)\n",
+            (unsigned long long) stats_get(&stats->io_reads), (unsigned long long) stats_get(&stats->io_read_bytes),
+            (unsigned long long) stats_get(&stats->io_writes), (unsigned long long) stats_get(&stats->io_write_bytes));
+    fprintf(file, "block cache hits: %llu, misses: %llu, evictions: %llu, write-backs: %llu\n",
+            (unsigned long long) stats_get(&stats->cache[STATS_CACHE_HIT]),
+            (unsigned long long) stats_get(&stats->cache[STATS_CACHE_MISS]),
+            (unsigned long long) stats_get(&stats->cache[STATS_CACHE_EVICTION]),
+            (unsigned long long) stats_get(&stats->cache[STATS_CACHE_WRITEBACK]));
+    fprintf(file, "read-ahead window: %llu blocks, blocks prefetched: %llu (%llu hit), inodes prefetched: %llu\n",
+            (unsigned long long) stats_get(&stats->readahead_window),
+            (unsigned long long) stats_get(&stats->cache[STATS_CACHE_PREFETCH]),
+            (unsigned long long) stats_get(&stats->cache[STATS_CACHE_PREFETCH_HIT]),
+            (unsigned long long) stats_get(&stats->inodes_prefetched));
+    fprintf(file, "shared tail blocks: %llu holding %llu bytes of tails\n",
+            (unsigned long long) stats_get(&stats->tail_blocks), (unsigned long long) stats_get(&stats->tail_bytes));
+}
+
+static void stats_dump_counter(struct Stats *stats, FILE *file, const char *name, const char *help, size_t field) {
+    fprintf(file, "# HELP minifs_%s %s\n# TYPE minifs_%s counter\n", name, help, name);
+    for (size_t op = 0; op < STATS_OPS_NUMBER; op++) {
+        uint64_t *counter = (uint64_t *) ((char *) &stats->ops[op] + field);
+        fprintf(file, "minifs_%s{op=\"%s\"} %llu\n", name, stats_op_names[op], (unsigned long long) stats_get(counter));
+    }
+}
+
+// Text exposition format of Prometheus, latencies in seconds as cumulative histograms
+static void stats_dump_prometheus(struct Stats *stats, FILE *file) {
+    stats_dump_counter(stats, file, "calls_total", "Calls per operation.", offsetof(struct OpStats, calls));
+    stats_dump_counter(stats, file, "bytes_total", "Bytes moved by successful calls.", offsetof(struct OpStats, bytes));
+    stats_dump_counter(stats, file, "io_calls_total", "Image reads and writes made by calls.",
+                       offsetof(struct OpStats, io_calls));
+
+    fprintf(file, "# HELP minifs_errors_total Failed calls per exit code.\n# TYPE minifs_errors_total counter\n");
+    for (size_t op = 0; op < STATS_OPS_NUMBER; op++) {
+        for (size_t code = 0; code < STATS_ERRORS_NUMBER; code++) {
+            fprintf(file, "minifs_errors_total{op=\"%s\",code=\"%s\"} %llu\n", stats_op_names[op],
+                    stats_error_names[code], (unsigned long long) stats_get(&stats->ops[op].errors[code]));
+        }
+    }
+
+    fprintf(file, "# HELP minifs_latency_seconds Call latency.\n# TYPE minifs_latency_seconds histogram\n");
+    for (size_t op = 0; op < STATS_OPS_NUMBER; op++) {
+        struct OpStats *op_stats = &stats->ops[op];
+        uint64_t seen = 0;
+        for (size_t i = 0; i + 1 < STATS_LATENCY_BUCKETS; i++) {
+            seen += stats_get(&op_stats->latency[i]);
+            fprintf(file, "minifs_latency_seconds_bucket{op=\"%s\",le=\"%.9g\"} %llu\n", stats_op_names[op],
+                    (double) (2ULL << i) / 1e9, (unsigned long long) seen);
+        }
+        seen += stats_get(&op_stats->latency[STATS_LATENCY_BUCKETS - 1]);
+        fprintf(file, "minifs_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n", stats_op_names[op],
+                (unsigned long long) seen);
+        fprintf(file, "minifs_latency_seconds_sum{op=\"%s\"} %.9g\n", stats_op_names[op],
+                (double) stats_get(&op_stats->latency_sum) / 1e9);
+        fprintf(file, "minifs_latency_seconds_count{op=\"%s\"} %llu\n", stats_op_names[op],
+                (unsigned long long) seen);
+    }
+
+    fprintf(file, "# HELP minifs_image_io_total Image reads and writes.\n# TYPE minifs_image_io_total counter\n");
+    fprintf(file, "minifs_image_io_total{dir=\"read\"} %llu\nminifs_image_io_total{dir=\"write\"} %llu\n",
+            (unsigned long long) stats_get(&stats->io_reads), (unsigned long long) stats_get(&stats->io_writes));
+    fprintf(file, "# HELP minifs_image_io_bytes_total Image bytes read and written.\n"
+                  "# TYPE minifs_image_io_bytes_total counter\n");
+    fprintf(file, "minifs_image_io_bytes_total{dir=\"read\"} %llu\nminifs_image_io_bytes_total{dir=\"write\"} %llu\n",
+            (unsigned long long) stats_get(&stats->io_read_bytes),
+            (unsigned long long) stats_get(&stats->io_write_bytes));
+    fprintf(file, "# HELP minifs_block_cache_total Block cache lookups by outcome, evictions, blocks written back "
+                  "and blocks read ahead.\n"
+                  "# TYPE minifs_block_cache_total counter\n");
+    for (size_t event = 0; event < STATS_CACHE_EVENTS; event++) {
+        fprintf(file, "minifs_block_cache_total{event=\"%s\"} %llu\n", stats_cache_names[event],
+                (unsigned long long) stats_get(&stats->cache[event]));
+    }
+    fprintf(file, "# HELP minifs_readahead_window_blocks Read-ahead window of the last read stream.\n"
+                  "# TYPE minifs_readahead_window_blocks gauge\n");
+    fprintf(file, "minifs_readahead_window_blocks %llu\n", (unsigned long long) stats_get(&stats->readahead_window));
+    fprintf(file, "# HELP minifs_inodes_prefetched_total Inodes loaded ahead for directory walks.\n"
+                  "# TYPE minifs_inodes_prefetched_total counter\n");
+    fprintf(file, "minifs_inodes_prefetched_total %llu\n", (unsigned long long) stats_get(&stats->inodes_prefetched));
+    fprintf(file, "# HELP minifs_tail_blocks Blocks shared by the packed tails of files.\n"
+                  "# TYPE minifs_tail_blocks gauge\n");
+    fprintf(file, "minifs_tail_blocks %llu\n", (unsigned long long) stats_get(&stats->tail_blocks));
+    fprintf(file, "# HELP minifs_tail_bytes Bytes of the shared tail blocks taken by tails.\n"
+                  "# TYPE minifs_tail_bytes gauge\n");
+    fprintf(file, "minifs_tail_bytes %llu\n", (unsigned long long) stats_get(&stats->tail_bytes));
+}
+
+void stats_dump(struct Stats *stats, int format, FILE *file) {
+    if (format == STATS_FORMAT_PROMETHEUS) {
+        stats_dump_prometheus(stats, file);
+    } else {
+        stats_dump_table(stats, file);
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef TASK1_STATS_H
+#define TASK1_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define STATS_OP_ADD 0
+#define STATS_OP_READ 1
+#define STATS_OP_UPDATE 2
+#define STATS_OP_REMOVE 3
+#define STATS_OP_SIZE 4
+#define STATS_OP_PREAD 5
+#define STATS_OP_PWRITE 6
+#define STATS_OP_APPEND 7
+#define STATS_OP_TRUNCATE 8
+#define STATS_OP_DIR_FIND 9
+#define STATS_OP_BITMAP_FIND 10
+#define STATS_OPS_NUMBER 11
+
+// One counter per code of exit_codes.h, NO_SPACE first
+#define STATS_ERRORS_NUMBER 8
+
+// Latency bucket i counts calls of [2^i, 2^(i+1)) nanoseconds, the last one everything longer
+#define STATS_LATENCY_BUCKETS 32
+
+// Block cache events, hits and misses count the lookups of reads only
+#define STATS_CACHE_HIT 0
+#define STATS_CACHE_MISS 1
+#define STATS_CACHE_EVICTION 2
+#define STATS_CACHE_WRITEBACK 3
+// Blocks read ahead into the cache, and the ones of them later hit
+#define STATS_CACHE_PREFETCH 4
+#define STATS_CACHE_PREFETCH_HIT 5
+#define STATS_CACHE_EVENTS 6
+
+#define STATS_FORMAT_TABLE 0
+#define STATS_FORMAT_PROMETHEUS 1
+
+struct OpStats {
+    uint64_t calls;
+    uint64_t errors[STATS_ERRORS_NUMBER];
+    uint64_t bytes;
+    // Image reads and writes made by the call, including nested counted calls
+    uint64_t io_calls;
+    uint64_t latency_sum;
+    uint64_t latency[STATS_LATENCY_BUCKETS];
+};
+
+struct Stats {
+    struct OpStats ops[STATS_OPS_NUMBER];
+    uint64_t io_reads;
+    uint64_t io_writes;
+    uint64_t io_read_bytes;
+    uint64_t io_write_bytes;
+    uint64_t cache[STATS_CACHE_EVENTS];
+    // Read-ahead window in blocks of the last read stream, a gauge
+    uint64_t readahead_window;
+    uint64_t inodes_prefetched;
+    // Blocks shared by packed file tails and the bytes of their units in use, gauges
+    uint64_t tail_blocks;
+    uint64_t tail_bytes;
+};
+
+struct StatsTimer {
+    uint64_t started;
+    uint64_t io_calls;
+};
+
+void stats_init(struct Stats *stats);
+
+void stats_count_io(struct Stats *stats, int write, size_t length);
+
+void stats_count_cache(struct Stats *stats, int event, size_t number);
+
+void stats_set_readahead_window(struct Stats *stats, size_t window);
+
+void stats_count_inode_prefetch(struct Stats *stats, size_t number);
+
+void stats_set_tails(struct Stats *stats, size_t blocks, size_t bytes);
+
+void stats_start(struct StatsTimer *timer);
+
+void stats_finish(struct Stats *stats, int op, struct StatsTimer *timer, int res, size_t bytes);
+
+int stats_format_by_name(const char *name);
+
+void stats_dump(struct Stats *stats, int format, FILE *file);
+
+#endif //TASK1_STATS_H
@@ -0,0 +1,230 @@
+#include <stdlib.h>
+
+#include "exit_codes.h"
+#include "tails.h"
+
+static size_t tails_units(struct TailIndex *index, size_t length) {
+    return (length + index->unit_size - 1) / index->unit_size;
+}
+
+static uint64_t tails_mask(size_t first, size_t units) {
+    return (((uint64_t) 1 << units) - 1) << first;
+}
+
+static void tails_count(struct TailIndex *index) {
+    stats_set_tails(index->stats, index->blocks_number, index->used_units * index->unit_size);
+}
+
+static struct TailBlock *tails_find(struct TailIndex *index, size_t block_idx) {
+    struct TailBlock *block = index->buckets[block_idx % index->buckets_number];
+    while (block != NULL && block->block_idx != block_idx) {
+        block = block->hash_next;
+    }
+    return block;
+}
+
+static struct TailBlock *tails_insert(struct TailIndex *index, size_t block_idx) {
+    struct TailBlock *block = malloc(sizeof(struct TailBlock));
+    if (block == NULL) return NULL;
+    struct TailBlock **bucket = &index->buckets[block_idx % index->buckets_number];
+    block->block_idx = block_idx;
+    block->used = 0;
+    block->hash_next = *bucket;
+    *bucket = block;
+    index->blocks_number++;
+    return block;
+}
+
+static void tails_close(struct TailIndex *index, struct TailBlock *block) {
+    for (size_t i = 0; i < TAIL_OPEN_BLOCKS; i++) {
+        if (index->open[i] == block) index->open[i] = NULL;
+    }
+}
+
+static void tails_erase(struct TailIndex *index, struct TailBlock *block) {
+    struct TailBlock **link = &index->buckets[block->block_idx % index->buckets_number];
+    while (*link != block) {
+        link = &(*link)->hash_next;
+    }
+    *link = block->hash_next;
+    tails_close(index, block);
+    index->blocks_number--;
+    free(block);
+}
+
+// Makes new tails go into the block, it takes the place of the block opened longest ago
+static void tails_open(struct TailIndex *index, struct TailBlock *block) {
+    for (size_t i = 0; i < TAIL_OPEN_BLOCKS; i++) {
+        if (index->open[i] == block) return;
+    }
+    index->open[index->next_open] = block;
+    index->next_open = (index->next_open + 1) % TAIL_OPEN_BLOCKS;
+}
+
+// First fit of units free units in the block
+static int tails_fit(struct TailBlock *block, size_t units, size_t *first) {
+    for (size_t start = 0; start + units <= TAIL_UNITS; start++) {
+        if ((block->used & tails_mask(start, units)) == 0) {
+            *first = start;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int tails_init(struct TailIndex *index, size_t block_size, size_t blocks_number, struct Stats *stats) {
+    index->unit_size = block_size % TAIL_UNITS == 0 ? block_size / TAIL_UNITS : 0;
+    index->buckets_number = blocks_number / 16 + 1;
+    index->buckets = calloc(index->buckets_number, sizeof(struct TailBlock *));
+    if (index->buckets == NULL) return NO_SPACE;
+    for (size_t i = 0; i < TAIL_OPEN_BLOCKS; i++) {
+        index->open[i] = NULL;
+    }
+    index->next_open = 0;
+    index->blocks_number = 0;
+    index->used_units = 0;
+    index->stats = stats;
+    tails_count(index);
+    return 0;
+}
+
+void tails_free(struct TailIndex *index) {
+    if (index->buckets == NULL) return;
+    for (size_t i = 0; i < index->buckets_number; i++) {
+        struct TailBlock *block = index->buckets[i];
+        while (block != NULL) {
+            struct TailBlock *next = block->hash_next;
+            free(block);
+            block = next;
+        }
+    }
+    free(index->buckets);
+    index->buckets = NULL;
+}
+
+// Whether a partial last block of length bytes is worth a place in a shared block: it must leave a unit free
+int tails_packable(struct TailIndex *index, size_t length) {
+    return index->unit_size > 0 && length > 0 && tails_units(index, length) < TAIL_UNITS;
+}
+
+// Registers a tail found in the inode table while opening the image, its block is already marked in the bitmap
+int tails_add(struct TailIndex *index, size_t block_idx, size_t offset, size_t length) {
+    if (!tails_packable(index, length) || offset % index->unit_size != 0) return READ_FAILURE;
+    size_t first = offset / index->unit_size;
+    size_t units = tails_units(index, length);
+    if (first + units > TAIL_UNITS) return READ_FAILURE;
+
+    struct TailBlock *block = tails_find(index, block_idx);
+    if (block == NULL) {
+        block = tails_insert(index, block_idx);
+        if (block == NULL) return NO_SPACE;
+    }
+    uint64_t mask = tails_mask(first, units);
+    if ((block->used & mask) != 0) return READ_FAILURE;
+    block->used |= mask;
+    index->used_units += units;
+    if (block->used != UINT64_MAX) tails_open(index, block);
+    tails_count(index);
+    return 0;
+}
+
+// Takes a free block as a new open shared block, the one following after when it is not TAIL_AFTER_NONE
+static int tails_open_new(struct TailIndex *index, struct Bitmap *bitmap, struct ExtentIndex *extents, size_t after,
+                          struct TailBlock **block) {
+    size_t block_idx;
+    int res = after != TAIL_AFTER_NONE ? extents_alloc_after(extents, after, &block_idx, 1)
+                                       : extents_alloc(extents, &block_idx, 1);
+    if (res < 0) return res;
+    res = bitmap_set(bitmap, block_idx, 1);
+    if (res < 0) {
+        extents_release(extents, block_idx, 1);
+        return res;
+    }
+    *block = tails_insert(index, block_idx);
+    if (*block == NULL) {
+        bitmap_set(bitmap, block_idx, 0);
+        extents_release(extents, block_idx, 1);
+        return NO_SPACE;
+    }
+    tails_open(index, *block);
+    return 0;
+}
+
+// Finds units for a tail of length bytes in one of the open blocks, or takes a new shared block from the free
+// extents. A tail over half a block of a file whose full blocks end at block after goes to the start of the block
+// following them while that one is free: the content stays in one piece for single transfers, and the rest of the
+// block is left to small tails, the only ones it could share with anyway. Called with the allocator mutex held
+int tails_alloc(struct TailIndex *index, struct Bitmap *bitmap, struct ExtentIndex *extents, size_t length,
+                size_t after, size_t *block_idx, size_t *offset) {
+    if (!tails_packable(index, length)) return WRONG_INPUT;
+    size_t units = tails_units(index, length);
+
+    struct TailBlock *block = NULL;
+    size_t first = 0;
+    if (after != TAIL_AFTER_NONE && units > TAIL_UNITS / 2 && bitmap_read(bitmap, after + 1) == 0) {
+        int res = tails_open_new(index, bitmap, extents, after, &block);
+        if (res < 0) return res;
+    }
+    for (size_t i = 0; i < TAIL_OPEN_BLOCKS && block == NULL; i++) {
+        if (index->open[i] != NULL && tails_fit(index->open[i], units, &first)) block = index->open[i];
+    }
+    if (block == NULL) {
+        int res = tails_open_new(index, bitmap, extents, TAIL_AFTER_NONE, &block);
+        if (res < 0) return res;
+    }
+
+    block->used |= tails_mask(first, units);
+    index->used_units += units;
+    if (block->used == UINT64_MAX) tails_close(index, block);
+    tails_count(index);
+    *block_idx = block->block_idx;
+    *offset = first * index->unit_size;
+    return 0;
+}
+
+// Changes the length of a tail in place, taking the free units following it when it grows. Fails with NO_SPACE
+// when they are used. Called with the allocator mutex held
+int tails_resize(struct TailIndex *index, size_t block_idx, size_t offset, size_t length, size_t new_length) {
+    struct TailBlock *block = tails_find(index, block_idx);
+    if (block == NULL || !tails_packable(index, length) || !tails_packable(index, new_length)) return WRONG_INPUT;
+    size_t first = offset / index->unit_size;
+    size_t units = tails_units(index, length);
+    size_t new_units = tails_units(index, new_length);
+    if (first + new_units > TAIL_UNITS) return NO_SPACE;
+    uint64_t others = block->used & ~tails_mask(first, units);
+    if ((others & tails_mask(first, new_units)) != 0) return NO_SPACE;
+
+    block->used = others | tails_mask(first, new_units);
+    index->used_units = index->used_units - units + new_units;
+    if (block->used == UINT64_MAX) {
+        tails_close(index, block);
+    } else if (new_units < units) {
+        tails_open(index, block);
+    }
+    tails_count(index);
+    return 0;
+}
+
+// Gives the units of a tail back, and the shared block itself to the free extents with its last tail.
+// Returns 1 when the block was released. Called with the allocator mutex held
+int tails_release(struct TailIndex *index, struct Bitmap *bitmap, struct ExtentIndex *extents, size_t block_idx,
+                  size_t offset, size_t length) {
+    struct TailBlock *block = tails_find(index, block_idx);
+    if (block == NULL || !tails_packable(index, length)) return WRONG_INPUT;
+    size_t units = tails_units(index, length);
+    block->used &= ~tails_mask(offset / index->unit_size, units);
+    index->used_units -= units;
+
+    if (block->used != 0) {
+        tails_open(index, block);
+        tails_count(index);
+        return 0;
+    }
+    tails_erase(index, block);
+    tails_count(index);
+    int res = bitmap_set(bitmap, block_idx, 0);
+    if (res < 0) return res;
+    res = extents_release(extents, block_idx, 1);
+    if (res < 0) return res;
+    return 1;
+}
@@ -0,0 +1,57 @@
+#ifndef TASK1_TAILS_H
+#define TASK1_TAILS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bitmaps.h"
+#include "extents.h"
+#include "stats.h"
+
+// Shared tail blocks are split into this many units, a tail takes whole units
+#define TAIL_UNITS 64
+
+// Shared blocks with free units that new tails are put into
+#define TAIL_OPEN_BLOCKS 8
+
+#define TAIL_AFTER_NONE ((size_t) -1)
+
+struct TailBlock {
+    size_t block_idx;
+    // Bit i is set while unit i holds a tail
+    uint64_t used;
+    struct TailBlock *hash_next;
+};
+
+// Blocks holding the partial last blocks of several files. A shared block stays allocated in the blocks bitmap
+// while any of its units is used and is released with its last tail
+struct TailIndex {
+    struct TailBlock **buckets;
+    size_t buckets_number;
+    // Bytes per unit, 0 when the block size does not split evenly and tails are not packed
+    size_t unit_size;
+    struct TailBlock *open[TAIL_OPEN_BLOCKS];
+    size_t next_open;
+    size_t blocks_number;
+    size_t used_units;
+
+    struct Stats *stats;
+};
+
+int tails_init(struct TailIndex *index, size_t block_size, size_t blocks_number, struct Stats *stats);
+
+void tails_free(struct TailIndex *index);
+
+int tails_packable(struct TailIndex *index, size_t length);
+
+int tails_add(struct TailIndex *index, size_t block_idx, size_t offset, size_t length);
+
+int tails_alloc(struct TailIndex *index, struct Bitmap *bitmap, struct ExtentIndex *extents, size_t length,
+                size_t after, size_t *block_idx, size_t *offset);
+
+int tails_resize(struct TailIndex *index, size_t block_idx, size_t offset, size_t length, size_t new_length);
+
+int tails_release(struct TailIndex *index, struct Bitmap *bitmap, struct ExtentIndex *extents, size_t block_idx,
+                  size_t offset, size_t length);
+
+#endif //TASK1_TAILS_H
@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "exit_codes.h"
+#include "trace.h"
+
+// Checked on every image access, while it is 0 tracing costs two calls and a load per access
+int trace_enabled;
+
+static size_t trace_ring_capacity = TRACE_RING_CAPACITY;
+static uint16_t trace_threads_number;
+
+// Rings of all threads, only ever pushed to until trace_free
+static struct TraceRing *trace_rings;
+static _Thread_local struct TraceRing *trace_ring;
+
+static uint64_t trace_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Records accesses from now on, rings are created with ring_capacity records, 0 keeps the last capacity
+void trace_start(size_t ring_capacity) {
+    if (ring_capacity > 0) __atomic_store_n(&trace_ring_capacity, ring_capacity, __ATOMIC_RELAXED);
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELAXED);
+}
+
+void trace_stop() {
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+}
+
+// Starts timing an access, returns 0 while tracing is off
+uint64_t trace_begin() {
+    if (!__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)) return 0;
+    return trace_now();
+}
+
+static struct TraceRing *trace_thread_ring() {
+    if (trace_ring != NULL) return trace_ring;
+    struct TraceRing *ring = malloc(sizeof(struct TraceRing));
+    if (ring == NULL) return NULL;
+    ring->capacity = __atomic_load_n(&trace_ring_capacity, __ATOMIC_RELAXED);
+    ring->records = malloc(sizeof(struct TraceRecord) * ring->capacity);
+    if (ring->records == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->head = 0;
+    ring->thread = __atomic_fetch_add(&trace_threads_number, 1, __ATOMIC_RELAXED);
+    ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    trace_ring = ring;
+    return ring;
+}
+
+static uint32_t trace_narrow(size_t value) {
+    return value < TRACE_NONE ? (uint32_t) value : TRACE_NONE;
+}
+
+// Records an access timed since started into the ring of this thread, overwriting its oldest record when full
+void trace_end(uint64_t started, int op, size_t inode, size_t block, size_t offset, size_t length) {
+    if (started == 0) return;
+    uint64_t duration = trace_now() - started;
+    struct TraceRing *ring = trace_thread_ring();
+    if (ring == NULL) return;
+
+    uint64_t head = ring->head;
+    struct TraceRecord *record = &ring->records[head % ring->capacity];
+    record->timestamp = started;
+    record->offset = offset;
+    record->length = trace_narrow(length);
+    record->duration = trace_narrow(duration);
+    record->inode = trace_narrow(inode);
+    record->block = trace_narrow(block);
+    record->thread = ring->thread;
+    record->op = op;
+    memset(record->reserved, 0, sizeof(record->reserved));
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Copies the records of a ring that its thread did not overwrite meanwhile, returns their number
+static size_t trace_copy_ring(struct TraceRing *ring, struct TraceRecord *records) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t begin = head > ring->capacity ? head - ring->capacity : 0;
+    for (uint64_t i = begin; i < head; i++) records[i - begin] = ring->records[i % ring->capacity];
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t new_head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint64_t valid_begin = new_head > ring->capacity ? new_head - ring->capacity : 0;
+    if (valid_begin <= begin) return head - begin;
+    if (valid_begin >= head) return 0;
+    memmove(records, records + (valid_begin - begin), sizeof(struct TraceRecord) * (head - valid_begin));
+    return head - valid_begin;
+}
+
+// Writes the records of all threads to filename, tracing may go on meanwhile
+int trace_dump(const char *filename) {
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) return WRITE_FAILURE;
+    int res = fwrite(TRACE_MAGIC, TRACE_MAGIC_LENGTH, 1, file) == 1 ? 0 : WRITE_FAILURE;
+
+    struct TraceRing *ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+    for (; res >= 0 && ring != NULL; ring = ring->next) {
+        struct TraceRecord *records = malloc(sizeof(struct TraceRecord) * ring->capacity);
+        if (records == NULL) {
+            res = NO_SPACE;
+            break;
+        }
+        size_t records_number = trace_copy_ring(ring, records);
+        size_t written = fwrite(records, sizeof(struct TraceRecord), records_number, file);
+        if (written != records_number) res = WRITE_FAILURE;
+        free(records);
+    }
+    if (fclose(file) != 0 && res >= 0) res = WRITE_FAILURE;
+    return res;
+}
+
+// Stops tracing and drops all records. No other thread may be tracing
+void trace_free() {
+    trace_stop();
+    struct TraceRing *ring = __atomic_exchange_n(&trace_rings, NULL, __ATOMIC_ACQUIRE);
+    while (ring != NULL) {
+        struct TraceRing *next = ring->next;
+        free(ring->records);
+        free(ring);
+        ring = next;
+    }
+    trace_ring = NULL;
+    __atomic_store_n(&trace_threads_number, 0, __ATOMIC_RELAXED);
+}
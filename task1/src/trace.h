@@ -0,0 +1,67 @@
+#ifndef TASK1_TRACE_H
+#define TASK1_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_OP_FILE_READ 1
+#define TRACE_OP_FILE_WRITE 2
+#define TRACE_OP_INODE_READ 3
+#define TRACE_OP_INODE_WRITE 4
+// Indirect pointer blocks of large files
+#define TRACE_OP_TREE_READ 5
+#define TRACE_OP_TREE_WRITE 6
+#define TRACE_OP_BITMAP_READ 7
+#define TRACE_OP_BITMAP_WRITE 8
+// Data blocks read into the block cache ahead of a read stream
+#define TRACE_OP_READ_AHEAD 9
+#define TRACE_OPS_NUMBER 10
+
+// Inode or block field of an access not tied to one
+#define TRACE_NONE UINT32_MAX
+
+#ifndef TRACE_RING_CAPACITY
+#define TRACE_RING_CAPACITY 65536
+#endif
+
+// File: TRACE_MAGIC, then records in host byte order until the end
+#define TRACE_MAGIC "MFTRACE1"
+#define TRACE_MAGIC_LENGTH 8
+
+struct TraceRecord {
+    // CLOCK_MONOTONIC nanoseconds at the start of the access
+    uint64_t timestamp;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t duration;
+    uint32_t inode;
+    uint32_t block;
+    uint16_t thread;
+    uint8_t op;
+    uint8_t reserved[5];
+};
+
+// One per thread that traced anything, written by its thread only
+struct TraceRing {
+    struct TraceRecord *records;
+    size_t capacity;
+    uint64_t head;
+    uint16_t thread;
+    struct TraceRing *next;
+};
+
+extern int trace_enabled;
+
+void trace_start(size_t ring_capacity);
+
+void trace_stop();
+
+uint64_t trace_begin();
+
+void trace_end(uint64_t started, int op, size_t inode, size_t block, size_t offset, size_t length);
+
+int trace_dump(const char *filename);
+
+void trace_free();
+
+#endif //TASK1_TRACE_H
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+// Distances of 2^(i-1) to 2^i bytes land in bucket i, bucket 0 holds accesses right after the previous one
+#define DECODE_SEEK_BUCKETS 48
+
+#define DECODE_TOP_INODES 10
+
+static const char *decode_op_names[TRACE_OPS_NUMBER] = {
+        "?", "file read", "file write", "inode read", "inode write", "tree read", "tree write", "bitmap read",
+        "bitmap write", "read ahead"
+};
+
+struct InodeCount {
+    uint32_t inode;
+    size_t accesses;
+    size_t bytes;
+};
+
+static const char *decode_op_name(uint8_t op) {
+    return op < TRACE_OPS_NUMBER ? decode_op_names[op] : "?";
+}
+
+static int decode_by_time(const void *a, const void *b) {
+    const struct TraceRecord *first = a;
+    const struct TraceRecord *second = b;
+    if (first->timestamp != second->timestamp) return first->timestamp < second->timestamp ? -1 : 1;
+    return (int) first->thread - (int) second->thread;
+}
+
+static int decode_by_accesses(const void *a, const void *b) {
+    const struct InodeCount *first = a;
+    const struct InodeCount *second = b;
+    if (first->accesses != second->accesses) return first->accesses > second->accesses ? -1 : 1;
+    return first->inode < second->inode ? -1 : first->inode > second->inode;
+}
+
+static int decode_by_inode(const void *a, const void *b) {
+    const struct TraceRecord *first = a;
+    const struct TraceRecord *second = b;
+    return first->inode < second->inode ? -1 : first->inode > second->inode;
+}
+
+// Distance from the end of the previous access to the start of this one
+static long long decode_seek(struct TraceRecord *previous, struct TraceRecord *record) {
+    return (long long) record->offset - (long long) (previous->offset + previous->length);
+}
+
+static void decode_print_id(uint32_t id) {
+    if (id == TRACE_NONE) {
+        printf(" %10s", "-");
+    } else {
+        printf(" %10u", id);
+    }
+}
+
+static void decode_records(struct TraceRecord *records, size_t records_number) {
+    printf("%12s %6s %-12s %10s %10s %12s %8s %10s %12s\n", "time(us)", "thread", "op", "inode", "block",
+           "offset", "length", "took(us)", "seek");
+    for (size_t i = 0; i < records_number; i++) {
+        struct TraceRecord *record = &records[i];
+        printf("%12.3f %6u %-12s", (double) (record->timestamp - records[0].timestamp) / 1000, record->thread,
+               decode_op_name(record->op));
+        decode_print_id(record->inode);
+        decode_print_id(record->block);
+        printf(" %12llu %8u %10.3f", (unsigned long long) record->offset, record->length,
+               (double) record->duration / 1000);
+        if (i > 0) {
+            printf(" %12lld\n", decode_seek(&records[i - 1], record));
+        } else {
+            printf(" %12s\n", "-");
+        }
+    }
+}
+
+static void decode_summary(struct TraceRecord *records, size_t records_number) {
+    size_t counts[TRACE_OPS_NUMBER] = {0};
+    unsigned long long bytes[TRACE_OPS_NUMBER] = {0};
+    unsigned long long durations[TRACE_OPS_NUMBER] = {0};
+    uint32_t max_durations[TRACE_OPS_NUMBER] = {0};
+    size_t seeks[DECODE_SEEK_BUCKETS] = {0};
+    size_t backward = 0;
+    size_t threads_number = 0;
+
+    for (size_t i = 0; i < records_number; i++) {
+        struct TraceRecord *record = &records[i];
+        uint8_t op = record->op < TRACE_OPS_NUMBER ? record->op : 0;
+        counts[op]++;
+        bytes[op] += record->length;
+        durations[op] += record->duration;
+        if (record->duration > max_durations[op]) max_durations[op] = record->duration;
+        if (record->thread + (size_t) 1 > threads_number) threads_number = record->thread + 1;
+        if (i == 0) continue;
+
+        long long seek = decode_seek(&records[i - 1], record);
+        if (seek < 0) backward++;
+        unsigned long long distance = seek < 0 ? -seek : seek;
+        size_t bucket = distance == 0 ? 0 : 64 - __builtin_clzll(distance);
+        if (bucket >= DECODE_SEEK_BUCKETS) bucket = DECODE_SEEK_BUCKETS - 1;
+        seeks[bucket]++;
+    }
+
+    double span = records_number > 0 ? (double) (records[records_number - 1].timestamp - records[0].timestamp) : 0;
+    printf("%zu accesses from %zu threads over %.3f ms\n\n", records_number, threads_number, span / 1e6);
+
+    printf("%-12s %10s %14s %10s %10s\n", "op", "accesses", "bytes", "avg(us)", "max(us)");
+    for (size_t op = 0; op < TRACE_OPS_NUMBER; op++) {
+        if (counts[op] == 0) continue;
+        printf("%-12s %10zu %14llu %10.3f %10.3f\n", decode_op_names[op], counts[op], bytes[op],
+               (double) durations[op] / counts[op] / 1000, (double) max_durations[op] / 1000);
+    }
+
+    if (records_number > 1) {
+        printf("\nseek distance from the end of the previous access (%zu backward)\n", backward);
+        printf("%-24s %10s %8s\n", "bytes", "accesses", "share");
+        for (size_t i = 0; i < DECODE_SEEK_BUCKETS; i++) {
+            if (seeks[i] == 0) continue;
+            char range[32];
+            if (i == 0) {
+                snprintf(range, sizeof(range), "0 (sequential)");
+            } else {
+                snprintf(range, sizeof(range), "%llu..%llu", 1ULL << (i - 1), (1ULL << i) - 1);
+            }
+            printf("%-24s %10zu %7.1f%%\n", range, seeks[i], 100.0 * seeks[i] / (records_number - 1));
+        }
+    }
+
+    // Records are regrouped by inode for the counts, after everything that needs them by time
+    qsort(records, records_number, sizeof(struct TraceRecord), decode_by_inode);
+    struct InodeCount *inodes = calloc(records_number + 1, sizeof(struct InodeCount));
+    size_t inodes_number = 0;
+    for (size_t i = 0; i < records_number; i++) {
+        if (records[i].inode == TRACE_NONE) continue;
+        if (inodes_number == 0 || inodes[inodes_number - 1].inode != records[i].inode) {
+            inodes[inodes_number].inode = records[i].inode;
+            inodes_number++;
+        }
+        inodes[inodes_number - 1].accesses++;
+        inodes[inodes_number - 1].bytes += records[i].length;
+    }
+    qsort(inodes, inodes_number, sizeof(struct InodeCount), decode_by_accesses);
+    if (inodes_number > 0) {
+        printf("\nbusiest of %zu inodes\n%-10s %10s %14s\n", inodes_number, "inode", "accesses", "bytes");
+    }
+    for (size_t i = 0; i < inodes_number && i < DECODE_TOP_INODES; i++) {
+        printf("%-10u %10zu %14zu\n", inodes[i].inode, inodes[i].accesses, inodes[i].bytes);
+    }
+    free(inodes);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("Use: %s [trace file] [summary|records]\n", argv[0]);
+        return 1;
+    }
+    int print_records = argc > 2 && strcmp(argv[2], "records") == 0;
+    if (argc > 2 && !print_records && strcmp(argv[2], "summary") != 0) {
+        printf("Unknown mode: %s\n", argv[2]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        printf("Can not open %s\n", argv[1]);
+        return 1;
+    }
+    char magic[TRACE_MAGIC_LENGTH];
+    if (fread(magic, TRACE_MAGIC_LENGTH, 1, file) != 1 || memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LENGTH) != 0) {
+        printf("Not a trace file: %s\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+
+    size_t records_capacity = 1024;
+    size_t records_number = 0;
+    struct TraceRecord *records = malloc(sizeof(struct TraceRecord) * records_capacity);
+    while (1) {
+        if (records_number == records_capacity) {
+            records_capacity *= 2;
+            records = realloc(records, sizeof(struct TraceRecord) * records_capacity);
+        }
+        size_t read = fread(records + records_number, sizeof(struct TraceRecord), records_capacity - records_number,
+                            file);
+        if (read == 0) break;
+        records_number += read;
+    }
+    fclose(file);
+
+    // Rings are dumped one thread after another
+    qsort(records, records_number, sizeof(struct TraceRecord), decode_by_time);
+    if (print_records) {
+        decode_records(records, records_number);
+    } else {
+        decode_summary(records, records_number);
+    }
+    free(records);
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+
+#include "exit_codes.h"
+#include "files.h"
+#include "inodes.h"
+#include "txn.h"
+
+// Collects the metadata changes of one operation: the allocator changes and inode updates stay in memory as
+// usual and reach the image together on the next flush, but if the operation fails halfway they are undone
+// first, so it leaves no blocks or inodes reserved for nothing
+void txn_begin(struct Txn *txn, struct FS *fs) {
+    txn->fs = fs;
+    txn->inodes = NULL;
+    txn->inodes_number = 0;
+    txn->inodes_capacity = 0;
+}
+
+// Remembers the inode before its first change, blocks_required is the number of data blocks it is about to get.
+// A created inode is given back whole on rollback. The inode stays pinned until the transaction ends
+int txn_track(struct Txn *txn, struct Inode *inode, size_t blocks_required, int created) {
+    for (size_t i = 0; i < txn->inodes_number; i++) {
+        struct TxnInode *entry = &txn->inodes[i];
+        if (entry->inode != inode) continue;
+        if (blocks_required < entry->blocks_kept) entry->blocks_kept = blocks_required;
+        return 0;
+    }
+
+    if (txn->inodes_number == txn->inodes_capacity) {
+        size_t capacity = txn->inodes_capacity == 0 ? 4 : txn->inodes_capacity * 2;
+        struct TxnInode *inodes = realloc(txn->inodes, sizeof(struct TxnInode) * capacity);
+        if (inodes == NULL) return NO_SPACE;
+        txn->inodes = inodes;
+        txn->inodes_capacity = capacity;
+    }
+    struct Inode *pinned;
+    int res = inode_get(txn->fs, inode->idx, &pinned);
+    if (res < 0) return res;
+
+    struct TxnInode *entry = &txn->inodes[txn->inodes_number];
+    entry->inode = inode;
+    entry->created = created;
+    entry->length = inode->length;
+    entry->blocks_number = inode->blocks_number;
+    entry->blocks_kept = blocks_required < inode->blocks_number ? blocks_required : inode->blocks_number;
+    txn->inodes_number++;
+    return 0;
+}
+
+static void txn_end(struct Txn *txn) {
+    for (size_t i = 0; i < txn->inodes_number; i++) inode_put(txn->fs, txn->inodes[i].inode);
+    free(txn->inodes);
+    txn->inodes = NULL;
+    txn->inodes_number = 0;
+    txn->inodes_capacity = 0;
+}
+
+// Keeps every change, the caller flushes them
+void txn_commit(struct Txn *txn) {
+    txn_end(txn);
+}
+
+// Releases the blocks taken and the inodes created since txn_begin, newest first. Blocks released meanwhile
+// stay released, the inode keeps the pointers it had all along and its length is cut to them. Called with
+// every tracked inode still locked, or unlinked
+void txn_rollback(struct Txn *txn) {
+    struct FS *fs = txn->fs;
+    size_t block_size = fs->super_block.block_size;
+    for (size_t i = txn->inodes_number; i > 0; i--) {
+        struct TxnInode *entry = &txn->inodes[i - 1];
+        if (entry->created) {
+            file_restore(fs, entry->inode, 0, 0);
+            inode_forget(fs, entry->inode->idx);
+            pthread_mutex_lock(&fs->alloc_mutex);
+            bitmap_set(&fs->inode_bitmap, entry->inode->idx, 0);
+            pthread_mutex_unlock(&fs->alloc_mutex);
+            continue;
+        }
+        size_t length = entry->length;
+        if (entry->blocks_kept < entry->blocks_number) {
+            size_t kept_length = entry->blocks_kept * block_size;
+            if (length > kept_length) length = kept_length;
+        }
+        file_restore(fs, entry->inode, entry->blocks_kept, length);
+    }
+    txn_end(txn);
+}
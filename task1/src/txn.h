@@ -0,0 +1,34 @@
+#ifndef TASK1_TXN_H
+#define TASK1_TXN_H
+
+#include <stddef.h>
+
+struct FS;
+struct Inode;
+
+struct TxnInode {
+    struct Inode *inode;
+    int created;
+    // State before the transaction, and the fewest pointers the inode had during it
+    size_t length;
+    size_t blocks_number;
+    size_t blocks_kept;
+};
+
+// Undo log of the inodes one operation resized or created
+struct Txn {
+    struct FS *fs;
+    struct TxnInode *inodes;
+    size_t inodes_number;
+    size_t inodes_capacity;
+};
+
+void txn_begin(struct Txn *txn, struct FS *fs);
+
+int txn_track(struct Txn *txn, struct Inode *inode, size_t blocks_required, int created);
+
+void txn_commit(struct Txn *txn);
+
+void txn_rollback(struct Txn *txn);
+
+#endif //TASK1_TXN_H
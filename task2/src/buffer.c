@@ -0,0 +1,57 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+
+void buffer_init(struct Buffer *buffer) {
+    buffer->data = NULL;
+    buffer->begin = 0;
+    buffer->end = 0;
+    buffer->capacity = 0;
+}
+
+void buffer_free(struct Buffer *buffer) {
+    free(buffer->data);
+    buffer_init(buffer);
+}
+
+size_t buffer_length(struct Buffer *buffer) {
+    return buffer->end - buffer->begin;
+}
+
+// Makes room for length more bytes after end, moving pending bytes to the front first
+int buffer_reserve(struct Buffer *buffer, size_t length) {
+    if (buffer->end + length <= buffer->capacity) return 0;
+
+    size_t pending = buffer_length(buffer);
+    if (buffer->begin > 0) {
+        memmove(buffer->data, buffer->data + buffer->begin, pending);
+        buffer->begin = 0;
+        buffer->end = pending;
+    }
+    if (pending + length <= buffer->capacity) return 0;
+
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while (capacity < pending + length) capacity *= 2;
+    char *data = realloc(buffer->data, capacity);
+    if (data == NULL) return -1;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+int buffer_append(struct Buffer *buffer, const char *data, size_t length) {
+    if (length == 0) return 0;
+    if (buffer_reserve(buffer, length) < 0) return -1;
+    memcpy(buffer->data + buffer->end, data, length);
+    buffer->end += length;
+    return 0;
+}
+
+void buffer_consume(struct Buffer *buffer, size_t length) {
+    buffer->begin += length;
+    if (buffer->begin == buffer->end) {
+        buffer->begin = 0;
+        buffer->end = 0;
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef TASK2_BUFFER_H
+#define TASK2_BUFFER_H
+
+#include <stdio.h>
+
+// Growable byte queue, bytes are appended at end and consumed from begin
+struct Buffer {
+    char *data;
+    size_t begin;
+    size_t end;
+    size_t capacity;
+};
+
+void buffer_init(struct Buffer *buffer);
+
+void buffer_free(struct Buffer *buffer);
+
+size_t buffer_length(struct Buffer *buffer);
+
+int buffer_reserve(struct Buffer *buffer, size_t length);
+
+int buffer_append(struct Buffer *buffer, const char *data, size_t length);
+
+void buffer_consume(struct Buffer *buffer, size_t length);
+
+#endif //TASK2_BUFFER_H
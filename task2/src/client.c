@@ -5,8 +5,116 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 
+#include "../../task1/src/exit_codes.h"
+#include "protocol.h"
+
+void handle_error(int res) {
+    switch (res) {
+        case NO_SPACE:
+            printf("No space left, file may be too big\n");
+            break;
+        case READ_FAILURE:
+            printf("Read failure\n");
+            break;
+        case WRITE_FAILURE:
+            printf("Write failure, file system may be corrupted\n");
+            break;
+        case TOO_SMALL_BUFFER:
+            printf("Technical error: too small buffer\n");
+            break;
+        case WRONG_FILE_TYPE:
+            printf("Wrong file type\n");
+            break;
+        case NOT_FOUND:
+            printf("File not found\n");
+            break;
+        case WRONG_INPUT:
+            printf("Wrong input\n");
+            break;
+        default:
+            break;
+    }
+}
+
+int send_all(int sockfd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_sent = send(sockfd, data, length, MSG_NOSIGNAL);
+        if (bytes_sent <= 0) return -1;
+        data += bytes_sent;
+        length -= bytes_sent;
+    }
+    return 0;
+}
+
+int receive_all(int sockfd, char *data, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_read = recv(sockfd, data, length, 0);
+        if (bytes_read <= 0) return -1;
+        data += bytes_read;
+        length -= bytes_read;
+    }
+    return 0;
+}
+
+int send_request(int sockfd, int opcode, uint32_t request_id, char *path, char *payload, size_t payload_length) {
+    struct Request request = {PROTOCOL_VERSION, opcode, request_id, strlen(path), payload_length};
+    unsigned char header[PROTOCOL_REQUEST_HEADER_LENGTH];
+    protocol_encode_request(header, &request);
+    if (send_all(sockfd, (char *) header, sizeof(header)) < 0) return -1;
+    if (send_all(sockfd, path, request.path_length) < 0) return -1;
+    return send_all(sockfd, payload, payload_length);
+}
+
+// Sends a local file as the payload of an add, in chunks so it is never held whole in memory
+int send_upload(int sockfd, uint32_t request_id, char *path, char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) return -2;
+    fseek(file, 0, SEEK_END);
+    long file_length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (file_length < 0 || file_length > PROTOCOL_PAYLOAD_LENGTH) {
+        fclose(file);
+        return -2;
+    }
+
+    struct Request request = {PROTOCOL_VERSION, OP_ADD, request_id, strlen(path), file_length};
+    unsigned char header[PROTOCOL_REQUEST_HEADER_LENGTH];
+    protocol_encode_request(header, &request);
+    int res = 0;
+    if (send_all(sockfd, (char *) header, sizeof(header)) < 0 || send_all(sockfd, path, request.path_length) < 0) {
+        res = -1;
+    }
+    char chunk[PROTOCOL_CHUNK_LENGTH];
+    size_t left = file_length;
+    while (res == 0 && left > 0) {
+        size_t length = left < sizeof(chunk) ? left : sizeof(chunk);
+        // A file that shrank meanwhile is padded with zeros to the declared length
+        size_t bytes_read = fread(chunk, 1, length, file);
+        memset(chunk + bytes_read, 0, length - bytes_read);
+        if (send_all(sockfd, chunk, length) < 0) res = -1;
+        left -= length;
+    }
+    fclose(file);
+    return res;
+}
+
+// Waits for the response, the payload is allocated and has to be freed by the caller
+int receive_response(int sockfd, struct Response *response, char **payload) {
+    unsigned char header[PROTOCOL_RESPONSE_HEADER_LENGTH];
+    if (receive_all(sockfd, (char *) header, sizeof(header)) < 0) return -1;
+    if (protocol_decode_response(header, response) < 0) return -1;
+    *payload = malloc(response->payload_length + 1);
+    if (*payload == NULL) return -1;
+    if (receive_all(sockfd, *payload, response->payload_length) < 0) {
+        free(*payload);
+        return -1;
+    }
+    (*payload)[response->payload_length] = 0;
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
+    if (argc < 3) {
         printf("Use: %s [address] [port]\n", argv[0]);
         return 1;
     }
@@ -45,21 +153,120 @@ int main(int argc, char *argv[]) {
 
     size_t buffer_size = 8192;
     char buffer[buffer_size];
+    uint32_t request_id = 0;
     while(1) {
         printf("command> ");
-        fgets(buffer, buffer_size, stdin);
+        if (fgets(buffer, buffer_size, stdin) == NULL) break;
         size_t bytes_read = strlen(buffer);
-        buffer[bytes_read - 1] = '\0';
+        if (bytes_read > 0 && buffer[bytes_read - 1] == '\n') buffer[--bytes_read] = '\0';
 
         if ((strcmp(buffer, "exit")) == 0) {
             printf("Disconnecting...\n");
             break;
+        } else if (strcmp(buffer, "help") == 0) {
+            printf("add <path> <content> - add file\nadd <path> - add dir\nread <path> - print file or dir\nupdate <path> <content> - update file\nappend <path> <content> - append to file\nupload <path> <local file> - add file with the content of a local file\ntruncate <path> <length> - resize file\nsize <path> - print file or dir size\nremove <path> - remove file or dir (recursively)\nstats [table|prometheus] - print server operation counters and latencies\nshutdown - shutdown server\nexit - leave\n");
+            continue;
+        }
+
+        char *command = buffer;
+        char *path = "";
+        char *content = buffer + bytes_read;
+        char *space = strchr(buffer, ' ');
+        if (space != NULL) {
+            *space = 0;
+            path = space + 1;
+            space = strchr(path, ' ');
+            if (space != NULL) {
+                *space = 0;
+                content = space + 1;
+            }
         }
 
-        write(sockfd, buffer, bytes_read);
-        read(sockfd, buffer, buffer_size);
-        printf("%s", buffer);
+        if (strcmp(command, "upload") == 0) {
+            request_id++;
+            int res = send_upload(sockfd, request_id, path, content);
+            if (res == -2) {
+                printf("Can not read local file: '%s'\n", content);
+                continue;
+            }
+            struct Response response;
+            char *response_payload;
+            if (res < 0 || receive_response(sockfd, &response, &response_payload) < 0) {
+                printf("Connection lost\n");
+                break;
+            }
+            if (response.status < 0) {
+                handle_error(response.status);
+            } else {
+                printf("OK\n");
+            }
+            free(response_payload);
+            continue;
+        }
+
+        int opcode;
+        char length_payload[8];
+        char *payload = content;
+        // Contents are stored with the terminating zero, like task1 and the text protocol do
+        size_t payload_length = strlen(content) + 1;
+        if (strcmp(command, "read") == 0) {
+            opcode = OP_READ;
+        } else if (strcmp(command, "add") == 0) {
+            opcode = OP_ADD;
+        } else if (strcmp(command, "update") == 0) {
+            opcode = OP_UPDATE;
+        } else if (strcmp(command, "append") == 0) {
+            opcode = OP_APPEND;
+        } else if (strcmp(command, "truncate") == 0) {
+            opcode = OP_TRUNCATE;
+            protocol_put_u64((unsigned char *) length_payload, strtoull(content, NULL, 10));
+            payload = length_payload;
+            payload_length = sizeof(length_payload);
+        } else if (strcmp(command, "size") == 0) {
+            opcode = OP_SIZE;
+        } else if (strcmp(command, "remove") == 0) {
+            opcode = OP_REMOVE;
+        } else if (strcmp(command, "shutdown") == 0) {
+            opcode = OP_SHUTDOWN;
+        } else if (strcmp(command, "stats") == 0) {
+            opcode = OP_STATS;
+            if (path[0] == 0) path = "table";
+        } else {
+            printf("Unknown command: '%s'\n", command);
+            continue;
+        }
+        if (opcode == OP_READ || opcode == OP_SIZE || opcode == OP_REMOVE || opcode == OP_SHUTDOWN ||
+            opcode == OP_STATS) {
+            payload_length = 0;
+        } else if (opcode == OP_ADD && path[0] != 0 && path[strlen(path) - 1] == '/') {
+            payload_length = 0;
+        }
+
+        request_id++;
+        struct Response response;
+        char *response_payload;
+        if (send_request(sockfd, opcode, request_id, path, payload, payload_length) < 0 ||
+            receive_response(sockfd, &response, &response_payload) < 0) {
+            printf("Connection lost\n");
+            break;
+        }
+
+        if (response.status < 0) {
+            handle_error(response.status);
+        } else if (opcode == OP_READ) {
+            printf("%s\n", response_payload);
+        } else if (opcode == OP_STATS) {
+            fwrite(response_payload, 1, response.payload_length, stdout);
+        } else if (opcode == OP_SIZE) {
+            printf("%d\n", response.status);
+        } else if (opcode == OP_SHUTDOWN) {
+            printf("Exiting...\n");
+        } else {
+            printf("OK\n");
+        }
+        free(response_payload);
+        if (opcode == OP_SHUTDOWN) break;
     }
 
     close(sockfd);
-}
\ No newline at end of file
+}
@@ -0,0 +1,104 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "connection.h"
+
+static int connection_watch(int epoll_fd, struct Connection *connection, unsigned int events, int op) {
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = connection;
+    if (epoll_ctl(epoll_fd, op, connection->fd, &event) < 0) return -1;
+    connection->events = events;
+    return 0;
+}
+
+struct Connection *connection_open(int epoll_fd, int fd) {
+    struct Connection *connection = malloc(sizeof(struct Connection));
+    if (connection == NULL) return NULL;
+    connection->fd = fd;
+    buffer_init(&connection->input);
+    buffer_init(&connection->output);
+    connection->mode = CONNECTION_MODE_UNKNOWN;
+    connection->closing = 0;
+    connection->eof = 0;
+    connection->pending = 0;
+    connection->stalled = 0;
+    connection->resume_idx = CONNECTION_NOT_RESUMED;
+    connection->exclusive = 0;
+    connection->closed = 0;
+    connection->upload = NULL;
+    if (connection_watch(epoll_fd, connection, EPOLLIN, EPOLL_CTL_ADD) < 0) {
+        free(connection);
+        return NULL;
+    }
+    return connection;
+}
+
+// Stops serving the connection. Pending work may still use the socket, the connection is freed by
+// calling this again once the last of it completes
+void connection_close(int epoll_fd, struct Connection *connection) {
+    if (!connection->closed) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    connection->closed = 1;
+    buffer_free(&connection->input);
+    buffer_free(&connection->output);
+    if (connection->pending > 0) return;
+    close(connection->fd);
+    free(connection);
+}
+
+// Queues data, it is sent by connection_flush
+int connection_send(struct Connection *connection, const char *data, size_t length) {
+    return buffer_append(&connection->output, data, length);
+}
+
+// Reads what is available on the socket until the input holds limit bytes, returns 0 once the peer has
+// closed it
+int connection_receive(struct Connection *connection, size_t limit) {
+    while (buffer_length(&connection->input) < limit) {
+        if (buffer_reserve(&connection->input, 4096) < 0) return -1;
+        struct Buffer *input = &connection->input;
+        size_t room = input->capacity - input->end;
+        if (room > limit - buffer_length(input)) room = limit - buffer_length(input);
+        ssize_t bytes_read = recv(connection->fd, input->data + input->end, room, 0);
+        if (bytes_read > 0) {
+            input->end += bytes_read;
+            continue;
+        }
+        if (bytes_read == 0) return 0;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+        return -1;
+    }
+    return 1;
+}
+
+// Sends as much queued output as the socket takes and waits for writability if some is left.
+// Returns 0 once a closing connection has sent everything and may be closed
+int connection_flush(int epoll_fd, struct Connection *connection) {
+    struct Buffer *output = &connection->output;
+    while (buffer_length(output) > 0) {
+        ssize_t bytes_sent = send(connection->fd, output->data + output->begin, buffer_length(output),
+                                  MSG_NOSIGNAL);
+        if (bytes_sent > 0) {
+            buffer_consume(output, bytes_sent);
+            continue;
+        }
+        if (bytes_sent < 0 && errno == EINTR) continue;
+        if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        return -1;
+    }
+    if (connection->closing && buffer_length(output) == 0) return 0;
+
+    unsigned int events = 0;
+    if (!connection->closing && !connection->stalled && !connection->eof &&
+        buffer_length(output) < CONNECTION_OUTPUT_LIMIT) events |= EPOLLIN;
+    if (buffer_length(output) > 0) events |= EPOLLOUT;
+    if (events != connection->events &&
+        connection_watch(epoll_fd, connection, events, EPOLL_CTL_MOD) < 0) {
+        return -1;
+    }
+    return 1;
+}
@@ -0,0 +1,57 @@
+#ifndef TASK2_CONNECTION_H
+#define TASK2_CONNECTION_H
+
+#include "buffer.h"
+
+#ifndef MAX_CONNECTIONS
+#define MAX_CONNECTIONS 1024
+#endif
+
+#define CONNECTION_MODE_UNKNOWN 0
+#define CONNECTION_MODE_TEXT 1
+#define CONNECTION_MODE_BINARY 2
+
+#define CONNECTION_NOT_RESUMED ((size_t) -1)
+
+// Reading from a client stops while this much of its output is not sent yet
+#define CONNECTION_OUTPUT_LIMIT (1 << 20)
+
+struct Connection {
+    int fd;
+    // Position in the server connections table
+    size_t idx;
+    struct Buffer input;
+    struct Buffer output;
+    // Protocol, chosen by the first byte the client sends
+    int mode;
+    // Registered epoll events, to skip redundant epoll_ctl calls
+    unsigned int events;
+    // Set when the connection is closed once its output is sent
+    int closing;
+    // Set when the peer has closed its side, the connection stays until pending commands are answered
+    int eof;
+    // Commands handed to the workers and not answered yet, a closed connection is freed when they are
+    size_t pending;
+    // Set while no more input is taken until some work completes
+    int stalled;
+    // Position in the server list of connections served again once work completes, CONNECTION_NOT_RESUMED if absent
+    size_t resume_idx;
+    // Set while a job writes to the socket itself, nothing else is sent or taken meanwhile
+    int exclusive;
+    // Set once the server dropped the connection, the socket stays open for pending work
+    int closed;
+    // Frame whose payload is being streamed to the file system, owned by the server
+    struct Upload *upload;
+};
+
+struct Connection *connection_open(int epoll_fd, int fd);
+
+void connection_close(int epoll_fd, struct Connection *connection);
+
+int connection_send(struct Connection *connection, const char *data, size_t length);
+
+int connection_receive(struct Connection *connection, size_t limit);
+
+int connection_flush(int epoll_fd, struct Connection *connection);
+
+#endif //TASK2_CONNECTION_H
@@ -0,0 +1,565 @@
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../task1/src/exit_codes.h"
+#include "protocol.h"
+
+#define LOADGEN_OPS_NUMBER 4
+
+#define LOADGEN_PATH_LENGTH 64
+
+// Files one connection keeps alive at most through its adds and removes
+#define LOADGEN_LIVE_FILES 4
+
+// Requests one connection may have in flight in open-loop mode, ids are mapped onto this many slots
+#define LOADGEN_WINDOW 4096
+
+// Log-linear histogram of nanoseconds: exact below 32, then 16 buckets per power of two, so every bucket is
+// within 1/16 of its value
+#define HISTOGRAM_SUB_BUCKETS 16
+#define HISTOGRAM_BUCKETS (32 + 64 * HISTOGRAM_SUB_BUCKETS)
+
+static const int loadgen_opcodes[LOADGEN_OPS_NUMBER] = {OP_READ, OP_ADD, OP_UPDATE, OP_REMOVE};
+static const char *loadgen_op_names[LOADGEN_OPS_NUMBER] = {"read", "add", "update", "remove"};
+
+struct Histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+struct Options {
+    in_addr_t addr;
+    int port;
+    size_t connections;
+    double duration;
+    // Requests per second over all connections, 0 runs closed-loop at maximum throughput
+    double rate;
+    // Percent of read, add, update and remove
+    unsigned int mix[LOADGEN_OPS_NUMBER];
+    size_t keys;
+    // Zipfian skew, 0 picks keys uniformly
+    double theta;
+    size_t value_size;
+};
+
+// Zipfian key generator after Gray et al., "Quickly generating billion-record synthetic databases"
+struct Zipf {
+    size_t n;
+    double theta;
+    double alpha;
+    double zeta_n;
+    double eta;
+};
+
+struct Worker {
+    pthread_t thread;
+    struct Options *options;
+    struct Zipf *zipf;
+    size_t idx;
+    uint64_t random;
+
+    struct Histogram histograms[LOADGEN_OPS_NUMBER];
+    uint64_t errors[LOADGEN_OPS_NUMBER];
+    // Files this connection added and removed, names repeat only after the directory was removed
+    uint64_t added;
+    uint64_t removed;
+
+    // Open-loop requests that could not be sent because the window was full
+    uint64_t dropped;
+    int failed;
+};
+
+static uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// xorshift64*
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double next_unit(uint64_t *state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void zipf_init(struct Zipf *zipf, size_t n, double theta) {
+    zipf->n = n;
+    zipf->theta = theta;
+    double zeta_2 = 0;
+    zipf->zeta_n = 0;
+    for (size_t i = 1; i <= n; i++) {
+        zipf->zeta_n += 1 / pow(i, theta);
+        if (i == 2) zeta_2 = zipf->zeta_n;
+    }
+    zipf->alpha = 1 / (1 - theta);
+    zipf->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta_2 / zipf->zeta_n);
+}
+
+static size_t zipf_next(struct Zipf *zipf, uint64_t *state) {
+    double u = next_unit(state);
+    double uz = u * zipf->zeta_n;
+    if (uz < 1) return 0;
+    if (uz < 1 + pow(0.5, zipf->theta)) return 1 < zipf->n ? 1 : 0;
+    size_t key = (size_t) (zipf->n * pow(zipf->eta * u - zipf->eta + 1, zipf->alpha));
+    return key < zipf->n ? key : zipf->n - 1;
+}
+
+static size_t histogram_index(uint64_t value) {
+    if (value < 32) return value;
+    int high = 63 - __builtin_clzll(value);
+    int shift = high - 4;
+    return 32 + (shift - 1) * HISTOGRAM_SUB_BUCKETS + ((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+// Highest value counted in the bucket
+static uint64_t histogram_value(size_t idx) {
+    if (idx < 32) return idx;
+    int shift = (idx - 32) / HISTOGRAM_SUB_BUCKETS + 1;
+    uint64_t sub = (idx - 32) % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void histogram_record(struct Histogram *histogram, uint64_t value) {
+    histogram->counts[histogram_index(value)]++;
+    histogram->total++;
+    if (value > histogram->max) histogram->max = value;
+}
+
+static void histogram_merge(struct Histogram *to, struct Histogram *from) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) to->counts[i] += from->counts[i];
+    to->total += from->total;
+    if (from->max > to->max) to->max = from->max;
+}
+
+static uint64_t histogram_percentile(struct Histogram *histogram, double percentile) {
+    uint64_t rank = (uint64_t) ceil(histogram->total * percentile / 100);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) return histogram->max < histogram_value(i) ? histogram->max : histogram_value(i);
+    }
+    return histogram->max;
+}
+
+// Percentile distribution in the layout of HdrHistogram, values in microseconds
+static void histogram_print(struct Histogram *histogram) {
+    printf("%12s %14s %10s %14s\n", "Value(us)", "Percentile", "TotalCount", "1/(1-Percentile)");
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (histogram->counts[i] == 0) continue;
+        seen += histogram->counts[i];
+        double fraction = (double) seen / histogram->total;
+        uint64_t value = histogram->max < histogram_value(i) ? histogram->max : histogram_value(i);
+        if (fraction < 1) {
+            printf("%12.3f %14.12f %10llu %14.2f\n", value / 1000.0, fraction, (unsigned long long) seen,
+                   1 / (1 - fraction));
+        } else {
+            printf("%12.3f %14.12f %10llu %14s\n", value / 1000.0, fraction, (unsigned long long) seen, "inf");
+        }
+    }
+    printf("#[Max = %.3f, Total count = %llu]\n", histogram->max / 1000.0, (unsigned long long) histogram->total);
+}
+
+static int send_all(int sockfd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_sent = send(sockfd, data, length, MSG_NOSIGNAL);
+        if (bytes_sent <= 0) return -1;
+        data += bytes_sent;
+        length -= bytes_sent;
+    }
+    return 0;
+}
+
+static int receive_all(int sockfd, char *data, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_read = recv(sockfd, data, length, 0);
+        if (bytes_read <= 0) return -1;
+        data += bytes_read;
+        length -= bytes_read;
+    }
+    return 0;
+}
+
+static int connect_server(struct Options *options) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) return -1;
+    struct sockaddr_in servaddr;
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = options->addr;
+    servaddr.sin_port = htons(options->port);
+    if (connect(sockfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) != 0) {
+        close(sockfd);
+        return -1;
+    }
+    // Pipelined requests must not wait for the acknowledgement of the previous ones
+    int opt_val = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt_val, sizeof(opt_val));
+    return sockfd;
+}
+
+// Sends the whole frame with one call, so it goes out in as few segments as possible
+static int send_path(int sockfd, int opcode, uint32_t request_id, char *path, char *value, size_t value_length) {
+    if (opcode != OP_ADD && opcode != OP_UPDATE) value_length = 0;
+    struct Request request = {PROTOCOL_VERSION, opcode, request_id, strlen(path), value_length};
+    size_t frame_length = PROTOCOL_REQUEST_HEADER_LENGTH + request.path_length + value_length;
+    char *frame = malloc(frame_length);
+    if (frame == NULL) return -1;
+    protocol_encode_request((unsigned char *) frame, &request);
+    memcpy(frame + PROTOCOL_REQUEST_HEADER_LENGTH, path, request.path_length);
+    memcpy(frame + PROTOCOL_REQUEST_HEADER_LENGTH + request.path_length, value, value_length);
+    int res = send_all(sockfd, frame, frame_length);
+    free(frame);
+    return res;
+}
+
+static int send_request(int sockfd, int opcode, uint32_t request_id, size_t key, char *value, size_t value_length) {
+    char path[LOADGEN_PATH_LENGTH];
+    snprintf(path, sizeof(path), "/loadgen/k%zu", key);
+    return send_path(sockfd, opcode, request_id, path, value, value_length);
+}
+
+// Reads one response and drops its payload
+static int receive_response(int sockfd, struct Response *response, char **payload, size_t *payload_capacity) {
+    unsigned char header[PROTOCOL_RESPONSE_HEADER_LENGTH];
+    if (receive_all(sockfd, (char *) header, sizeof(header)) < 0) return -1;
+    if (protocol_decode_response(header, response) < 0) return -1;
+    if (response->payload_length > *payload_capacity) {
+        char *resized = realloc(*payload, response->payload_length);
+        if (resized == NULL) return -1;
+        *payload = resized;
+        *payload_capacity = response->payload_length;
+    }
+    return receive_all(sockfd, *payload, response->payload_length);
+}
+
+static int pick_op(struct Worker *worker) {
+    unsigned int roll = next_random(&worker->random) % 100;
+    for (int i = 0; i < LOADGEN_OPS_NUMBER; i++) {
+        if (roll < worker->options->mix[i]) return i;
+        roll -= worker->options->mix[i];
+    }
+    return 0;
+}
+
+static size_t pick_key(struct Worker *worker) {
+    if (worker->zipf != NULL) return zipf_next(worker->zipf, &worker->random);
+    return next_random(&worker->random) % worker->options->keys;
+}
+
+// Reads and updates go to the shared keys. The file system does not refuse duplicate names, so every add
+// creates a new file in the directory of this connection and every remove takes its oldest one. An add with
+// LOADGEN_LIVE_FILES alive is sent as a remove and a remove with none alive as an add, which keeps the mix.
+// Returns the operation sent
+static int send_op(struct Worker *worker, int sockfd, int op, uint32_t request_id, char *value) {
+    int opcode = loadgen_opcodes[op];
+    if (opcode == OP_READ || opcode == OP_UPDATE) {
+        if (send_request(sockfd, opcode, request_id, pick_key(worker), value, worker->options->value_size) < 0) {
+            return -1;
+        }
+        return op;
+    }
+    uint64_t alive = worker->added - worker->removed;
+    if (opcode == OP_ADD && alive == LOADGEN_LIVE_FILES) opcode = OP_REMOVE;
+    if (opcode == OP_REMOVE && alive == 0) opcode = OP_ADD;
+    uint64_t file = opcode == OP_ADD ? worker->added++ : worker->removed++;
+    char path[LOADGEN_PATH_LENGTH];
+    snprintf(path, sizeof(path), "/loadgen/c%zu/f%llu", worker->idx, (unsigned long long) file);
+    if (send_path(sockfd, opcode, request_id, path, value, worker->options->value_size) < 0) return -1;
+    for (op = 0; loadgen_opcodes[op] != opcode; op++);
+    return op;
+}
+
+// Removes the directory of a connection with whatever files earlier runs left in it
+static int remove_files(struct Worker *worker, int sockfd) {
+    char path[LOADGEN_PATH_LENGTH];
+    snprintf(path, sizeof(path), "/loadgen/c%zu/", worker->idx);
+    struct Response response;
+    char *payload = NULL;
+    size_t payload_capacity = 0;
+    int res = send_path(sockfd, OP_REMOVE, 0, path, NULL, 0);
+    // Skips open-loop answers that were given up on, ids of measured requests start at 1
+    do {
+        if (res >= 0) res = receive_response(sockfd, &response, &payload, &payload_capacity);
+    } while (res >= 0 && response.request_id != 0);
+    free(payload);
+    return res;
+}
+
+// Records a response. Missing files are not errors, a remove may overtake its add on the server
+static void complete(struct Worker *worker, int op, struct Response *response, uint64_t latency) {
+    histogram_record(&worker->histograms[op], latency);
+    if (response->status < 0 && response->status != NOT_FOUND) worker->errors[op]++;
+}
+
+// Sends the next request when the previous one is answered
+static void run_closed_loop(struct Worker *worker, int sockfd, char *value, uint64_t deadline) {
+    char *payload = NULL;
+    size_t payload_capacity = 0;
+    uint32_t request_id = 0;
+    while (now_ns() < deadline) {
+        uint64_t started = now_ns();
+        struct Response response;
+        int op = send_op(worker, sockfd, pick_op(worker), ++request_id, value);
+        if (op < 0 || receive_response(sockfd, &response, &payload, &payload_capacity) < 0) {
+            worker->failed = 1;
+            break;
+        }
+        complete(worker, op, &response, now_ns() - started);
+    }
+    free(payload);
+}
+
+// Sends on a fixed schedule whatever the answers are. Latency counts from the scheduled time, so a stalled
+// server is charged for the requests it delayed
+static void run_open_loop(struct Worker *worker, int sockfd, char *value, uint64_t deadline) {
+    uint64_t interval = (uint64_t) (1e9 * worker->options->connections / worker->options->rate);
+    uint64_t scheduled[LOADGEN_WINDOW];
+    // Operation in flight in each slot, -1 when free
+    int ops[LOADGEN_WINDOW];
+    for (size_t i = 0; i < LOADGEN_WINDOW; i++) ops[i] = -1;
+    size_t in_flight = 0;
+    char *payload = NULL;
+    size_t payload_capacity = 0;
+    uint32_t request_id = 0;
+    // Connections start spread over one interval
+    uint64_t next = now_ns() + interval * worker->idx / worker->options->connections;
+
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= deadline && in_flight == 0) break;
+        // Answers still missing a second after the end are given up
+        if (now >= deadline + 1000000000ULL) break;
+
+        while (now < deadline && next <= now) {
+            request_id++;
+            if (ops[request_id % LOADGEN_WINDOW] >= 0) {
+                worker->dropped++;
+            } else {
+                int op = send_op(worker, sockfd, pick_op(worker), request_id, value);
+                if (op < 0) {
+                    worker->failed = 1;
+                    free(payload);
+                    return;
+                }
+                scheduled[request_id % LOADGEN_WINDOW] = next;
+                ops[request_id % LOADGEN_WINDOW] = op;
+                in_flight++;
+            }
+            next += interval;
+        }
+
+        // Sleeps to the exact next send, a whole-millisecond poll would spin the last millisecond away
+        uint64_t timeout = 1000000000;
+        if (now < deadline) timeout = next > now ? next - now : 0;
+        struct timespec timeout_spec = {(time_t) (timeout / 1000000000), (long) (timeout % 1000000000)};
+        struct pollfd poll_fd = {sockfd, POLLIN, 0};
+        int res = ppoll(&poll_fd, 1, &timeout_spec, NULL);
+        if (res < 0) continue;
+        if (res == 0) continue;
+
+        struct Response response;
+        if (receive_response(sockfd, &response, &payload, &payload_capacity) < 0) {
+            worker->failed = 1;
+            break;
+        }
+        size_t slot = response.request_id % LOADGEN_WINDOW;
+        if (ops[slot] < 0) continue;
+        complete(worker, ops[slot], &response, now_ns() - scheduled[slot]);
+        ops[slot] = -1;
+        in_flight--;
+    }
+    free(payload);
+}
+
+static void *run_worker(void *arg) {
+    struct Worker *worker = arg;
+    int sockfd = connect_server(worker->options);
+    if (sockfd < 0) {
+        worker->failed = 1;
+        return NULL;
+    }
+    char *value = malloc(worker->options->value_size + 1);
+    memset(value, 'v', worker->options->value_size);
+    remove_files(worker, sockfd);
+
+    uint64_t deadline = now_ns() + (uint64_t) (worker->options->duration * 1e9);
+    if (worker->options->rate > 0) {
+        run_open_loop(worker, sockfd, value, deadline);
+    } else {
+        run_closed_loop(worker, sockfd, value, deadline);
+    }
+    if (!worker->failed) remove_files(worker, sockfd);
+    free(value);
+    close(sockfd);
+    return NULL;
+}
+
+// Adds the keys missing from earlier runs so reads and updates find them
+static int preload(struct Options *options) {
+    int sockfd = connect_server(options);
+    if (sockfd < 0) return -1;
+    char *value = malloc(options->value_size + 1);
+    memset(value, 'v', options->value_size);
+    char *payload = NULL;
+    size_t payload_capacity = 0;
+    int res = 0;
+    for (size_t key = 0; key < options->keys && res >= 0; key++) {
+        struct Response response;
+        res = send_request(sockfd, OP_SIZE, key, key, value, 0);
+        if (res >= 0) res = receive_response(sockfd, &response, &payload, &payload_capacity);
+        if (res < 0 || response.status != NOT_FOUND) continue;
+        res = send_request(sockfd, OP_ADD, key, key, value, options->value_size);
+        if (res >= 0) res = receive_response(sockfd, &response, &payload, &payload_capacity);
+    }
+    free(payload);
+    free(value);
+    close(sockfd);
+    return res;
+}
+
+static int parse_option(struct Options *options, char *option) {
+    char *value = strchr(option, '=');
+    if (value == NULL) return -1;
+    *value++ = 0;
+    if (strcmp(option, "connections") == 0) {
+        options->connections = strtoul(value, NULL, 10);
+    } else if (strcmp(option, "duration") == 0) {
+        options->duration = atof(value);
+    } else if (strcmp(option, "rate") == 0) {
+        options->rate = strcmp(value, "max") == 0 ? 0 : atof(value);
+    } else if (strcmp(option, "mix") == 0) {
+        if (sscanf(value, "%u:%u:%u:%u", &options->mix[0], &options->mix[1], &options->mix[2],
+                   &options->mix[3]) != 4) {
+            return -1;
+        }
+    } else if (strcmp(option, "keys") == 0) {
+        options->keys = strtoul(value, NULL, 10);
+    } else if (strcmp(option, "distribution") == 0) {
+        if (strcmp(value, "uniform") == 0) {
+            options->theta = 0;
+        } else if (strncmp(value, "zipfian", 7) == 0) {
+            options->theta = value[7] == ':' ? atof(value + 8) : 0.99;
+        } else {
+            return -1;
+        }
+    } else if (strcmp(option, "size") == 0) {
+        options->value_size = strtoul(value, NULL, 10);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("Use: %s [address] [port] [option=value]...\n"
+               "connections=16 - concurrent connections\n"
+               "duration=10 - seconds to run\n"
+               "rate=max - requests per second over all connections, max runs closed-loop\n"
+               "mix=80:5:10:5 - percent of read:add:update:remove\n"
+               "keys=100 - number of distinct files\n"
+               "distribution=uniform - uniform or zipfian[:theta], theta defaults to 0.99\n"
+               "size=128 - bytes written by add and update\n", argv[0]);
+        return 1;
+    }
+
+    struct Options options = {0, 0, 16, 10, 0, {80, 5, 10, 5}, 100, 0, 128};
+    options.addr = inet_addr(argv[1]);
+    if (options.addr == (in_addr_t) -1) {
+        printf("Invalid address: %s\n", argv[1]);
+        return 1;
+    }
+    options.port = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) {
+        if (parse_option(&options, argv[i]) < 0) {
+            printf("Invalid option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    unsigned int mix_total = options.mix[0] + options.mix[1] + options.mix[2] + options.mix[3];
+    if (options.port == 0 || options.connections == 0 || options.keys == 0 || options.duration <= 0 ||
+        mix_total != 100 || options.theta < 0 || options.theta >= 1 ||
+        options.value_size > PROTOCOL_CHUNK_LENGTH) {
+        printf("Invalid options\n");
+        return 1;
+    }
+
+    if (preload(&options) < 0) {
+        printf("Failed to connect to server\n");
+        return 1;
+    }
+
+    struct Zipf zipf;
+    if (options.theta > 0) zipf_init(&zipf, options.keys, options.theta);
+    struct Worker *workers = calloc(options.connections, sizeof(struct Worker));
+    if (workers == NULL) return 1;
+    uint64_t started = now_ns();
+    for (size_t i = 0; i < options.connections; i++) {
+        workers[i].options = &options;
+        workers[i].zipf = options.theta > 0 ? &zipf : NULL;
+        workers[i].idx = i;
+        workers[i].random = 0x9E3779B97F4A7C15ULL * (i + 1);
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+
+    struct Histogram total;
+    memset(&total, 0, sizeof(total));
+    struct Histogram *histograms = calloc(LOADGEN_OPS_NUMBER, sizeof(struct Histogram));
+    uint64_t errors[LOADGEN_OPS_NUMBER] = {0};
+    uint64_t dropped = 0;
+    size_t failed = 0;
+    for (size_t i = 0; i < options.connections; i++) {
+        pthread_join(workers[i].thread, NULL);
+        for (int op = 0; op < LOADGEN_OPS_NUMBER; op++) {
+            histogram_merge(&histograms[op], &workers[i].histograms[op]);
+            errors[op] += workers[i].errors[op];
+        }
+        dropped += workers[i].dropped;
+        failed += workers[i].failed;
+    }
+    double elapsed = (now_ns() - started) / 1e9;
+
+    printf("%-8s %10s %8s %12s %10s %10s %10s %10s %10s\n", "op", "count", "errors", "ops/sec", "p50(us)",
+           "p90(us)", "p99(us)", "p99.9(us)", "max(us)");
+    for (int op = 0; op < LOADGEN_OPS_NUMBER; op++) {
+        struct Histogram *histogram = &histograms[op];
+        histogram_merge(&total, histogram);
+        if (histogram->total == 0) continue;
+        printf("%-8s %10llu %8llu %12.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", loadgen_op_names[op],
+               (unsigned long long) histogram->total, (unsigned long long) errors[op], histogram->total / elapsed,
+               histogram_percentile(histogram, 50) / 1000.0, histogram_percentile(histogram, 90) / 1000.0,
+               histogram_percentile(histogram, 99) / 1000.0, histogram_percentile(histogram, 99.9) / 1000.0,
+               histogram->max / 1000.0);
+    }
+    printf("%-8s %10llu %8s %12.1f\n", "total", (unsigned long long) total.total, "", total.total / elapsed);
+    if (dropped > 0) printf("Dropped %llu requests, the window was full\n", (unsigned long long) dropped);
+    if (failed > 0) printf("%zu connections failed\n", failed);
+    printf("\n");
+    if (total.total > 0) histogram_print(&total);
+
+    free(histograms);
+    free(workers);
+    return failed > 0 ? 1 : 0;
+}
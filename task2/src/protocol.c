@@ -0,0 +1,72 @@
+#include "protocol.h"
+#include "../../task1/src/exit_codes.h"
+
+static void protocol_put_u32(unsigned char *bytes, uint32_t value) {
+    for (int i = 3; i >= 0; i--) {
+        bytes[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static uint32_t protocol_get_u32(const unsigned char *bytes) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) value = value << 8 | bytes[i];
+    return value;
+}
+
+void protocol_put_u64(unsigned char *bytes, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+        bytes[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+uint64_t protocol_get_u64(const unsigned char *bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) value = value << 8 | bytes[i];
+    return value;
+}
+
+void protocol_encode_request(unsigned char *header, struct Request *request) {
+    header[0] = PROTOCOL_MAGIC;
+    header[1] = request->version;
+    header[2] = request->opcode;
+    header[3] = 0;
+    protocol_put_u32(header + 4, request->request_id);
+    protocol_put_u32(header + 8, request->path_length);
+    protocol_put_u64(header + 12, request->payload_length);
+}
+
+// Fails on frames of other versions or with lengths over the limits, the stream cannot be resynchronized after them
+int protocol_decode_request(const unsigned char *header, struct Request *request) {
+    request->version = header[1];
+    request->opcode = header[2];
+    request->request_id = protocol_get_u32(header + 4);
+    request->path_length = protocol_get_u32(header + 8);
+    request->payload_length = protocol_get_u64(header + 12);
+    if (header[0] != PROTOCOL_MAGIC || request->version != PROTOCOL_VERSION) return WRONG_INPUT;
+    if (request->path_length > PROTOCOL_PATH_LENGTH || request->payload_length > PROTOCOL_PAYLOAD_LENGTH) {
+        return NO_SPACE;
+    }
+    return 0;
+}
+
+void protocol_encode_response(unsigned char *header, struct Response *response) {
+    header[0] = PROTOCOL_MAGIC;
+    header[1] = response->version;
+    header[2] = response->opcode;
+    header[3] = 0;
+    protocol_put_u32(header + 4, response->request_id);
+    protocol_put_u32(header + 8, (uint32_t) response->status);
+    protocol_put_u64(header + 12, response->payload_length);
+}
+
+int protocol_decode_response(const unsigned char *header, struct Response *response) {
+    response->version = header[1];
+    response->opcode = header[2];
+    response->request_id = protocol_get_u32(header + 4);
+    response->status = (int32_t) protocol_get_u32(header + 8);
+    response->payload_length = protocol_get_u64(header + 12);
+    if (header[0] != PROTOCOL_MAGIC || response->version != PROTOCOL_VERSION) return WRONG_INPUT;
+    return 0;
+}
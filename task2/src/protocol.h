@@ -0,0 +1,74 @@
+#ifndef TASK2_PROTOCOL_H
+#define TASK2_PROTOCOL_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Binary frames start with this byte, anything else is read as a text command
+#define PROTOCOL_MAGIC 0xF5
+#define PROTOCOL_VERSION 1
+
+// Request: magic, version, opcode, reserved byte, request id (4), path length (4), payload length (8).
+// Followed by the path and the payload. Integers are big-endian
+#define PROTOCOL_REQUEST_HEADER_LENGTH 20
+// Response: magic, version, opcode, reserved byte, request id (4), status (4), payload length (8).
+// Followed by the payload
+#define PROTOCOL_RESPONSE_HEADER_LENGTH 20
+
+#define PROTOCOL_PATH_LENGTH 4096
+// Payloads are bounded by the int lengths of the file system API
+#define PROTOCOL_PAYLOAD_LENGTH 0x7fffffff
+// Longer payloads of add, update, pwrite and append are written in chunks of this size as they arrive, so
+// a reader may see the file partly written and a failed update keeps the chunks written before the error. Other
+// requests may not carry more than this
+#define PROTOCOL_CHUNK_LENGTH (64 * 1024)
+
+// Path only, responds with the content
+#define OP_READ 1
+// Payload is the content, the path ending with '/' adds a dir
+#define OP_ADD 2
+#define OP_UPDATE 3
+#define OP_REMOVE 4
+// Status is the size
+#define OP_SIZE 5
+// Payload is offset (8) and length (8), responds with the bytes read
+#define OP_PREAD 6
+// Payload is offset (8) and the bytes, status is the number of bytes written
+#define OP_PWRITE 7
+#define OP_APPEND 8
+// Payload is the new length (8)
+#define OP_TRUNCATE 9
+#define OP_SHUTDOWN 10
+// Path names the format, table or prometheus, responds with the counters as text
+#define OP_STATS 11
+
+struct Request {
+    uint8_t version;
+    uint8_t opcode;
+    uint32_t request_id;
+    uint32_t path_length;
+    uint64_t payload_length;
+};
+
+// Status is the result of the call, negative values are error codes from exit_codes.h
+struct Response {
+    uint8_t version;
+    uint8_t opcode;
+    uint32_t request_id;
+    int32_t status;
+    uint64_t payload_length;
+};
+
+void protocol_put_u64(unsigned char *bytes, uint64_t value);
+
+uint64_t protocol_get_u64(const unsigned char *bytes);
+
+void protocol_encode_request(unsigned char *header, struct Request *request);
+
+int protocol_decode_request(const unsigned char *header, struct Request *request);
+
+void protocol_encode_response(unsigned char *header, struct Response *response);
+
+int protocol_decode_response(const unsigned char *header, struct Response *response);
+
+#endif //TASK2_PROTOCOL_H
@@ -1,6 +1,13 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <unistd.h>
@@ -8,53 +15,795 @@
 #include <sys/stat.h>
 
 #include "../../task1/src/fs.h"
+#include "../../task1/src/trace.h"
+#include "connection.h"
+#include "protocol.h"
+#include "workers.h"
+
+// Longest text command, longer ones close the connection
+#define SERVER_MESSAGE_LENGTH 8192
+
+// Input read ahead per connection, enough for the largest frame that is not streamed
+#define SERVER_INPUT_LIMIT (PROTOCOL_REQUEST_HEADER_LENGTH + PROTOCOL_PATH_LENGTH + PROTOCOL_CHUNK_LENGTH)
+
+#define SERVER_EVENTS_NUMBER 64
 
-int server_fd, client_fd;
+// Attempts at reading a whole file that keeps growing between taking its size and reading it
+#define SERVER_READ_ATTEMPTS 4
+
+// Milliseconds a worker streaming a file waits for a client that does not read, it is dropped then
+#define SERVER_SEND_TIMEOUT 10000
+
+int server_fd, epoll_fd;
 
 struct FS fs;
 
+struct WorkerPool workers;
+
+// Where recorded image accesses go on shutdown, NULL when not tracing
+char *trace_filename = NULL;
+
+struct Connection *connections[MAX_CONNECTIONS];
+size_t connections_number = 0;
+
+// Connections that got replies or found the queue full, served again once the completed work is handed out
+struct Connection *resumed[MAX_CONNECTIONS];
+size_t resumed_number = 0;
+
+// One parsed command, executed by a worker thread. The reply is built in output and appended to the
+// connection output by the network thread
+struct Job {
+    struct Work work;
+    struct Connection *connection;
+    int binary;
+    struct Request request;
+    // Text command, or the path of a binary request
+    char *message;
+    size_t message_length;
+    char *payload;
+    struct Buffer output;
+    // Set when the job may write a read reply to the socket itself, no other output is queued before it
+    int exclusive;
+    // Set when writing to the socket failed part way, the connection is dropped
+    int failed;
+    // Set for a chunk of a streamed payload, written at offset and answered with status by the network thread
+    int chunk;
+    size_t offset;
+    int status;
+    // File of a streamed add or update, pinned by its first chunk and written to by the others
+    struct Inode *file;
+};
+
+// Frame whose payload is longer than PROTOCOL_CHUNK_LENGTH, written chunk by chunk as it arrives
+struct Upload {
+    struct Request request;
+    char *path;
+    // Where a pwrite starts in the file
+    size_t offset;
+    // Bytes of content in the payload and how many of them are taken
+    size_t length;
+    size_t done;
+    // Set while a chunk is written, chunks go one at a time to keep their order
+    int in_flight;
+    // Answer to the frame, the first error or the bytes written by pwrite and append
+    int status;
+    // File created or updated by the first chunk of an add or update, pinned until the upload is freed
+    struct Inode *file;
+};
+
+// Written to by the signal handler, its read end wakes the event loop
+int signal_pipe[2] = {-1, -1};
+volatile sig_atomic_t stop_signal = 0;
+
+// Workers may be in the middle of a command, so the event loop shuts down the way the shutdown command does
 void termination_handler(int signum) {
-    printf("Shutting down: %d\n", signum);
-    shutdown(client_fd, SHUT_RDWR);
-    close(client_fd);
-    close(server_fd);
-    fs_close(&fs);
-    exit(1);
+    stop_signal = signum;
+    char byte = 0;
+    if (write(signal_pipe[1], &byte, 1) < 0) return;
+}
+
+// Reads the whole file or directory listing at path into output, skip bytes past its end, without adding it to
+// the output length. The space comes from fs_size, so a file that grew before fs_read took its lock is read again
+// with its new size. Returns the bytes read, TOO_SMALL_BUFFER for content over limit bytes
+int read_whole(struct Buffer *output, size_t skip, char *path, size_t limit) {
+    int res = TOO_SMALL_BUFFER;
+    for (int attempt = 0; attempt < SERVER_READ_ATTEMPTS && res == TOO_SMALL_BUFFER; attempt++) {
+        int size = fs_size(&fs, path);
+        if (size < 0) return size;
+        if ((size_t) size > limit) return TOO_SMALL_BUFFER;
+        if (buffer_reserve(output, skip + size) < 0) return NO_SPACE;
+        res = fs_read(&fs, path, output->data + output->end + skip, size);
+    }
+    return res;
+}
+
+void send_text(struct Buffer *output, const char *text) {
+    buffer_append(output, text, strlen(text) + 1);
 }
 
-void handle_error(int client_fd, int res) {
+void handle_error(struct Buffer *output, int res) {
     switch (res) {
         case NO_SPACE:
-            send(client_fd, "No space left, file may be too big\n", 36, 0);
+            send_text(output, "No space left, file may be too big\n");
             break;
         case READ_FAILURE:
-            send(client_fd, "Read failure\n", 14, 0);
+            send_text(output, "Read failure\n");
             break;
         case WRITE_FAILURE:
-            send(client_fd, "Write failure, file system may be corrupted\n", 45, 0);
+            send_text(output, "Write failure, file system may be corrupted\n");
             break;
         case TOO_SMALL_BUFFER:
-            send(client_fd, "Technical error: too small buffer\n", 35, 0);
+            send_text(output, "Technical error: too small buffer\n");
             break;
         case WRONG_FILE_TYPE:
-            send(client_fd, "Wrong file type\n", 17, 0);
+            send_text(output, "Wrong file type\n");
             break;
         case NOT_FOUND:
-            send(client_fd, "File not found\n", 16, 0);
+            send_text(output, "File not found\n");
             break;
         case WRONG_INPUT:
-            send(client_fd, "Wrong input\n", 13, 0);
+            send_text(output, "Wrong input\n");
+            break;
+        default:
+            break;
+    }
+}
+
+void handle_result(struct Buffer *output, int res) {
+    if (res < 0) {
+        handle_error(output, res);
+    } else {
+        send_text(output, "OK\n");
+    }
+}
+
+// Appends the counters of the file system in the given stats format, returns the length appended
+int send_stats(struct Buffer *output, int format) {
+    char *text;
+    size_t length;
+    FILE *file = open_memstream(&text, &length);
+    if (file == NULL) return NO_SPACE;
+    stats_dump(&fs.stats, format, file);
+    fclose(file);
+    int res = buffer_append(output, text, length);
+    free(text);
+    if (res < 0) return res;
+    return length;
+}
+
+// Runs one text command
+void execute(struct Buffer *output, char *buffer, size_t bytes_read) {
+    if (strcmp(buffer, "help") == 0) {
+        send_text(output, "add <path> <content> - add file\nadd <path> - add dir\nread <path> - print file or dir\nupdate <path> <content> - update file\nremove <path> - remove file or dir (recursively)\nstats [table|prometheus] - print operation counters and latencies\nshutdown - shutdown server\n/a/b/c/ - example path to dir\n/a/b/c - example path to file\n");
+        return;
+    }
+    if (strcmp(buffer, "stats") == 0 || strncmp(buffer, "stats ", 6) == 0) {
+        int format = buffer[5] == '\0' ? STATS_FORMAT_TABLE : stats_format_by_name(buffer + 6);
+        if (format < 0) {
+            send_text(output, "Unknown stats format\n");
+        } else if (send_stats(output, format) < 0) {
+            handle_error(output, NO_SPACE);
+        }
+        return;
+    }
+
+    size_t first_space;
+    for (first_space = 0; first_space < bytes_read && buffer[first_space] != ' '; first_space++);
+    size_t second_space;
+    for (second_space = first_space + 1; second_space < bytes_read && buffer[second_space] != ' '; second_space++);
+
+    if (first_space == 0 || first_space >= bytes_read) {
+        send_text(output, "Unknown command\n");
+        return;
+    }
+    char *command = buffer;
+    command[first_space] = 0;
+    char *path = buffer + first_space + 1;
+    char *content = buffer + bytes_read;
+    if (second_space < bytes_read) {
+        path[second_space - first_space - 1] = 0;
+        content = buffer + second_space + 1;
+    }
+
+    if (strcmp(command, "read") == 0) {
+        int res = read_whole(output, 0, path, (size_t) -1);
+        if (res < 0) {
+            handle_error(output, res);
+        } else {
+            output->end += res;
+        }
+    } else if (strcmp(command, "add") == 0) {
+        handle_result(output, fs_add(&fs, path, content, strlen(content) + 1));
+    } else if (strcmp(command, "update") == 0) {
+        handle_result(output, fs_update(&fs, path, content, strlen(content) + 1));
+    } else if (strcmp(command, "remove") == 0) {
+        handle_result(output, fs_remove(&fs, path));
+    } else {
+        send_text(output, "Unknown command\n");
+    }
+}
+
+// Appends a response frame, length bytes of payload are taken from payload unless they are already placed
+// after the header space in output
+void send_response(struct Buffer *output, struct Request *request, int status, char *payload, size_t length) {
+    struct Response response = {PROTOCOL_VERSION, request->opcode, request->request_id, status, length};
+    unsigned char header[PROTOCOL_RESPONSE_HEADER_LENGTH];
+    protocol_encode_response(header, &response);
+    if (payload == NULL) {
+        memcpy(output->data + output->end, header, PROTOCOL_RESPONSE_HEADER_LENGTH);
+        output->end += PROTOCOL_RESPONSE_HEADER_LENGTH + length;
+        return;
+    }
+    buffer_append(output, (char *) header, PROTOCOL_RESPONSE_HEADER_LENGTH);
+    buffer_append(output, payload, length);
+}
+
+// Reads straight into output, after the space for the response header
+void send_read_response(struct Buffer *output, struct Request *request, char *path, size_t offset,
+                        size_t length, int whole) {
+    int res;
+    if (whole) {
+        res = read_whole(output, PROTOCOL_RESPONSE_HEADER_LENGTH, path, PROTOCOL_PAYLOAD_LENGTH);
+        if (res >= 0) {
+            send_response(output, request, 0, NULL, res);
+            return;
+        }
+    } else {
+        if (length > PROTOCOL_PAYLOAD_LENGTH) length = PROTOCOL_PAYLOAD_LENGTH;
+        res = NO_SPACE;
+        if (buffer_reserve(output, PROTOCOL_RESPONSE_HEADER_LENGTH + length) == 0) {
+            char *content = output->data + output->end + PROTOCOL_RESPONSE_HEADER_LENGTH;
+            res = fs_pread(&fs, path, content, length, offset);
+        }
+        if (res >= 0) {
+            send_response(output, request, res, NULL, res);
+            return;
+        }
+    }
+    send_response(output, request, res, "", 0);
+}
+
+// Runs one binary request
+void execute_frame(struct Buffer *output, struct Request *request, char *path, char *payload) {
+    size_t length = request->payload_length;
+    // Kept for unknown opcodes and malformed payloads
+    int res = WRONG_INPUT;
+    switch (request->opcode) {
+        case OP_READ:
+            send_read_response(output, request, path, 0, 0, 1);
+            return;
+        case OP_PREAD:
+            if (length != 16) break;
+            send_read_response(output, request, path, protocol_get_u64((unsigned char *) payload),
+                               protocol_get_u64((unsigned char *) payload + 8), 0);
+            return;
+        case OP_ADD:
+            res = fs_add(&fs, path, payload, length);
+            break;
+        case OP_UPDATE:
+            res = fs_update(&fs, path, payload, length);
+            break;
+        case OP_REMOVE:
+            res = fs_remove(&fs, path);
+            break;
+        case OP_SIZE:
+            res = fs_size(&fs, path);
+            break;
+        case OP_PWRITE:
+            if (length < 8) break;
+            res = fs_pwrite(&fs, path, payload + 8, length - 8, protocol_get_u64((unsigned char *) payload));
             break;
+        case OP_APPEND:
+            res = fs_append(&fs, path, payload, length);
+            break;
+        case OP_TRUNCATE:
+            if (length != 8) break;
+            res = fs_truncate(&fs, path, protocol_get_u64((unsigned char *) payload));
+            break;
+        case OP_STATS: {
+            res = stats_format_by_name(path);
+            if (res < 0) break;
+            // The header goes in front of the text once its length is known
+            size_t header_end = output->end;
+            if (buffer_reserve(output, PROTOCOL_RESPONSE_HEADER_LENGTH) < 0) {
+                res = NO_SPACE;
+                break;
+            }
+            output->end += PROTOCOL_RESPONSE_HEADER_LENGTH;
+            res = send_stats(output, res);
+            output->end = header_end;
+            if (res < 0) break;
+            send_response(output, request, 0, NULL, res);
+            return;
+        }
+        default:
+            break;
+    }
+    send_response(output, request, res, "", 0);
+}
+
+// Writes from data, or from the image at image_offset when data is NULL, waiting while the socket is full.
+// MSG_MORE in flags holds data back until the rest of the reply follows
+int send_blocking(int fd, const char *data, size_t image_offset, size_t length, int flags) {
+    off_t offset = image_offset;
+    while (length > 0) {
+        ssize_t bytes_sent;
+        if (data != NULL) {
+            bytes_sent = send(fd, data, length, MSG_NOSIGNAL | flags);
+        } else {
+            bytes_sent = sendfile(fd, fs.io.fd, &offset, length);
+        }
+        if (bytes_sent > 0) {
+            if (data != NULL) data += bytes_sent;
+            length -= bytes_sent;
+            continue;
+        }
+        if (bytes_sent == 0) return -1;
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+
+        struct pollfd poll_fd = {fd, POLLOUT, 0};
+        int res = poll(&poll_fd, 1, SERVER_SEND_TIMEOUT);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return -1;
+    }
+    return 0;
+}
+
+// Streams a file whose blocks are contiguous straight from the image to the socket, without copying it
+// through user space. Returns 0 if the file has to go the buffered way
+int send_file(struct Job *job, char *path) {
+    struct Inode *inode;
+    size_t image_offset;
+    int length = fs_lock_extent(&fs, path, &inode, &image_offset);
+    if (length < 0) return 0;
+
+    int fd = job->connection->fd;
+    int res = 0;
+    if (job->binary) {
+        struct Response response = {PROTOCOL_VERSION, job->request.opcode, job->request.request_id, 0, length};
+        unsigned char header[PROTOCOL_RESPONSE_HEADER_LENGTH];
+        protocol_encode_response(header, &response);
+        res = send_blocking(fd, (char *) header, 0, PROTOCOL_RESPONSE_HEADER_LENGTH, MSG_MORE);
+    }
+    if (res == 0) res = send_blocking(fd, NULL, image_offset, length, 0);
+    fs_unlock_extent(&fs, inode);
+    if (res < 0) job->failed = 1;
+    return 1;
+}
+
+// Writes one chunk of a streamed payload. The first one of add and update creates or replaces the file and pins it,
+// the others go to that file even if the path is removed or added again meanwhile. A failed update keeps the chunks
+// written before the error
+int execute_chunk(struct Job *job) {
+    char *path = job->message;
+    size_t length = job->request.payload_length;
+    int res;
+    switch (job->request.opcode) {
+        case OP_ADD:
+            if (job->offset == 0) return fs_add_pinned(&fs, path, job->payload, length, &job->file);
+            res = fs_pwrite_pinned(&fs, job->file, job->payload, length, job->offset);
+            // Like a buffered add, a failed one leaves no file behind. Only the file it added is removed
+            if (res < 0) fs_remove_pinned(&fs, path, job->file);
+            return res;
+        case OP_UPDATE:
+            if (job->offset == 0) return fs_update_pinned(&fs, path, job->payload, length, &job->file);
+            return fs_pwrite_pinned(&fs, job->file, job->payload, length, job->offset);
+        case OP_APPEND:
+            return fs_append(&fs, path, job->payload, length);
         default:
             break;
     }
+    return fs_pwrite(&fs, path, job->payload, length, job->offset);
+}
+
+// Runs on a worker thread
+void run_job(struct Work *work) {
+    struct Job *job = (struct Job *) work;
+    if (job->chunk) {
+        job->status = execute_chunk(job);
+        return;
+    }
+    // Text reads are "read <path>", checked before submitting
+    if (job->exclusive && send_file(job, job->binary ? job->message : job->message + 5)) return;
+
+    if (job->binary) {
+        if (job->message_length == 0) {
+            send_response(&job->output, &job->request, WRONG_INPUT, "", 0);
+        } else {
+            execute_frame(&job->output, &job->request, job->message, job->payload);
+        }
+    } else {
+        execute(&job->output, job->message, job->message_length);
+    }
+}
+
+void free_job(struct Job *job) {
+    free(job->message);
+    free(job->payload);
+    buffer_free(&job->output);
+    free(job);
+}
+
+// Copies a command out of the input buffer into a new job
+struct Job *new_job(struct Connection *connection, int binary, struct Request *request, char *message,
+                    size_t message_length, char *payload, size_t payload_length) {
+    struct Job *job = calloc(1, sizeof(struct Job));
+    if (job == NULL) return NULL;
+    job->work.execute = run_job;
+    job->connection = connection;
+    job->binary = binary;
+    if (request != NULL) job->request = *request;
+    job->message = malloc(message_length + 1);
+    job->payload = malloc(payload_length > 0 ? payload_length : 1);
+    buffer_init(&job->output);
+    if (job->message == NULL || job->payload == NULL) {
+        free_job(job);
+        return NULL;
+    }
+    memcpy(job->message, message, message_length);
+    job->message[message_length] = 0;
+    job->message_length = message_length;
+    if (payload_length > 0) memcpy(job->payload, payload, payload_length);
+    return job;
+}
+
+void resume_later(struct Connection *connection) {
+    if (connection->resume_idx != CONNECTION_NOT_RESUMED) return;
+    connection->resume_idx = resumed_number;
+    resumed[resumed_number] = connection;
+    resumed_number++;
+}
+
+void resume_cancel(struct Connection *connection) {
+    if (connection->resume_idx == CONNECTION_NOT_RESUMED) return;
+    resumed_number--;
+    resumed[connection->resume_idx] = resumed[resumed_number];
+    resumed[connection->resume_idx]->resume_idx = connection->resume_idx;
+    connection->resume_idx = CONNECTION_NOT_RESUMED;
+}
+
+// Hands a job to the workers. Fails when the queue is full, the command then stays in the input buffer and
+// the connection stops reading until work completes
+int submit_job(struct Connection *connection, struct Job *job) {
+    if (job == NULL) return -1;
+    if (workers_submit(&workers, &job->work) < 0) {
+        free_job(job);
+        connection->stalled = 1;
+        resume_later(connection);
+        return -1;
+    }
+    connection->pending++;
+    if (job->exclusive) connection->exclusive = 1;
+    return 0;
+}
+
+// Queues every complete text command in the input buffer. Commands end with '\n' from terminals or '\0'
+// from task2_client. Text replies carry no id, so commands run one at a time in order.
+// Returns 0 if the server has to shut down
+int process_text(struct Connection *connection) {
+    struct Buffer *input = &connection->input;
+    while (!connection->closing && connection->pending == 0 && buffer_length(input) > 0) {
+        char *message = input->data + input->begin;
+        size_t length = 0;
+        while (length < buffer_length(input) && message[length] != '\n' && message[length] != '\0') length++;
+        if (length == buffer_length(input)) {
+            if (length >= SERVER_MESSAGE_LENGTH) {
+                send_text(&connection->output, "Message is too long!\n");
+                connection->closing = 1;
+            }
+            break;
+        }
+
+        size_t bytes_read = length;
+        if (bytes_read > 0 && message[bytes_read - 1] == '\r') bytes_read--;
+        if (bytes_read == 8 && memcmp(message, "shutdown", 8) == 0) {
+            send_text(&connection->output, "Exiting...\n");
+            buffer_consume(input, length + 1);
+            return 0;
+        }
+        // A read with nothing queued before it may be streamed to the socket by the worker
+        struct Job *job = new_job(connection, 0, NULL, message, bytes_read, NULL, 0);
+        if (job != NULL) {
+            job->exclusive = buffer_length(&connection->output) == 0 && bytes_read > 5 &&
+                             memcmp(message, "read ", 5) == 0 && memchr(message + 5, ' ', bytes_read - 5) == NULL;
+        }
+        if (submit_job(connection, job) < 0) break;
+        buffer_consume(input, length + 1);
+    }
+    // Stop reading until the answer is sent, the next command is taken then
+    if (connection->pending > 0) connection->stalled = 1;
+    return 1;
+}
+
+int is_streamed(struct Request *request) {
+    if (request->payload_length <= PROTOCOL_CHUNK_LENGTH) return 0;
+    return request->opcode == OP_ADD || request->opcode == OP_UPDATE || request->opcode == OP_PWRITE ||
+           request->opcode == OP_APPEND;
+}
+
+// Takes the start of a streamed frame, the payload is then written chunk by chunk by continue_upload.
+// Returns 0 while the frame start is incomplete
+int start_upload(struct Connection *connection, struct Request *request) {
+    struct Buffer *input = &connection->input;
+    size_t offset_length = request->opcode == OP_PWRITE ? 8 : 0;
+    size_t prefix_length = PROTOCOL_REQUEST_HEADER_LENGTH + request->path_length + offset_length;
+    if (buffer_length(input) < prefix_length) return 0;
+
+    struct Upload *upload = malloc(sizeof(struct Upload));
+    char *path = malloc(request->path_length + 1);
+    if (upload == NULL || path == NULL) {
+        free(upload);
+        free(path);
+        send_response(&connection->output, request, NO_SPACE, "", 0);
+        connection->closing = 1;
+        return 0;
+    }
+    char *frame = input->data + input->begin;
+    memcpy(path, frame + PROTOCOL_REQUEST_HEADER_LENGTH, request->path_length);
+    path[request->path_length] = 0;
+    upload->request = *request;
+    upload->path = path;
+    upload->offset = 0;
+    if (offset_length > 0) {
+        upload->offset = protocol_get_u64((unsigned char *) frame + PROTOCOL_REQUEST_HEADER_LENGTH +
+                                          request->path_length);
+    }
+    upload->length = request->payload_length - offset_length;
+    upload->done = 0;
+    upload->in_flight = 0;
+    upload->status = request->path_length == 0 ? WRONG_INPUT : 0;
+    upload->file = NULL;
+    buffer_consume(input, prefix_length);
+    connection->upload = upload;
+    return 1;
+}
+
+void free_upload(struct Upload *upload) {
+    if (upload == NULL) return;
+    if (upload->file != NULL) fs_unpin(&fs, upload->file);
+    free(upload->path);
+    free(upload);
+}
+
+// Hands the next chunk of the streamed payload to the workers once it has arrived, one chunk at a time so
+// they are written in order. Answers the frame after the last one. Returns 0 while waiting
+int continue_upload(struct Connection *connection) {
+    struct Upload *upload = connection->upload;
+    if (upload->in_flight) return 0;
+    if (upload->done == upload->length) {
+        send_response(&connection->output, &upload->request, upload->status, "", 0);
+        free_upload(upload);
+        connection->upload = NULL;
+        return 1;
+    }
+
+    struct Buffer *input = &connection->input;
+    size_t length = upload->length - upload->done;
+    if (length > PROTOCOL_CHUNK_LENGTH) length = PROTOCOL_CHUNK_LENGTH;
+    if (buffer_length(input) < length) return 0;
+    // The rest of a failed upload is skipped
+    if (upload->status >= 0) {
+        struct Request chunk = upload->request;
+        chunk.payload_length = length;
+        size_t offset = upload->request.opcode == OP_PWRITE ? upload->offset + upload->done : upload->done;
+        struct Job *job = new_job(connection, 1, &chunk, upload->path, strlen(upload->path),
+                                  input->data + input->begin, length);
+        if (job != NULL) {
+            job->chunk = 1;
+            job->offset = offset;
+            job->file = upload->file;
+        }
+        if (submit_job(connection, job) < 0) return 0;
+        upload->in_flight = 1;
+    }
+    buffer_consume(input, length);
+    upload->done += length;
+    return 1;
+}
+
+// Queues every complete frame in the input buffer, returns 0 if the server has to shut down
+int process_frames(struct Connection *connection) {
+    struct Buffer *input = &connection->input;
+    while (!connection->closing && !connection->exclusive) {
+        if (connection->upload != NULL) {
+            if (!continue_upload(connection)) break;
+            continue;
+        }
+        if (buffer_length(input) < PROTOCOL_REQUEST_HEADER_LENGTH) break;
+
+        struct Request request;
+        int res = protocol_decode_request((unsigned char *) input->data + input->begin, &request);
+        if (res >= 0 && request.payload_length > PROTOCOL_CHUNK_LENGTH && !is_streamed(&request)) {
+            res = WRONG_INPUT;
+        }
+        if (res < 0) {
+            send_response(&connection->output, &request, res, "", 0);
+            connection->closing = 1;
+            break;
+        }
+        if (is_streamed(&request)) {
+            if (!start_upload(connection, &request)) break;
+            continue;
+        }
+
+        size_t frame_length = PROTOCOL_REQUEST_HEADER_LENGTH + request.path_length + request.payload_length;
+        if (buffer_length(input) < frame_length) break;
+
+        char *frame = input->data + input->begin;
+        if (request.opcode == OP_SHUTDOWN) {
+            send_response(&connection->output, &request, 0, "", 0);
+            buffer_consume(input, frame_length);
+            return 0;
+        }
+        struct Job *job = new_job(connection, 1, &request, frame + PROTOCOL_REQUEST_HEADER_LENGTH,
+                                  request.path_length, frame + PROTOCOL_REQUEST_HEADER_LENGTH + request.path_length,
+                                  request.payload_length);
+        if (job != NULL) {
+            job->exclusive = request.opcode == OP_READ && connection->pending == 0 &&
+                             buffer_length(&connection->output) == 0;
+        }
+        if (submit_job(connection, job) < 0) break;
+        buffer_consume(input, frame_length);
+    }
+    // Nothing is taken while a worker writes to the socket or while the input is full
+    if (connection->exclusive || buffer_length(input) >= SERVER_INPUT_LIMIT) connection->stalled = 1;
+    return 1;
+}
+
+int process_input(struct Connection *connection) {
+    struct Buffer *input = &connection->input;
+    if (connection->mode == CONNECTION_MODE_UNKNOWN && buffer_length(input) > 0) {
+        unsigned char first = input->data[input->begin];
+        connection->mode = first == PROTOCOL_MAGIC ? CONNECTION_MODE_BINARY : CONNECTION_MODE_TEXT;
+    }
+    connection->stalled = 0;
+    int running;
+    if (connection->mode == CONNECTION_MODE_BINARY) {
+        running = process_frames(connection);
+    } else {
+        running = process_text(connection);
+    }
+    // A client that stopped sending is closed once every command it sent is answered
+    if (connection->eof && connection->pending == 0 && !connection->stalled) connection->closing = 1;
+    return running;
+}
+
+void accept_connections() {
+    while (1) {
+        int client_fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) printf("Could not establish new connection\n");
+            return;
+        }
+
+        if (connections_number >= MAX_CONNECTIONS) {
+            send(client_fd, "Too many connections\n", 22, MSG_NOSIGNAL);
+            close(client_fd);
+            continue;
+        }
+        struct Connection *connection = connection_open(epoll_fd, client_fd);
+        if (connection == NULL) {
+            close(client_fd);
+            continue;
+        }
+        connection->idx = connections_number;
+        connections[connections_number] = connection;
+        connections_number++;
+    }
+}
+
+void drop_connection(struct Connection *connection) {
+    resume_cancel(connection);
+    // A chunk being written still uses the pinned file, the upload is freed once it completes
+    if (connection->upload != NULL && !connection->upload->in_flight) {
+        free_upload(connection->upload);
+        connection->upload = NULL;
+    }
+    connections_number--;
+    connections[connection->idx] = connections[connections_number];
+    connections[connection->idx]->idx = connection->idx;
+    connection_close(epoll_fd, connection);
+}
+
+// Serves one ready connection, returns 0 if the server has to shut down
+int serve_connection(struct Connection *connection, unsigned int events) {
+    int running = 1;
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        if (connection_receive(connection, SERVER_INPUT_LIMIT) <= 0) connection->eof = 1;
+        running = process_input(connection);
+    }
+    if (connection_flush(epoll_fd, connection) <= 0) drop_connection(connection);
+    return running;
+}
+
+// Hands finished replies to their connections
+void complete_jobs(struct Work *work) {
+    while (work != NULL) {
+        struct Job *job = (struct Job *) work;
+        work = work->next;
+
+        struct Connection *connection = job->connection;
+        connection->pending--;
+        if (job->exclusive) connection->exclusive = 0;
+        // The client got part of a reply, the stream can not be resumed
+        if (job->failed) connection->closing = 1;
+        if (job->chunk) {
+            struct Upload *upload = connection->upload;
+            upload->in_flight = 0;
+            if (upload->file == NULL) upload->file = job->file;
+        }
+        if (connection->closed) {
+            if (job->chunk) {
+                free_upload(connection->upload);
+                connection->upload = NULL;
+            }
+            if (connection->pending == 0) connection_close(epoll_fd, connection);
+        } else if (job->chunk) {
+            struct Upload *upload = connection->upload;
+            if (job->status < 0) {
+                if (upload->status >= 0) upload->status = job->status;
+            } else if (upload->status >= 0 && (job->request.opcode == OP_PWRITE || job->request.opcode == OP_APPEND)) {
+                upload->status += job->status;
+            }
+        } else {
+            connection_send(connection, job->output.data + job->output.begin, buffer_length(&job->output));
+        }
+        if (!connection->closed) resume_later(connection);
+        free_job(job);
+    }
+}
+
+// Resumes connections after work completed: those that got replies and any that found the queue full.
+// The list is taken first, connections stalling on a full queue again wait for the next completions.
+// Returns 0 if the server has to shut down
+int resume_connections() {
+    struct Connection *resuming[MAX_CONNECTIONS];
+    size_t resuming_number = resumed_number;
+    for (size_t i = 0; i < resuming_number; i++) {
+        resuming[i] = resumed[i];
+        resuming[i]->resume_idx = CONNECTION_NOT_RESUMED;
+    }
+    resumed_number = 0;
+
+    int running = 1;
+    for (size_t i = 0; i < resuming_number && running; i++) {
+        struct Connection *connection = resuming[i];
+        running = process_input(connection);
+        if (connection_flush(epoll_fd, connection) <= 0) drop_connection(connection);
+    }
+    return running;
 }
 
 int main (int argc, char *argv[]) {
     if (argc < 2) {
-        printf("Use: %s [filename] [port]\n", argv[0]);
+        printf("Use: %s [filename] [port] [pread|stdio|mmap|uring] [workers] [queue depth] [trace file]\n", argv[0]);
+        return 1;
+    }
+
+    int engine = IO_ENGINE_PREAD;
+    if (argc > 3) {
+        engine = io_engine_by_name(argv[3]);
+        if (engine < 0) {
+            printf("Unknown I/O engine: %s\n", argv[3]);
+            return 1;
+        }
+    }
+
+    long threads_number = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 4) threads_number = atol(argv[4]);
+    long queue_depth = WORKERS_QUEUE_DEPTH;
+    if (argc > 5) queue_depth = atol(argv[5]);
+    if (threads_number <= 0 || queue_depth <= 0) {
+        printf("Wrong number of workers or queue depth\n");
         return 1;
     }
+    // Image accesses are recorded from the start and written out for minifs_trace on shutdown
+    if (argc > 6) {
+        trace_filename = argv[6];
+        trace_start(0);
+    }
 
     pid_t pid;
 
@@ -64,9 +813,6 @@ int main (int argc, char *argv[]) {
     if (pid > 0) return 0;
     if (setsid() < 0) return 1;
 
-    signal(SIGINT, termination_handler);
-    signal(SIGTERM, termination_handler);
-
     pid = fork();
 
     if (pid < 0) return 1;
@@ -74,16 +820,14 @@ int main (int argc, char *argv[]) {
 
     umask(0);
 
-    fs_open(&fs, argv[1]);
+    fs_open_engine(&fs, argv[1], engine);
 
     int port = atoi(argv[2]);
 
     int res;
-    struct sockaddr_in server, client;
-    const size_t buffer_size = 8192;
-    char buffer[buffer_size];
+    struct sockaddr_in server;
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (server_fd < 0) {
         printf("Could not create socket\n");
         return 1;
@@ -108,108 +852,82 @@ int main (int argc, char *argv[]) {
         return 1;
     }
 
-    printf("Server is listening on %d\n", port);
-
-    while (1) {
-        socklen_t client_len = sizeof(client);
-        client_fd = accept(server_fd, (struct sockaddr *) &client, &client_len);
-
-        if (client_fd < 0) {
-            printf("Could not establish new connection\n");
-            continue;
-        }
-
-        size_t bytes_read = 0;
-
-        while (1) {
-            bytes_read = recv(client_fd, buffer, buffer_size, 0);
-            if (bytes_read >= buffer_size) {
-                send(client_fd, "Message is too long!\n", 22, 0);
-                close(client_fd);
-                break;
-            }
-            if (!bytes_read) break;
-            if (bytes_read < 0) {
-                printf("Client read failed\n");
-                continue;
-            }
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        printf("Could not create epoll instance\n");
+        return 1;
+    }
+    struct epoll_event server_event;
+    server_event.events = EPOLLIN;
+    server_event.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &server_event);
 
-            if (buffer[bytes_read - 2] == '\r') {
-                buffer[bytes_read - 2] = 0;
-                bytes_read -= 2;
-            }
+    if (workers_start(&workers, threads_number, queue_depth) < 0) {
+        printf("Could not start workers\n");
+        return 1;
+    }
+    struct epoll_event workers_event;
+    workers_event.events = EPOLLIN;
+    workers_event.data.ptr = &workers;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, workers.event_fd, &workers_event);
 
-            if (strcmp(buffer, "shutdown") == 0) {
-                send(client_fd, "Exiting...\n", 12, 0);
-                shutdown(client_fd, SHUT_RDWR);
-                close(client_fd);
-                close(server_fd);
-                fs_close(&fs);
-                return 0;
-            } else if (strcmp(buffer, "help") == 0) {
-                send(client_fd, "add <path> <content> - add file\nadd <path> - add dir\nread <path> - print file or dir\nupdate <path> <content> - update file\nremove <path> - remove file or dir (recursively)\nshutdown - shutdown server\n/a/b/c/ - example path to dir\n/a/b/c - example path to file\n", 260, 0);
-                continue;
-            }
+    if (pipe2(signal_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        printf("Could not create signal pipe\n");
+        return 1;
+    }
+    struct epoll_event signal_event;
+    signal_event.events = EPOLLIN;
+    signal_event.data.ptr = signal_pipe;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_pipe[0], &signal_event);
+    signal(SIGINT, termination_handler);
+    signal(SIGTERM, termination_handler);
 
-            size_t first_space;
-            for (first_space = 0; buffer[first_space] != ' ' && first_space < bytes_read; first_space++);
-            size_t second_space;
-            for (second_space = first_space + 1; buffer[second_space] != ' ' && second_space < bytes_read; second_space++);
+    printf("Server is listening on %d\n", port);
 
-            if (first_space == 0) {
-                send(client_fd, "Unknown command\n", 30, 0);
-                continue;
-            }
+    struct epoll_event events[SERVER_EVENTS_NUMBER];
+    int running = 1;
+    while (running) {
+        int events_number = epoll_wait(epoll_fd, events, SERVER_EVENTS_NUMBER, -1);
+        if (events_number < 0) {
+            if (errno == EINTR) continue;
+            printf("Could not wait for events\n");
+            break;
+        }
 
-            if (second_space == 0) second_space = bytes_read;
-
-            char* command = malloc(first_space + 1);
-            memcpy(command, buffer, first_space);
-            command[first_space] = 0;
-
-            char* path = malloc(second_space - first_space + 1);
-            memcpy(path, buffer + first_space + 1, second_space - first_space - 1);
-            path[second_space - first_space - 1] = 0;
-
-            if (strcmp(command, "read") == 0) {
-                int size = fs_size(&fs, path);
-                if (size >= 0) {
-                    char* content = malloc(size);
-                    handle_error(client_fd, fs_read(&fs, path, content, size));
-                    send(client_fd, content, size, 0);
-                    free(content);
-                } else {
-                    handle_error(client_fd, size);
-                }
-            } else if (strcmp(command, "add") == 0) {
-                res = fs_add(&fs, path, buffer + second_space + 1, strlen(buffer + second_space + 1) + 1);
-                if (res < 0) {
-                    handle_error(client_fd, res);
-                } else {
-                    send(client_fd, "OK\n", 4, 0);
-                }
-            } else if (strcmp(command, "update") == 0) {
-                res = fs_update(&fs, path, buffer + second_space + 1, strlen(buffer + second_space + 1) + 1);
-                if (res < 0) {
-                    handle_error(client_fd, res);
-                } else {
-                    send(client_fd, "OK\n", 4, 0);
-                }
-            } else if (strcmp(command, "remove") == 0) {
-                res = fs_remove(&fs, path);
-                if (res < 0) {
-                    handle_error(client_fd, res);
-                } else {
-                    send(client_fd, "OK\n", 4, 0);
-                }
+        int completed = 0;
+        for (int i = 0; i < events_number && running; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_connections();
+            } else if (events[i].data.ptr == signal_pipe) {
+                printf("Shutting down: %d\n", (int) stop_signal);
+                running = 0;
+            } else if (events[i].data.ptr == &workers) {
+                completed = 1;
             } else {
-                send(client_fd, "Unknown command\n", 17, 0);
+                running = serve_connection(events[i].data.ptr, events[i].events);
             }
-
-            free(path);
-            free(command);
+        }
+        // Resuming may drop any connection, so it waits until no event of this batch refers to one
+        if (running && completed) {
+            complete_jobs(workers_completed(&workers));
+            running = resume_connections();
         }
     }
 
+    // Answers every command taken before the shutdown
+    complete_jobs(workers_stop(&workers));
+    while (connections_number > 0) {
+        struct Connection *connection = connections[connections_number - 1];
+        connection_flush(epoll_fd, connection);
+        shutdown(connection->fd, SHUT_RDWR);
+        drop_connection(connection);
+    }
+    close(epoll_fd);
+    close(server_fd);
+    close(signal_pipe[0]);
+    close(signal_pipe[1]);
+    fs_close(&fs);
+    if (trace_filename != NULL && trace_dump(trace_filename) < 0) printf("Could not write trace\n");
+    trace_free();
     return 0;
-}
\ No newline at end of file
+}
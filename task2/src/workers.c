@@ -0,0 +1,118 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "workers.h"
+
+static void *workers_loop(void *arg) {
+    struct WorkerPool *pool = arg;
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        while (pool->queue_length == 0 && !pool->stopping) pthread_cond_wait(&pool->not_empty, &pool->mutex);
+        if (pool->queue_length == 0) break;
+
+        struct Work *work = pool->queue[pool->queue_begin];
+        pool->queue_begin = (pool->queue_begin + 1) % pool->queue_capacity;
+        pool->queue_length--;
+        pthread_mutex_unlock(&pool->mutex);
+
+        work->execute(work);
+
+        pthread_mutex_lock(&pool->mutex);
+        work->next = NULL;
+        if (pool->completed_tail != NULL) {
+            pool->completed_tail->next = work;
+        } else {
+            pool->completed_head = work;
+        }
+        pool->completed_tail = work;
+        uint64_t one = 1;
+        write(pool->event_fd, &one, sizeof(one));
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+int workers_start(struct WorkerPool *pool, size_t threads_number, size_t queue_capacity) {
+    if (threads_number == 0 || queue_capacity == 0) return -1;
+    pool->threads = calloc(threads_number, sizeof(pthread_t));
+    pool->queue = calloc(queue_capacity, sizeof(struct Work *));
+    pool->queue_capacity = queue_capacity;
+    pool->queue_begin = 0;
+    pool->queue_length = 0;
+    pool->completed_head = NULL;
+    pool->completed_tail = NULL;
+    pool->stopping = 0;
+    pool->threads_number = 0;
+    pool->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    if (pool->threads == NULL || pool->queue == NULL || pool->event_fd < 0) {
+        workers_stop(pool);
+        return -1;
+    }
+
+    for (size_t i = 0; i < threads_number; i++) {
+        if (pthread_create(&pool->threads[i], NULL, workers_loop, pool) != 0) {
+            workers_stop(pool);
+            return -1;
+        }
+        pool->threads_number++;
+    }
+    return 0;
+}
+
+// Queues work for the threads, fails without blocking when the queue is full
+int workers_submit(struct WorkerPool *pool, struct Work *work) {
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->queue_length == pool->queue_capacity) {
+        pthread_mutex_unlock(&pool->mutex);
+        return -1;
+    }
+    pool->queue[(pool->queue_begin + pool->queue_length) % pool->queue_capacity] = work;
+    pool->queue_length++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+// Takes the list of works finished since the last call, in completion order
+struct Work *workers_completed(struct WorkerPool *pool) {
+    uint64_t count;
+    read(pool->event_fd, &count, sizeof(count));
+
+    pthread_mutex_lock(&pool->mutex);
+    struct Work *works = pool->completed_head;
+    pool->completed_head = NULL;
+    pool->completed_tail = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+    return works;
+}
+
+// Runs the queued works to the end and stops the threads, returns works finished since the last
+// workers_completed
+struct Work *workers_stop(struct WorkerPool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+    for (size_t i = 0; i < pool->threads_number; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    free(pool->threads);
+    free(pool->queue);
+    pool->threads = NULL;
+    pool->queue = NULL;
+    pool->threads_number = 0;
+    if (pool->event_fd >= 0) close(pool->event_fd);
+    pool->event_fd = -1;
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->not_empty);
+
+    struct Work *works = pool->completed_head;
+    pool->completed_head = NULL;
+    pool->completed_tail = NULL;
+    return works;
+}
@@ -0,0 +1,45 @@
+#ifndef TASK2_WORKERS_H
+#define TASK2_WORKERS_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#ifndef WORKERS_QUEUE_DEPTH
+#define WORKERS_QUEUE_DEPTH 1024
+#endif
+
+// Unit of work, embedded as the first member of the caller's own job struct
+struct Work {
+    void (*execute)(struct Work *work);
+    struct Work *next;
+};
+
+// Fixed set of threads running works from a bounded queue. Finished works are collected on a list and
+// announced on an eventfd, so an event loop can pick them up
+struct WorkerPool {
+    pthread_t *threads;
+    size_t threads_number;
+
+    struct Work **queue;
+    size_t queue_capacity;
+    size_t queue_begin;
+    size_t queue_length;
+
+    struct Work *completed_head;
+    struct Work *completed_tail;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    int event_fd;
+    int stopping;
+};
+
+int workers_start(struct WorkerPool *pool, size_t threads_number, size_t queue_capacity);
+
+int workers_submit(struct WorkerPool *pool, struct Work *work);
+
+struct Work *workers_completed(struct WorkerPool *pool);
+
+struct Work *workers_stop(struct WorkerPool *pool);
+
+#endif //TASK2_WORKERS_H